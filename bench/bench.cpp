@@ -0,0 +1,730 @@
+#include "xForm.h"
+
+// headless streaming benchmark of xMegaTexture: no window and no device are created,
+// the layer windows follow a camera path through UpdateLayer and GetTextureRect
+//
+// it is a Win32 console program, not a Linux one: xForm.h pulls in D3DX9 for the math and
+// texture types, the archive is read with CreateFile/ReadFile or MapViewOfFile, the image pool
+// lives in VirtualAlloc and xThread runs on Win32 threads, and the tree ships MSVC projects only.
+// nothing here needs a GPU or a window though
+//
+// bench [-make size | -mega prefix] [-path file] [options]
+//   -make size      builds a synthetic size x size megatexture to bench-<size>/mega first
+//   -mega prefix    uses an existing archive
+//   -bc1, -border n, -codec raw|lz|delta, -tolerance n   the format of -make
+//   -planes n       -make adds a linear BGR plane and a linear L8 one to the colors (1..3)
+//   -path file      replays "time x y" lines, positions are in mip 0 clusters,
+//                   the demo records them with -record file
+//   -speed n        clusters per second of the scripted circle if there is no path (16)
+//   -frames n, -fps n           frames to run (1000) and the simulated frame rate (60)
+//   -layers n, -layer n         mips and window size in clusters (7, 8)
+//   -budget mb, -threads n, -mapped, -sync, -realtime
+//   -pages n        runs the page table mode too, with a pool of n x n pages fed by the tiles
+//                   a top down camera would see, every mip in a ring twice as far as the finer one
+//   -csv file       appends the results as a row, the header is written to a new file
+//   -stats file     writes the per frame streaming statistics, JSON if the file ends with .json
+//   -check          runs the self checks below and exits, 1 if any of them fails
+
+enum
+{
+  BENCH_PREFETCH_FRAMES = 30
+};
+
+struct BenchOptions
+{
+  xString megaPrefix;
+  int makeSize;
+  int format;
+  int border;
+  int codec;
+  int tolerance;
+  int planesNumber;
+  xString pathFilename;
+  float speed;
+  int frames;
+  float fps;
+  int layersNumber;
+  int layerSize;
+  int budget;
+  int threadsNumber;
+  int pagePoolSize;
+  int initFlags;
+  bool isRealtime;
+  xString csvFilename;
+  xString statsFilename;
+
+  BenchOptions()
+  {
+    makeSize = 0;
+    format = xMegaTexture::FORMAT_BGR24;
+    border = 0;
+    codec = xClusterCodec::CODEC_RAW;
+    tolerance = 0;
+    planesNumber = 1;
+    speed = 16.0f;
+    frames = 1000;
+    fps = 60.0f;
+    layersNumber = 7;
+    layerSize = 8;
+    budget = 64;
+    threadsNumber = 0;
+    pagePoolSize = 0;
+    initFlags = xMegaTexture::INIT_ASYNC;
+    isRealtime = false;
+  }
+};
+
+struct BenchPathPoint
+{
+  float time;
+  xVec2 pos;
+};
+
+struct BenchResults
+{
+  int frames;
+  double seconds;
+  int loads;
+  uint64 bytesRead;
+  double p50, p99, maxLatency; // milliseconds of UpdateLayer and GetTextureRect per frame
+  double hitRate;
+  int evictions;
+  int cancels;
+  uint32 peakCacheBytes;
+  uint32 peakHeapBytes;
+  uint32 peakPoolBytes;
+  int pagesUploaded;
+};
+
+static double TimerSeconds()
+{
+  static LARGE_INTEGER freq = { 0 };
+  if(!freq.QuadPart)
+  {
+    QueryPerformanceFrequency(&freq);
+  }
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)freq.QuadPart;
+}
+
+static uint32 HeapBytes()
+{
+  xHeap::SummaryStats stats;
+  xHeap::Instance()->GetStats(stats);
+  return stats.allocSize;
+}
+
+// =================================================================
+
+// smooth color waves with detail noise and a grid, so the codecs see something like a terrain texture
+static bool MakeSyntheticImage(const xString& filename, int size)
+{
+  FILE * f;
+  errno_t err = _tfopen_s(&f, filename.ToChar(), _T("wb"));
+  if(err != 0)
+  {
+    return false;
+  }
+  byte header[18];
+  MEMSET(header, 0, sizeof(header));
+  header[2] = 2; // true color
+  header[12] = (byte)size;
+  header[13] = (byte)(size >> 8);
+  header[14] = (byte)size;
+  header[15] = (byte)(size >> 8);
+  header[16] = 24;
+  header[17] = 0x20; // top-down
+  bool isOk = fwrite(header, sizeof(header), 1, f) == 1;
+
+  xArray<byte> row;
+  row.SetCount(3 * size);
+  dword seed = 12345;
+  for(int y = 0; y < size && isOk; y++)
+  {
+    for(int x = 0; x < size; x++)
+    {
+      seed = seed * 1664525 + 1013904223;
+      int noise = (int)(seed >> 28) - 8;
+      float fx = (float)x / size * 23.0f, fy = (float)y / size * 17.0f;
+      float wave = xMath::Sin(fx + xMath::Sin(fy * 0.7f) * 2.0f) * xMath::Cos(fy - fx * 0.3f);
+      int line = (x % 512) < 2 || (y % 512) < 2 ? 60 : 0;
+      int base = (int)(wave * 60.0f) + noise;
+      row[3*x + 0] = (byte)Min(Max(90 + base / 2 + line, 0), 255);
+      row[3*x + 1] = (byte)Min(Max(120 + base + line, 0), 255);
+      row[3*x + 2] = (byte)Min(Max(100 - base / 2 + line, 0), 255);
+    }
+    isOk = fwrite(row.Ptr(), row.Count(), 1, f) == 1;
+  }
+  fclose(f);
+  return isOk;
+}
+
+static bool LoadPath(const xString& filename, xArray<BenchPathPoint>& path)
+{
+  FILE * f;
+  errno_t err = _tfopen_s(&f, filename.ToChar(), _T("rt"));
+  if(err != 0)
+  {
+    return false;
+  }
+  BenchPathPoint point;
+  while(fscanf_s(f, "%f %f %f", &point.time, &point.pos.x, &point.pos.y) == 3)
+  {
+    if(path.Count() && point.time < path[path.Count()-1].time)
+    {
+      break; // times are ascending
+    }
+    path.Append(point);
+  }
+  fclose(f);
+  return path.Count() > 0;
+}
+
+static xVec2 PathPos(const xArray<BenchPathPoint>& path, float time)
+{
+  int i;
+  for(i = 1; i < path.Count() && path[i].time < time; i++);
+  if(i >= path.Count())
+  {
+    return path[path.Count()-1].pos;
+  }
+  const BenchPathPoint& a = path[i-1];
+  const BenchPathPoint& b = path[i];
+  float t = b.time > a.time ? Min(Max((time - a.time) / (b.time - a.time), 0.0f), 1.0f) : 1.0f;
+  return a.pos + (b.pos - a.pos) * t;
+}
+
+static xVec2 ScriptedPos(const xMegaTexture& megaTexture, float speed, float time)
+{
+  // a circle around the middle of the texture, it crosses every mip window sooner or later
+  float cx = megaTexture.MipWidth(0) * 0.5f, cy = megaTexture.MipHeight(0) * 0.5f;
+  float radius = Max(1.0f, Min(cx, cy) * 0.6f);
+  float angle = speed * time / radius;
+  return xVec2(cx + xMath::Cos(angle) * radius, cy + xMath::Sin(angle) * radius);
+}
+
+// =================================================================
+
+static int PlanePixelBits(const xMegaTexture& megaTexture, int plane)
+{
+  switch(megaTexture.PlaneFormat(plane))
+  {
+  case xMegaTexture::FORMAT_BC1:
+    return 4;
+
+  case xMegaTexture::FORMAT_L8:
+    return 8;
+  }
+  return 32;
+}
+
+static void UpdateWindows(xMegaTexture& megaTexture, const BenchOptions& options, const xVec2& pos, xArray<byte>& texture)
+{
+  int clusterSize = megaTexture.ClusterSize();
+  int textureSize = options.layerSize * clusterSize;
+  for(int mip = 0; mip < options.layersNumber && mip < megaTexture.MipsNumber(); mip++)
+  {
+    int width = Min(options.layerSize, megaTexture.MipWidth(mip));
+    int height = Min(options.layerSize, megaTexture.MipHeight(mip));
+    int x = Min(Max((int)(pos.x / (float)(1 << mip)) - width / 2, 0), megaTexture.MipWidth(mip) - width);
+    int y = Min(Max((int)(pos.y / (float)(1 << mip)) - height / 2, 0), megaTexture.MipHeight(mip) - height);
+    megaTexture.UpdateLayer(mip, x, y, width, height);
+
+    // the same uploads the demo does, only to memory; every plane goes to its own texture
+    for(int plane = 0; plane < megaTexture.PlanesNumber(); plane++)
+    {
+      int pixelBits = PlanePixelBits(megaTexture, plane);
+      int pitch = pixelBits == 4 ? 8 * (textureSize / 4) : pixelBits / 8 * textureSize;
+      for(int i = 0; i < megaTexture.DirtyRectsNumber(mip); i++)
+      {
+        const xMegaTexture::Rect& dirty = megaTexture.DirtyRect(mip, i);
+        byte * dst = pixelBits == 4
+          ? texture.Ptr() + pitch * (dirty.y * clusterSize / 4) + 8 * (dirty.x * clusterSize / 4)
+          : texture.Ptr() + pitch * (dirty.y * clusterSize) + pixelBits / 8 * (dirty.x * clusterSize);
+        megaTexture.GetTextureRect(mip, dirty, dst, pitch, pixelBits, plane);
+      }
+    }
+    megaTexture.ClearDirtyRects(mip);
+  }
+}
+
+// the synthetic feedback: mip 0 tiles closer than half of the window, then rings doubling the radius
+static void FootprintTiles(const xMegaTexture& megaTexture, const BenchOptions& options, const xVec2& pos,
+  xArray<xMegaTexture::FeedbackTile>& tiles)
+{
+  tiles.SetCount(0, false);
+  float radius = Max(1.0f, options.layerSize * 0.5f);
+  for(int mip = 0; mip < options.layersNumber && mip < megaTexture.MipsNumber(); mip++)
+  {
+    float scale = 1.0f / (float)(1 << mip);
+    float minDist = mip > 0 ? radius * 0.5f : 0.0f; // in clusters of the mip
+    int x0 = Max((int)xMath::Floor(pos.x * scale - radius), 0);
+    int y0 = Max((int)xMath::Floor(pos.y * scale - radius), 0);
+    int x1 = Min((int)xMath::Ceil(pos.x * scale + radius), megaTexture.MipWidth(mip));
+    int y1 = Min((int)xMath::Ceil(pos.y * scale + radius), megaTexture.MipHeight(mip));
+    for(int y = y0; y < y1; y++)
+    {
+      for(int x = x0; x < x1; x++)
+      {
+        float dist = (xVec2(x + 0.5f, y + 0.5f) - pos * scale).Length();
+        if(dist >= minDist && dist < radius)
+        {
+          xMegaTexture::FeedbackTile tile;
+          tile.mip = mip;
+          tile.x = x;
+          tile.y = y;
+          tiles.Append(tile);
+        }
+      }
+    }
+  }
+}
+
+static int UpdatePages(xMegaTexture& megaTexture, const xArray<xMegaTexture::FeedbackTile>& tiles, xArray<byte>& pool,
+  xArray<byte>& pageTable)
+{
+  megaTexture.UpdatePages(tiles.Ptr(), tiles.Count());
+  int pageSize = megaTexture.PaddedClusterSize();
+  int poolSize = megaTexture.PagePoolSize() * pageSize;
+  for(int plane = 0; plane < megaTexture.PlanesNumber(); plane++)
+  {
+    int pixelBits = PlanePixelBits(megaTexture, plane);
+    int pitch = pixelBits == 4 ? 8 * (poolSize / 4) : pixelBits / 8 * poolSize;
+    for(int i = 0; i < megaTexture.DirtyPagesNumber(); i++)
+    {
+      int x, y;
+      megaTexture.DirtyPagePos(i, x, y);
+      byte * dst = pixelBits == 4
+        ? pool.Ptr() + pitch * (y * pageSize / 4) + 8 * (x * pageSize / 4)
+        : pool.Ptr() + pitch * (y * pageSize) + pixelBits / 8 * (x * pageSize);
+      megaTexture.GetDirtyPage(i, dst, pitch, pixelBits, plane);
+    }
+  }
+  int uploaded = megaTexture.DirtyPagesNumber();
+  megaTexture.ClearDirtyPages();
+  int width = megaTexture.MipWidth(0);
+  megaTexture.GetPageTable(0, pageTable.Ptr(), width * sizeof(dword));
+  return uploaded;
+}
+
+static int CompareDoubles(const double * a, const double * b)
+{
+  return *a < *b ? -1 : (*a > *b ? 1 : 0);
+}
+
+static bool Run(const BenchOptions& options, BenchResults& results)
+{
+  xMegaTexture megaTexture;
+  megaTexture.Init(options.megaPrefix, options.layersNumber, 128, options.layerSize,
+    options.initFlags, options.threadsNumber);
+  if(!megaTexture.IsArchive() || megaTexture.ClusterSize() != 128)
+  {
+    _tprintf(_T("can't open %s\n"), xMegaTexture::ArchiveFilename(options.megaPrefix).ToChar());
+    return false;
+  }
+  megaTexture.SetCacheBudget((uint32)options.budget << 20);
+  if(options.pagePoolSize > 0 && !megaTexture.InitPages(options.pagePoolSize))
+  {
+    _tprintf(_T("can't init %d x %d pages\n"), options.pagePoolSize, options.pagePoolSize);
+    return false;
+  }
+
+  xArray<BenchPathPoint> path;
+  if(!options.pathFilename.IsEmpty() && !LoadPath(options.pathFilename, path))
+  {
+    _tprintf(_T("can't read %s\n"), options.pathFilename.ToChar());
+    return false;
+  }
+
+  xArray<byte> texture;
+  int textureSize = options.layerSize * megaTexture.ClusterSize();
+  texture.SetCount(4 * textureSize * textureSize); // the biggest plane format
+
+  xArray<xMegaTexture::FeedbackTile> tiles;
+  xArray<byte> pool, pageTable;
+  if(megaTexture.IsPaged())
+  {
+    int poolSize = megaTexture.PagePoolSize() * megaTexture.PaddedClusterSize();
+    pool.SetCount(4 * poolSize * poolSize);
+    pageTable.SetCount(sizeof(dword) * megaTexture.MipWidth(0) * megaTexture.MipHeight(0));
+  }
+
+  xArray<double> latencies;
+  latencies.SetCount(options.frames);
+  MEMSET(&results, 0, sizeof(results));
+
+  float dt = 1.0f / options.fps;
+  double start = TimerSeconds();
+  for(int frame = 0; frame < options.frames; frame++)
+  {
+    float time = frame * dt;
+    xVec2 pos = path.Count() ? PathPos(path, time) : ScriptedPos(megaTexture, options.speed, time);
+    float prefetchTime = BENCH_PREFETCH_FRAMES * dt;
+    xVec2 nextPos = path.Count() ? PathPos(path, time + prefetchTime)
+      : ScriptedPos(megaTexture, options.speed, time + prefetchTime);
+
+    double frameStart = TimerSeconds();
+    megaTexture.SetViewer(pos, time);
+    UpdateWindows(megaTexture, options, pos, texture);
+    if(megaTexture.IsPaged())
+    {
+      FootprintTiles(megaTexture, options, pos, tiles);
+      results.pagesUploaded += UpdatePages(megaTexture, tiles, pool, pageTable);
+    }
+    latencies[frame] = (TimerSeconds() - frameStart) * 1000.0;
+    megaTexture.Prefetch(pos, (nextPos - pos) / prefetchTime, prefetchTime);
+    megaTexture.FinishStatsFrame();
+
+    xMegaTexture::CacheStats cache = megaTexture.GetCacheStats();
+    results.peakCacheBytes = Max(results.peakCacheBytes, cache.bytes);
+    results.peakHeapBytes = Max(results.peakHeapBytes, HeapBytes());
+    results.peakPoolBytes = Max(results.peakPoolBytes, cache.poolBytes);
+
+    if(options.isRealtime)
+    {
+      double wait = start + (frame + 1) * dt - TimerSeconds();
+      if(wait > 0)
+      {
+        Sleep((DWORD)(wait * 1000.0));
+      }
+    }
+  }
+  results.seconds = TimerSeconds() - start;
+  results.frames = options.frames;
+
+  latencies.Sort(CompareDoubles);
+  results.p50 = latencies[options.frames / 2];
+  results.p99 = latencies[Min(options.frames * 99 / 100, options.frames - 1)];
+  results.maxLatency = latencies[options.frames - 1];
+
+  xMegaTexture::CacheStats cache = megaTexture.GetCacheStats();
+  results.loads = cache.loads;
+  results.bytesRead = cache.bytesRead;
+  results.hitRate = cache.hits + cache.misses > 0 ? (double)cache.hits / (cache.hits + cache.misses) : 0;
+  results.evictions = cache.evictions;
+  results.cancels = cache.cancels;
+
+  if(!options.statsFilename.IsEmpty())
+  {
+    int len = options.statsFilename.Len();
+    bool isJson = len > 5 && lstrcmpi(options.statsFilename.ToChar() + len - 5, _T(".json")) == 0;
+    if(!megaTexture.DumpStats(options.statsFilename, isJson ? xMegaTexture::STATS_JSON : xMegaTexture::STATS_CSV))
+    {
+      _tprintf(_T("can't write %s\n"), options.statsFilename.ToChar());
+    }
+  }
+  return true;
+}
+
+static void Report(const BenchOptions& options, const BenchResults& results)
+{
+  double mb = 1024.0 * 1024.0;
+  _tprintf(_T("frames: %d in %.2f s\n"), results.frames, results.seconds);
+  _tprintf(_T("clusters loaded: %d, %.1f per second\n"), results.loads, results.loads / results.seconds);
+  _tprintf(_T("bytes read: %.2f Mb, %.2f Mb per second\n"), results.bytesRead / mb, results.bytesRead / mb / results.seconds);
+  _tprintf(_T("update latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n"), results.p50, results.p99, results.maxLatency);
+  _tprintf(_T("cache hit rate: %.1f%%, evictions: %d, cancelled: %d\n"), results.hitRate * 100.0, results.evictions, results.cancels);
+  _tprintf(_T("peak memory: cache %.2f Mb, image pool %.2f Mb, heap %.2f Mb\n"),
+    results.peakCacheBytes / mb, results.peakPoolBytes / mb, results.peakHeapBytes / mb);
+  if(options.pagePoolSize > 0)
+  {
+    _tprintf(_T("pages uploaded: %d, %.1f per frame\n"), results.pagesUploaded, (double)results.pagesUploaded / results.frames);
+  }
+
+  if(options.csvFilename.IsEmpty())
+  {
+    return;
+  }
+  FILE * f;
+  bool isNew = _tfopen_s(&f, options.csvFilename.ToChar(), _T("rt")) != 0;
+  if(!isNew)
+  {
+    fclose(f);
+  }
+  if(_tfopen_s(&f, options.csvFilename.ToChar(), _T("at")) != 0)
+  {
+    return;
+  }
+  if(isNew)
+  {
+    fprintf(f, "mega,codec,budget,threads,mapped,frames,seconds,loads,loads_per_s,bytes_read,"
+      "p50_ms,p99_ms,max_ms,hit_rate,evictions,cancels,peak_cache,peak_heap\n");
+  }
+  _ftprintf(f, _T("%s,%d,%d,%d,%d,%d,%.3f,%d,%.1f,%I64u,%.3f,%.3f,%.3f,%.4f,%d,%d,%u,%u\n"),
+    options.megaPrefix.ToChar(), options.codec, options.budget, options.threadsNumber,
+    (options.initFlags & xMegaTexture::INIT_MAPPED) ? 1 : 0,
+    results.frames, results.seconds, results.loads, results.loads / results.seconds, results.bytesRead,
+    results.p50, results.p99, results.maxLatency, results.hitRate, results.evictions, results.cancels,
+    results.peakCacheBytes, results.peakHeapBytes);
+  fclose(f);
+}
+
+// =================================================================
+
+// the threaded Smooth must equal its reference mode to the bit
+static bool CheckSmooth()
+{
+  const float size = 512.0f, grid = 4.0f; // 129 rows, so there are several bands
+  xTerrainVerts terrains[2];
+  xTerrainVerts::Stamp hills[5];
+  for(int i = 0; i < 5; i++)
+  {
+    xVec2 center(size * (0.1f * i - 0.2f), size * (0.07f * i - 0.15f));
+    hills[i] = xTerrainVerts::Stamp::Hill(center, size * (0.1f + 0.03f * i), 20.0f + 5.0f * i, i == 2);
+  }
+  xArray<float> heights[2];
+  int passes[] = { 1, 3 };
+  bool isOk = true;
+  for(int k = 0; k < 2; k++)
+  {
+    for(int t = 0; t < 2; t++)
+    {
+      terrains[t].Init(xVec2(size, size), xVec2(grid, grid));
+      terrains[t].ApplyStamps(hills, 5);
+      terrains[t].Smooth(passes[k], t ? 4 : 0, t == 0);
+      int width = terrains[t].XPointsNumber(), height = terrains[t].YPointsNumber();
+      heights[t].SetCount(width * height);
+      terrains[t].HeightsRect(0, 0, width, height, heights[t].Ptr(), width);
+    }
+    if(MEMCMP(heights[0].Ptr(), heights[1].Ptr(), heights[0].Count() * sizeof(float)) != 0)
+    {
+      _tprintf(_T("Smooth(%d) differs from the reference\n"), passes[k]);
+      isOk = false;
+    }
+  }
+  return isOk;
+}
+
+static dword checkSeed = 12345;
+
+static float CheckRandom()
+{
+  checkSeed = checkSeed * 1664525 + 1013904223;
+  return (checkSeed >> 8) / (float)(1 << 24);
+}
+
+static bool CheckFloats(const TCHAR * name, const float * a, const float * b, int count, float epsilon)
+{
+  for(int i = 0; i < count; i++)
+  {
+    if(fabs(a[i] - b[i]) > epsilon * Max(1.0f, (float)fabs(b[i])))
+    {
+      _tprintf(_T("%s: %s differs from the generic one at %d, %f instead of %f\n"),
+        xSIMD::Processor->Name(), name, i, a[i], b[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool CheckBytes(const TCHAR * name, const byte * a, const byte * b, int count)
+{
+  if(MEMCMP(a, b, count) != 0)
+  {
+    _tprintf(_T("%s: %s differs from the generic one\n"), xSIMD::Processor->Name(), name);
+    return false;
+  }
+  return true;
+}
+
+// the SIMD kernels the engine uses must match the generic ones, the ones working
+// with integers to the bit, the float ones up to the rounding of their order of operations
+static bool CheckSIMD()
+{
+  enum { COUNT = 1027, BLOCKS = 16 }; // the count is odd, so the tails are run too
+  xSIMD_Generic generic;
+  xSIMDProcessor * simd = xSIMD::Processor;
+  _tprintf(_T("checking %s against %s\n"), simd->Name(), generic.Name());
+
+  xArray<float> in[6], out[2][3];
+  int i, k;
+  for(k = 0; k < 6; k++)
+  {
+    in[k].SetCount(COUNT);
+    for(i = 0; i < COUNT; i++)
+    {
+      in[k][i] = k < 4 ? (CheckRandom() - 0.5f) * 200.0f : CheckRandom();
+    }
+  }
+  for(k = 0; k < 2; k++)
+  {
+    out[k][0].SetCount(COUNT);
+    out[k][1].SetCount(COUNT);
+    out[k][2].SetCount(COUNT);
+  }
+  bool isOk = true;
+
+  xSIMDProcessor * processors[2] = { simd, &generic };
+  for(k = 0; k < 2; k++)
+  {
+    processors[k]->Bilinear(out[k][0].Ptr(), out[k][1].Ptr(), out[k][2].Ptr(),
+      in[0].Ptr(), in[1].Ptr(), in[2].Ptr(), in[3].Ptr(), in[4].Ptr(), in[5].Ptr(), COUNT);
+  }
+  isOk &= CheckFloats(_T("Bilinear"), out[0][0].Ptr(), out[1][0].Ptr(), COUNT, 1e-4f);
+  isOk &= CheckFloats(_T("Bilinear derivX"), out[0][1].Ptr(), out[1][1].Ptr(), COUNT, 1e-4f);
+  isOk &= CheckFloats(_T("Bilinear derivY"), out[0][2].Ptr(), out[1][2].Ptr(), COUNT, 1e-4f);
+
+  for(k = 0; k < 2; k++)
+  {
+    processors[k]->RaisedCosine(out[k][0].Ptr(), in[4].Ptr(), COUNT);
+  }
+  isOk &= CheckFloats(_T("RaisedCosine"), out[0][0].Ptr(), out[1][0].Ptr(), COUNT, 1e-5f);
+
+  for(k = 0; k < 2; k++)
+  {
+    processors[k]->Mul(out[k][0].Ptr(), 0.37f, in[0].Ptr(), COUNT);
+    processors[k]->MulAdd(out[k][0].Ptr(), 1.5f, in[1].Ptr(), COUNT);
+  }
+  isOk &= CheckFloats(_T("Mul and MulAdd"), out[0][0].Ptr(), out[1][0].Ptr(), COUNT, 1e-4f);
+
+  float mins[2], maxs[2];
+  for(k = 0; k < 2; k++)
+  {
+    processors[k]->MinMax(mins[k], maxs[k], in[0].Ptr(), COUNT);
+  }
+  isOk &= CheckFloats(_T("MinMax min"), &mins[0], &mins[1], 1, 0.0f);
+  isOk &= CheckFloats(_T("MinMax max"), &maxs[0], &maxs[1], 1, 0.0f);
+
+  xArray<word> quantized;
+  quantized.SetCount(COUNT);
+  for(i = 0; i < COUNT; i++)
+  {
+    quantized[i] = (word)(CheckRandom() * 65535.0f);
+  }
+  for(k = 0; k < 2; k++)
+  {
+    processors[k]->Dequantize(out[k][0].Ptr(), quantized.Ptr(), 0.01f, -300.0f, COUNT);
+  }
+  isOk &= CheckFloats(_T("Dequantize"), out[0][0].Ptr(), out[1][0].Ptr(), COUNT, 1e-5f);
+
+  // a noisy gradient, so the blocks get different endpoints and indices
+  const int size = BLOCKS * 4, pitch = size * 3;
+  xArray<byte> image, pixels[2], blocks[2];
+  image.SetCount(size * pitch);
+  for(int y = 0; y < size; y++)
+  {
+    for(int x = 0; x < pitch; x++)
+    {
+      image[y * pitch + x] = (byte)Min(255, x / 3 * 2 + y + (x % 3) * 40 + (int)(CheckRandom() * 24.0f));
+    }
+  }
+  for(k = 0; k < 2; k++)
+  {
+    pixels[k].SetCount(COUNT * 4);
+    processors[k]->ExpandBGR24(pixels[k].Ptr(), image.Ptr(), COUNT);
+    blocks[k].SetCount(BLOCKS * BLOCKS * 8);
+    processors[k]->CompressBC1(blocks[k].Ptr(), BLOCKS * 8, image.Ptr(), pitch, BLOCKS, BLOCKS);
+  }
+  isOk &= CheckBytes(_T("ExpandBGR24"), pixels[0].Ptr(), pixels[1].Ptr(), COUNT * 4);
+  isOk &= CheckBytes(_T("CompressBC1"), blocks[0].Ptr(), blocks[1].Ptr(), BLOCKS * BLOCKS * 8);
+  return isOk;
+}
+
+static bool Check()
+{
+  bool isOk = CheckSmooth();
+  isOk &= CheckSIMD();
+  _tprintf(isOk ? _T("checks passed\n") : _T("checks failed\n"));
+  return isOk;
+}
+
+// =================================================================
+
+int _tmain(int argc, _TCHAR * argv[])
+{
+  xSIMD::InitProcessor(_T("bench"), false);
+
+  BenchOptions options;
+  for(int i = 1; i < argc; i++)
+  {
+    xString arg = argv[i];
+    xString value = i + 1 < argc ? xString(argv[i+1]) : xString();
+    if(arg == _T("-make")) { options.makeSize = _ttoi(value.ToChar()); i++; }
+    else if(arg == _T("-mega")) { options.megaPrefix = value; i++; }
+    else if(arg == _T("-bc1")) { options.format = xMegaTexture::FORMAT_BC1; }
+    else if(arg == _T("-border")) { options.border = _ttoi(value.ToChar()); i++; }
+    else if(arg == _T("-codec"))
+    {
+      if(value.Icmp(_T("lz")) == 0)
+        options.codec = xClusterCodec::CODEC_LZ;
+      else if(value.Icmp(_T("delta")) == 0)
+        options.codec = xClusterCodec::CODEC_DELTA;
+      i++;
+    }
+    else if(arg == _T("-tolerance")) { options.tolerance = Min(Max(_ttoi(value.ToChar()), 0), 255); i++; }
+    else if(arg == _T("-planes")) { options.planesNumber = Min(Max(_ttoi(value.ToChar()), 1), 3); i++; }
+    else if(arg == _T("-path")) { options.pathFilename = value; i++; }
+    else if(arg == _T("-speed")) { options.speed = (float)_tstof(value.ToChar()); i++; }
+    else if(arg == _T("-frames")) { options.frames = Max(1, _ttoi(value.ToChar())); i++; }
+    else if(arg == _T("-fps")) { options.fps = Max(1.0f, (float)_tstof(value.ToChar())); i++; }
+    else if(arg == _T("-layers")) { options.layersNumber = Max(1, _ttoi(value.ToChar())); i++; }
+    else if(arg == _T("-layer")) { options.layerSize = Max(1, _ttoi(value.ToChar())); i++; }
+    else if(arg == _T("-budget")) { options.budget = Max(1, _ttoi(value.ToChar())); i++; }
+    else if(arg == _T("-threads")) { options.threadsNumber = _ttoi(value.ToChar()); i++; }
+    else if(arg == _T("-pages")) { options.pagePoolSize = Min(Max(_ttoi(value.ToChar()), 1), 256); i++; }
+    else if(arg == _T("-mapped")) { options.initFlags |= xMegaTexture::INIT_MAPPED; }
+    else if(arg == _T("-sync")) { options.initFlags &= ~xMegaTexture::INIT_ASYNC; }
+    else if(arg == _T("-realtime")) { options.isRealtime = true; }
+    else if(arg == _T("-csv")) { options.csvFilename = value; i++; }
+    else if(arg == _T("-stats")) { options.statsFilename = value; i++; }
+    else if(arg == _T("-check"))
+    {
+      bool isOk = Check();
+      xThread::FreePool();
+      return isOk ? 0 : 1;
+    }
+    else
+    {
+      _tprintf(_T("unknown option %s\n"), arg.ToChar());
+      return 1;
+    }
+  }
+
+  if(options.makeSize > 0)
+  {
+    xString dir = xString::Format(_T("bench-%d"), options.makeSize);
+    xString imageFilename = dir + _T(".tga");
+    CreateDirectory(dir, NULL);
+    options.megaPrefix = dir + _T("/mega");
+    if(options.format == xMegaTexture::FORMAT_BC1)
+    {
+      options.border = (options.border + 3) & ~3; // whole blocks
+    }
+    // normals and material data are made of the same image, only their formats matter here
+    xMegaTexture::PlaneDesc planes[3];
+    for(int i = 0; i < options.planesNumber; i++)
+    {
+      planes[i].filename = imageFilename;
+      planes[i].codec = options.codec;
+      planes[i].tolerance = options.tolerance;
+      planes[i].isLinear = i > 0;
+    }
+    planes[0].format = options.format;
+    planes[2].format = xMegaTexture::FORMAT_L8;
+    double start = TimerSeconds();
+    if(!MakeSyntheticImage(imageFilename, options.makeSize)
+      || !xMegaTexture::Make(planes, options.planesNumber, options.megaPrefix, 128, xMegaTexture::FILTER_BOX,
+        options.border))
+    {
+      _tprintf(_T("can't make %s\n"), options.megaPrefix.ToChar());
+      return 1;
+    }
+    _tprintf(_T("made %s in %.2f s\n"), options.megaPrefix.ToChar(), TimerSeconds() - start);
+  }
+  if(options.megaPrefix.IsEmpty())
+  {
+    _tprintf(_T("bench [-make size | -mega prefix] [-path file] [options]\n"));
+    return 1;
+  }
+
+  BenchResults results;
+  bool isOk = Run(options, results);
+  xThread::FreePool();
+  if(!isOk)
+  {
+    return 1;
+  }
+  Report(options, results);
+  return 0;
+}
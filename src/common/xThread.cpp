@@ -0,0 +1,170 @@
+#include <windows.h>
+#include <process.h>
+#include "xThread.h"
+
+// =================================================================
+// =================================================================
+// =================================================================
+
+xSemaphore::xSemaphore(int count)
+{
+  handle = CreateSemaphore(NULL, count, 0x7fffffff, NULL);
+  ASSERT(handle);
+}
+
+xSemaphore::~xSemaphore()
+{
+  CloseHandle(handle);
+}
+
+void xSemaphore::Release(int count)
+{
+  ReleaseSemaphore(handle, count, NULL);
+}
+
+bool xSemaphore::Wait(dword timeout)
+{
+  return WaitForSingleObject(handle, timeout) == WAIT_OBJECT_0;
+}
+
+// =================================================================
+// =================================================================
+// =================================================================
+
+xThread::xThread()
+{
+  handle = NULL;
+  func = NULL;
+  params = NULL;
+}
+
+xThread::~xThread()
+{
+  Wait();
+}
+
+unsigned __stdcall xThread::ThreadProc(void * p)
+{
+  xThread * thread = (xThread*)p;
+  thread->func(thread->params);
+  return 0;
+}
+
+bool xThread::Start(Func p_func, void * p_params)
+{
+  ASSERT(!handle && p_func);
+  func = p_func;
+  params = p_params;
+  handle = (HANDLE)_beginthreadex(NULL, 0, ThreadProc, this, 0, NULL);
+  return handle != NULL;
+}
+
+void xThread::Wait()
+{
+  if(handle)
+  {
+    WaitForSingleObject(handle, INFINITE);
+    CloseHandle(handle);
+    handle = NULL;
+  }
+}
+
+int xThread::ProcessorsNumber()
+{
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+void xThread::ForThreadProc(void * p)
+{
+  ForJob * job = (ForJob*)p;
+  for(;;)
+  {
+    int i = InterlockedIncrement(&job->next) - 1;
+    if(i >= job->count)
+    {
+      break;
+    }
+    job->func(job->params, i);
+  }
+}
+
+xThread::Pool * xThread::pool = NULL;
+volatile LONG xThread::isPoolBusy = 0;
+
+void xThread::PoolThreadProc(void * p)
+{
+  Pool * pool = (Pool*)p;
+  for(;;)
+  {
+    pool->wake.Wait();
+    if(pool->isQuit)
+    {
+      break;
+    }
+    ForThreadProc(pool->job);
+    pool->done.Release();
+  }
+}
+
+void xThread::ParallelFor(ForFunc func, void * params, int count, int threadsNumber)
+{
+  ForJob job;
+  job.func = func;
+  job.params = params;
+  job.count = count;
+  job.next = 0;
+
+  int helpersNumber = (threadsNumber < count ? threadsNumber : count) - 1;
+  if(helpersNumber <= 0 || InterlockedCompareExchange(&isPoolBusy, 1, 0) != 0)
+  {
+    ForThreadProc(&job);
+    return;
+  }
+  if(!pool)
+  {
+    pool = new Pool;
+    pool->threadsNumber = ProcessorsNumber() - 1;
+    pool->threads = pool->threadsNumber > 0 ? new xThread[pool->threadsNumber] : NULL;
+    pool->job = NULL;
+    pool->isQuit = false;
+    for(int i = 0; i < pool->threadsNumber; i++)
+    {
+      pool->threads[i].Start(PoolThreadProc, pool);
+    }
+  }
+  if(helpersNumber > pool->threadsNumber)
+  {
+    helpersNumber = pool->threadsNumber;
+  }
+  pool->job = &job;
+  if(helpersNumber > 0)
+  {
+    pool->wake.Release(helpersNumber);
+  }
+  ForThreadProc(&job);
+  // every woken helper reports once it finds no items left
+  for(int i = 0; i < helpersNumber; i++)
+  {
+    pool->done.Wait();
+  }
+  pool->job = NULL;
+  InterlockedExchange(&isPoolBusy, 0);
+}
+
+void xThread::FreePool()
+{
+  ASSERT(!isPoolBusy);
+  if(pool)
+  {
+    pool->isQuit = true;
+    if(pool->threadsNumber > 0)
+    {
+      pool->wake.Release(pool->threadsNumber);
+    }
+    delete [] pool->threads; // waits for the threads
+    delete pool;
+    pool = NULL;
+  }
+}
@@ -0,0 +1,128 @@
+#ifndef __X_THREAD_H__
+#define __X_THREAD_H__
+
+#pragma once
+
+/*
+===============================================================================
+
+	Thin wrappers around the win32 threading primitives.
+
+	xHeap is not thread safe, so code running in a worker thread must not
+	allocate or free memory through new/delete (xString included).
+
+===============================================================================
+*/
+
+#include <windows.h>
+#include "../xDef.h"
+
+class xMutex
+{
+  CRITICAL_SECTION cs;
+
+  xMutex(const xMutex&);
+  void operator=(const xMutex&);
+
+public:
+
+  xMutex(){ InitializeCriticalSection(&cs); }
+  ~xMutex(){ DeleteCriticalSection(&cs); }
+
+  void Lock(){ EnterCriticalSection(&cs); }
+  void Unlock(){ LeaveCriticalSection(&cs); }
+};
+
+class xMutexLock
+{
+  xMutex& mutex;
+
+  xMutexLock(const xMutexLock&);
+  void operator=(const xMutexLock&);
+
+public:
+
+  xMutexLock(xMutex& m): mutex(m){ mutex.Lock(); }
+  ~xMutexLock(){ mutex.Unlock(); }
+};
+
+class xSemaphore
+{
+  HANDLE handle;
+
+  xSemaphore(const xSemaphore&);
+  void operator=(const xSemaphore&);
+
+public:
+
+  xSemaphore(int count = 0);
+  ~xSemaphore();
+
+  void Release(int count = 1);
+  bool Wait(dword timeout = INFINITE);
+};
+
+class xThread
+{
+public:
+
+  typedef void (*Func)(void * params);
+  typedef void (*ForFunc)(void * params, int i);
+
+protected:
+
+  struct ForJob
+  {
+    ForFunc func;
+    void * params;
+    int count;
+    volatile LONG next;
+  };
+
+  // helpers of ParallelFor, started by the first call and waiting for jobs
+  struct Pool
+  {
+    xThread * threads;
+    int threadsNumber;
+    xSemaphore wake;
+    xSemaphore done;
+    ForJob * job;
+    bool isQuit;
+  };
+
+  static Pool * pool;
+  static volatile LONG isPoolBusy;
+
+  static void ForThreadProc(void * p);
+  static void PoolThreadProc(void * p);
+
+  HANDLE handle;
+  Func func;
+  void * params;
+
+  static unsigned __stdcall ThreadProc(void * p);
+
+  xThread(const xThread&);
+  void operator=(const xThread&);
+
+public:
+
+  xThread();
+  ~xThread();
+
+  bool Start(Func func, void * params);
+  void Wait();
+
+  bool IsRunning() const { return handle != NULL; }
+
+  static int ProcessorsNumber();
+
+  // calls func for every i in [0, count) on threadsNumber threads, the calling one included;
+  // items are taken one by one, so func must not use the heap. The helpers are the threads
+  // of a pool of ProcessorsNumber()-1 made once, a nested or concurrent call runs on its own thread
+  static void ParallelFor(ForFunc func, void * params, int count, int threadsNumber);
+  // joins the pool threads, call it before exit
+  static void FreePool();
+};
+
+#endif // __X_THREAD_H__
@@ -6,17 +6,259 @@
 
 xTerrainVerts::xTerrainVerts()
 {
+  Clear();
 }
 
 xTerrainVerts::xTerrainVerts(const xVec2& size, const xVec2& gridSize)
 {
+  Clear();
   Init(size, gridSize);
 }
 
+xTerrainVerts::~xTerrainVerts()
+{
+  Close();
+}
+
+void xTerrainVerts::Clear()
+{
+  steps.x = steps.y = 0;
+  size = gridSize = corner = xVec2(0, 0);
+  minHeight = maxHeight = 0;
+  tiles = NULL;
+  tilesX = tilesY = 0;
+  file = INVALID_HANDLE_VALUE;
+  fileMapping = NULL;
+  fileView = NULL;
+  tilesOffset = 0;
+  format = FORMAT_FLOAT;
+  tileBudget = 0;
+  residentTiles = 0;
+}
+
+void xTerrainVerts::Close()
+{
+  if(tiles && IsPaged() && !fileView)
+  {
+    for(Tile * tile = tileLRU.Next(); tile; tile = tileLRU.Next())
+    {
+      tile->lruNode.Remove();
+      delete [] tile->samples;
+    }
+  }
+  ASSERT(tileLRU.IsListEmpty());
+  delete [] tiles;
+  samples.Clear();
+  if(fileView)
+  {
+    UnmapViewOfFile(fileView);
+  }
+  if(fileMapping)
+  {
+    CloseHandle(fileMapping);
+  }
+  if(file != INVALID_HANDLE_VALUE)
+  {
+    CloseHandle(file);
+  }
+  Clear();
+}
+
+void xTerrainVerts::InitGrid(const xVec2& p_size, int stepsX, int stepsY)
+{
+  size = p_size;
+  steps.x = stepsX;
+  steps.y = stepsY;
+  gridSize.x = size.x / (steps.x - 1);
+  gridSize.y = size.y / (steps.y - 1);
+
+  corner = vec3_forward.ToVec2() * (size.y * 0.5f)
+    - vec3_right.ToVec2() * (size.x * 0.5f);
+
+  tilesX = (steps.x - 1 + TILE_SIZE - 1) >> TILE_SHIFT;
+  tilesY = (steps.y - 1 + TILE_SIZE - 1) >> TILE_SHIFT;
+  tiles = new Tile[tilesX * tilesY];
+}
+
 int xTerrainVerts::MapIndex(int x, int y) const { return y*steps.x + x; }
 
-float xTerrainVerts::Height(int x, int y) const { return heights[MapIndex(x,y)]; }
-float& xTerrainVerts::Height(int x, int y){ return heights[MapIndex(x,y)]; }
+xTerrainVerts::Tile * xTerrainVerts::TileAt(int x, int y, int& localX, int& localY) const
+{
+  ASSERT(x >= 0 && x < steps.x && y >= 0 && y < steps.y);
+  // the last samples of the grid are the repeated edge of the last tile
+  int tileX = Min(x >> TILE_SHIFT, tilesX-1);
+  int tileY = Min(y >> TILE_SHIFT, tilesY-1);
+  localX = x - (tileX << TILE_SHIFT);
+  localY = y - (tileY << TILE_SHIFT);
+  return tiles + tileY * tilesX + tileX;
+}
+
+void xTerrainVerts::TileCounts(int tileX, int tileY, int& countX, int& countY) const
+{
+  countX = Min((int)TILE_STRIDE, steps.x - (tileX << TILE_SHIFT));
+  countY = Min((int)TILE_STRIDE, steps.y - (tileY << TILE_SHIFT));
+}
+
+const byte * xTerrainVerts::TileSamples(Tile * tile) const
+{
+  if(!tile->samples)
+  {
+    LoadTile(tile);
+  }
+  else if(tile->lruNode.InList() && tileLRU.Next() != tile)
+  {
+    tile->lruNode.InsertAfter(tileLRU);
+  }
+  return tile->samples;
+}
+
+bool xTerrainVerts::ReadFileAt(HANDLE f, uint64 offset, void * buf, uint32 size)
+{
+  OVERLAPPED overlapped;
+  MEMSET(&overlapped, 0, sizeof(overlapped));
+  overlapped.Offset = (DWORD)offset;
+  overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+  DWORD readSize = 0;
+  return ReadFile(f, buf, size, &readSize, &overlapped) && readSize == size;
+}
+
+void xTerrainVerts::LoadTile(Tile * tile) const
+{
+  ASSERT(IsPaged() && !tile->samples);
+
+  // the budget is filled first, then the least recently used tile gives its buffer
+  byte * buf;
+  if(residentTiles < tileBudget)
+  {
+    buf = new byte[TileBytes()];
+    residentTiles++;
+  }
+  else
+  {
+    Tile * last = tileLRU.Prev();
+    ASSERT(last);
+    last->lruNode.Remove();
+    buf = last->samples;
+    last->samples = NULL;
+  }
+  tile->samples = buf;
+  tile->lruNode.InsertAfter(tileLRU);
+
+  uint64 offset = tilesOffset + (uint64)(tile - tiles) * TileBytes();
+  if(!ReadFileAt(file, offset, buf, TileBytes()))
+  {
+    // a broken tile is flat, it stays inside its bounds
+    if(format == FORMAT_FLOAT)
+    {
+      for(int i = 0; i < TILE_SAMPLES; i++)
+      {
+        ((float*)buf)[i] = tile->minHeight;
+      }
+    }
+    else
+    {
+      MEMSET(buf, 0, TileBytes());
+    }
+  }
+}
+
+float xTerrainVerts::Height(int x, int y) const
+{
+  int localX, localY;
+  Tile * tile = TileAt(x, y, localX, localY);
+  return Sample(tile, TileSamples(tile), localY * TILE_STRIDE + localX);
+}
+
+void xTerrainVerts::SetTileHeight(int tileX, int tileY, int localX, int localY, float h)
+{
+  Tile& tile = tiles[tileY * tilesX + tileX];
+  ((float*)tile.samples)[localY * TILE_STRIDE + localX] = h;
+  tile.minHeight = Min(tile.minHeight, h);
+  tile.maxHeight = Max(tile.maxHeight, h);
+}
+
+void xTerrainVerts::SetHeight(int x, int y, float h)
+{
+  ASSERT(!IsPaged() && format == FORMAT_FLOAT);
+  int localX, localY;
+  Tile * tile = TileAt(x, y, localX, localY);
+  int tileX = (int)(tile - tiles) % tilesX;
+  int tileY = (int)(tile - tiles) / tilesX;
+  SetTileHeight(tileX, tileY, localX, localY, h);
+  // edge samples are repeated by the tiles on the left and above,
+  // tile bounds only grow here, UpdateBounds makes them exact
+  if(localX == 0 && tileX > 0)
+  {
+    SetTileHeight(tileX-1, tileY, TILE_SIZE, localY, h);
+  }
+  if(localY == 0 && tileY > 0)
+  {
+    SetTileHeight(tileX, tileY-1, localX, TILE_SIZE, h);
+    if(localX == 0 && tileX > 0)
+    {
+      SetTileHeight(tileX-1, tileY-1, TILE_SIZE, TILE_SIZE, h);
+    }
+  }
+}
+
+void xTerrainVerts::SampleBounds(const float * heights, int countX, int countY, float& minHeight, float& maxHeight)
+{
+  minHeight = maxHeight = heights[0];
+  for(int y = 0; y < countY; y++, heights += TILE_STRIDE)
+  {
+    for(int x = 0; x < countX; x++)
+    {
+      minHeight = Min(minHeight, heights[x]);
+      maxHeight = Max(maxHeight, heights[x]);
+    }
+  }
+}
+
+void xTerrainVerts::UpdateTileBounds(int tileX, int tileY)
+{
+  Tile& tile = tiles[tileY * tilesX + tileX];
+  int countX, countY;
+  TileCounts(tileX, tileY, countX, countY);
+  SampleBounds((const float*)tile.samples, countX, countY, tile.minHeight, tile.maxHeight);
+}
+
+void xTerrainVerts::UpdateBounds()
+{
+  ASSERT(!IsPaged() && format == FORMAT_FLOAT);
+  for(int tileY = 0; tileY < tilesY; tileY++)
+  {
+    for(int tileX = 0; tileX < tilesX; tileX++)
+    {
+      UpdateTileBounds(tileX, tileY);
+    }
+  }
+}
+
+void xTerrainVerts::Bounds(int x, int y, int sizeX, int sizeY, xBounds& bounds) const
+{
+  // tile t has the samples [t*TILE_SIZE, (t+1)*TILE_SIZE]
+  int tileX0 = Min(x >> TILE_SHIFT, tilesX-1);
+  int tileY0 = Min(y >> TILE_SHIFT, tilesY-1);
+  int tileX1 = Min((x + Max(sizeX, 1) - 1) >> TILE_SHIFT, tilesX-1);
+  int tileY1 = Min((y + Max(sizeY, 1) - 1) >> TILE_SHIFT, tilesY-1);
+  float minZ = tiles[tileY0 * tilesX + tileX0].minHeight;
+  float maxZ = tiles[tileY0 * tilesX + tileX0].maxHeight;
+  for(int tileY = tileY0; tileY <= tileY1; tileY++)
+  {
+    for(int tileX = tileX0; tileX <= tileX1; tileX++)
+    {
+      const Tile& tile = tiles[tileY * tilesX + tileX];
+      minZ = Min(minZ, tile.minHeight);
+      maxZ = Max(maxZ, tile.maxHeight);
+    }
+  }
+  xVec2 p0 = Pos(x, y);
+  xVec2 p1 = Pos(x + sizeX, y + sizeY);
+  bounds.Clear();
+  bounds.Add(xVec3(p0.x, p0.y, minZ));
+  bounds.Add(xVec3(p1.x, p1.y, maxZ));
+}
 
 xVec2 xTerrainVerts::Pos(int x, int y) const
 {
@@ -40,18 +282,21 @@ float xTerrainVerts::Height(const xVec2& pos)
   float px = r / gridSize.x;
   px = Clamp(px, 0.0f, steps.x-1.0f);
   py = Clamp(py, 0.0f, steps.y-1.0f);
-  int ix = (int)px; // xMath::FtoiFast(p.x);
-  int iy = (int)py; // xMath::FtoiFast(p.y);
+  // the cell is clamped rather than the neighbour, so all four samples are in one tile
+  int ix = Min((int)px, steps.x-2); // xMath::FtoiFast(p.x);
+  int iy = Min((int)py, steps.y-2); // xMath::FtoiFast(p.y);
   float dx = px - ix;
   float dy = py - iy;
 
-  int nx = Min(ix+1, steps.x-1);
-  int ny = Min(iy+1, steps.y-1);
+  int localX, localY;
+  Tile * tile = TileAt(ix, iy, localX, localY);
+  const byte * samples = TileSamples(tile);
+  int i = localY * TILE_STRIDE + localX;
 
-  float p0 = Height(ix, iy);
-  float p1 = Height(nx, iy);
-  float p2 = Height(ix, ny);
-  float p3 = Height(nx, ny);
+  float p0 = Sample(tile, samples, i);
+  float p1 = Sample(tile, samples, i + 1);
+  float p2 = Sample(tile, samples, i + TILE_STRIDE);
+  float p3 = Sample(tile, samples, i + TILE_STRIDE + 1);
 
   float p01 = p0 * (1 - dx) + p1 * dx;
   float p23 = p2 * (1 - dx) + p3 * dx;
@@ -59,6 +304,108 @@ float xTerrainVerts::Height(const xVec2& pos)
   return p01 * (1 - dy) + p23 * dy;
 }
 
+void xTerrainVerts::SampleBatch(const xVec2 * pos, float * heights, xVec3 * normals, int count) const
+{
+  ASSERT(count <= SAMPLE_BATCH);
+  // corners are gathered one by one, then blended by xSIMDProcessor
+  float p00[SAMPLE_BATCH], p10[SAMPLE_BATCH], p01[SAMPLE_BATCH], p11[SAMPLE_BATCH];
+  float fracX[SAMPLE_BATCH], fracY[SAMPLE_BATCH];
+  float derivX[SAMPLE_BATCH], derivY[SAMPLE_BATCH];
+
+  xVec2 right = vec3_right.ToVec2() / gridSize.x;
+  xVec2 back = -vec3_forward.ToVec2() / gridSize.y;
+  float maxX = steps.x-1.0f, maxY = steps.y-1.0f;
+  int i;
+  for(i = 0; i < count; i++)
+  {
+    xVec2 offs = pos[i] - corner;
+    float px = right * offs;
+    float py = back * offs;
+    px = Clamp(px, 0.0f, maxX);
+    py = Clamp(py, 0.0f, maxY);
+    int ix = Min((int)px, steps.x-2);
+    int iy = Min((int)py, steps.y-2);
+    fracX[i] = px - ix;
+    fracY[i] = py - iy;
+
+    int localX, localY;
+    Tile * tile = TileAt(ix, iy, localX, localY);
+    const byte * samples = TileSamples(tile);
+    int s = localY * TILE_STRIDE + localX;
+    p00[i] = Sample(tile, samples, s);
+    p10[i] = Sample(tile, samples, s + 1);
+    p01[i] = Sample(tile, samples, s + TILE_STRIDE);
+    p11[i] = Sample(tile, samples, s + TILE_STRIDE + 1);
+  }
+  xSIMD::Processor->Bilinear(heights, normals ? derivX : NULL, normals ? derivY : NULL,
+    p00, p10, p01, p11, fracX, fracY, count);
+  if(normals)
+  {
+    // the derivatives are per cell, right and back are the world axes over the cell size
+    for(i = 0; i < count; i++)
+    {
+      xVec2 gradient = right * derivX[i] + back * derivY[i];
+      normals[i] = (vec3_up - xVec3(gradient.x, gradient.y, 0)).Norm();
+    }
+  }
+}
+
+void xTerrainVerts::SampleProc(void * params, int i)
+{
+  SampleJob * job = (SampleJob*)params;
+  int first = i * SAMPLE_BATCH;
+  job->terrain->SampleBatch(job->pos + first, job->heights + first,
+    job->normals ? job->normals + first : NULL, Min(job->count - first, (int)SAMPLE_BATCH));
+}
+
+void xTerrainVerts::Heights(const xVec2 * pos, float * heights, int count, xVec3 * normals, int threadsNumber) const
+{
+  // paged tiles are loaded through the LRU list of the calling thread, mapped ones are never loaded
+  int batchesNumber = (count + SAMPLE_BATCH - 1) / SAMPLE_BATCH;
+  if(threadsNumber != 1 && batchesNumber > 1 && (!IsPaged() || fileView))
+  {
+    SampleJob job;
+    job.terrain = this;
+    job.pos = pos;
+    job.heights = heights;
+    job.normals = normals;
+    job.count = count;
+    xThread::ParallelFor(SampleProc, &job, batchesNumber,
+      threadsNumber > 0 ? threadsNumber : xThread::ProcessorsNumber());
+    return;
+  }
+  for(int i = 0; i < count; i += SAMPLE_BATCH)
+  {
+    SampleBatch(pos + i, heights + i, normals ? normals + i : NULL, Min(count - i, (int)SAMPLE_BATCH));
+  }
+}
+
+void xTerrainVerts::HeightsRect(int x, int y, int sizeX, int sizeY, float * out, int pitch) const
+{
+  ASSERT(x >= 0 && y >= 0 && x + sizeX <= steps.x && y + sizeY <= steps.y);
+  int sampleBytes = TileBytes() / TILE_SAMPLES;
+  for(int j = 0; j < sizeY; j++, out += pitch)
+  {
+    // rows are split at tile edges
+    for(int i = 0; i < sizeX; )
+    {
+      int localX, localY;
+      Tile * tile = TileAt(x + i, y + j, localX, localY);
+      int count = Min(sizeX - i, TILE_STRIDE - localX);
+      const byte * row = TileSamples(tile) + (localY * TILE_STRIDE + localX) * sampleBytes;
+      if(format == FORMAT_FLOAT)
+      {
+        xSIMD::Processor->Memcpy(out + i, row, count * sizeof(float));
+      }
+      else
+      {
+        xSIMD::Processor->Dequantize(out + i, (const word*)row, tile->scale, tile->bias, count);
+      }
+      i += count;
+    }
+  }
+}
+
 void xTerrainVerts::MapPos(const xVec2& pos, int& x, int& y, bool nearest, int mip)
 {
   xVec2 offs = pos - corner;
@@ -71,19 +418,27 @@ void xTerrainVerts::MapPos(const xVec2& pos, int& x, int& y, bool nearest, int m
   y = Clamp((int)py << mip, 0, steps.y-1) >> mip;
 }
 
-void xTerrainVerts::Init(const xVec2& p_size, const xVec2& grid)
+xVec2 xTerrainVerts::MapPos(const xVec2& pos) const
 {
-  size = p_size;
-  steps.x = Max(2, xMath::FtoiFast(size.x / grid.x) + 1);
-  steps.y = Max(2, xMath::FtoiFast(size.y / grid.y) + 1);
-  gridSize.x = size.x / (steps.x - 1);
-  gridSize.y = size.y / (steps.y - 1);
+  xVec2 offs = pos - corner;
+  float f = vec3_forward.ToVec2() * -offs;
+  float r = vec3_right.ToVec2() * offs;
+  return xVec2(r / gridSize.x, f / gridSize.y);
+}
 
-  corner = vec3_forward.ToVec2() * (size.y * 0.5f)
-    - vec3_right.ToVec2() * (size.x * 0.5f);
+void xTerrainVerts::Init(const xVec2& p_size, const xVec2& grid)
+{
+  Close();
+  InitGrid(p_size, Max(2, xMath::FtoiFast(p_size.x / grid.x) + 1),
+    Max(2, xMath::FtoiFast(p_size.y / grid.y) + 1));
 
   minHeight = maxHeight = 0;
-  heights.SetCount(steps.x * steps.y, true);
+  samples.SetCount(tilesX * tilesY * TileBytes(), true);
+  MEMSET(samples.Ptr(), 0, samples.Count());
+  for(int i = 0; i < tilesX * tilesY; i++)
+  {
+    tiles[i].samples = samples.Ptr() + i * TileBytes();
+  }
   
   /*
   xVec2 halfSize = size * 0.5f;
@@ -132,82 +487,514 @@ void xTerrainVerts::CreateHill(const xVec2& centerPos, float width, float height
 }
 void xTerrainVerts::CreateHill(const xVec2& centerPos, float width, float height, float clearRadius, bool setHeight)
 {
-  for(int x = 0; x < steps.x; x++)
-    for(int y = 0; y < steps.y; y++){
-      xVec3 vert = Vert(x, y);
-      float len = (xVec2(vert.x, vert.y) - centerPos).LengthFast();
-      if(len >= clearRadius && len <= clearRadius + width){
-        float inHill = (len - clearRadius) / width;
-        float s = xMath::PI*2 * inHill - xMath::PI;
-        float h = (xMath::Cos16(s)+1) * 0.5f * height;
-        // h = xMath::EpsRound(h, TERRAIN_EPSILON_VERT);
-        if(h >= 0 && vert.z < h){
-          if(setHeight)
-            vert.z = h;
-          else
-            vert.z += h;
-          maxHeight = Max(maxHeight, vert.z);
-          Height(x, y) = vert.z;
-        }else if(h < 0 && vert.z > h){
-          if(setHeight)
-            vert.z = h;
+  Stamp stamp = Stamp::Hill(centerPos, width, height, clearRadius, setHeight);
+  ApplyStamps(&stamp, 1);
+}
+void xTerrainVerts::ClearRadius(const xVec2& centerPos, float radius, float height)
+{
+  Stamp stamp = Stamp::Clear(centerPos, radius, height);
+  ApplyStamps(&stamp, 1);
+}
+
+void xTerrainVerts::StampTile(int tileNum, const StampJob& job)
+{
+  // the tile owns its samples but the repeated right and bottom edges, the last tiles own them too
+  int tileX = tileNum % tilesX;
+  int tileY = tileNum / tilesX;
+  int ownX0 = tileX << TILE_SHIFT;
+  int ownY0 = tileY << TILE_SHIFT;
+  int ownX1 = tileX == tilesX-1 ? steps.x-1 : ownX0 + TILE_SIZE-1;
+  int ownY1 = tileY == tilesY-1 ? steps.y-1 : ownY0 + TILE_SIZE-1;
+  float * samples = (float*)tiles[tileNum].samples;
+
+  float inHill[TILE_STRIDE], profile[TILE_STRIDE];
+  for(int k = job.offsets[tileNum]; k < job.offsets[tileNum+1]; k++)
+  {
+    const Stamp& stamp = job.stamps[job.indices[k]];
+    const StampRect& rect = job.rects[job.indices[k]];
+    int x0 = Max(rect.x0, ownX0), x1 = Min(rect.x1, ownX1);
+    int y0 = Max(rect.y0, ownY0), y1 = Min(rect.y1, ownY1);
+    for(int y = y0; y <= y1; y++)
+    {
+      float * row = samples + (y - ownY0) * TILE_STRIDE + x0 - ownX0;
+      int x;
+      if(stamp.type == Stamp::CLEAR)
+      {
+        for(x = x0; x <= x1; x++)
+        {
+          if((Pos(x, y) - stamp.center).LengthFast() <= stamp.radius)
+            row[x - x0] = stamp.height;
+        }
+        continue;
+      }
+      // the profile of the row is done at once, samples out of the ring get -1
+      for(x = x0; x <= x1; x++)
+      {
+        float len = (Pos(x, y) - stamp.center).LengthFast();
+        inHill[x - x0] = len >= stamp.radius && len <= stamp.radius + stamp.width
+          ? (len - stamp.radius) / stamp.width : -1.0f;
+      }
+      xSIMD::Processor->RaisedCosine(profile, inHill, x1 - x0 + 1);
+      for(x = x0; x <= x1; x++)
+      {
+        if(inHill[x - x0] < 0)
+          continue;
+        float h = profile[x - x0] * stamp.height;
+        float& z = row[x - x0];
+        if((h >= 0 && z < h) || (h < 0 && z > h)){
+          if(stamp.setHeight)
+            z = h;
           else
-            vert.z += h;
-          minHeight = Min(minHeight, vert.z);
-          Height(x, y) = vert.z;
+            z += h;
         }
       }
     }
+  }
 }
-void xTerrainVerts::ClearRadius(const xVec2& centerPos, float radius, float height)
+
+void xTerrainVerts::StampTileProc(void * params, int i)
 {
-  for(int x = 0; x < steps.x; x++)
-    for(int y = 0; y < steps.y; y++){
-      xVec2 pos = Pos(x,y);
-      float len = (pos - centerPos).LengthFast();
-      if(len <= radius)
-        Height(x, y) = height;
+  StampJob * job = (StampJob*)params;
+  job->terrain->StampTile(job->tileNums[i], *job);
+}
+
+void xTerrainVerts::CopyTileEdges(int tileX, int tileY)
+{
+  // the first column and row of the tile are repeated by the tiles on the left and above
+  int countX, countY;
+  TileCounts(tileX, tileY, countX, countY);
+  const float * src = (const float*)tiles[tileY * tilesX + tileX].samples;
+  if(tileX > 0)
+  {
+    float * dst = (float*)tiles[tileY * tilesX + tileX-1].samples + TILE_SIZE;
+    for(int y = 0; y < countY; y++)
+      dst[y * TILE_STRIDE] = src[y * TILE_STRIDE];
+  }
+  if(tileY > 0)
+  {
+    float * dst = (float*)tiles[(tileY-1) * tilesX + tileX].samples + TILE_SIZE * TILE_STRIDE;
+    MEMCPY(dst, src, countX * sizeof(float));
+  }
+  if(tileX > 0 && tileY > 0)
+  {
+    float * dst = (float*)tiles[(tileY-1) * tilesX + tileX-1].samples + TILE_SIZE * TILE_STRIDE + TILE_SIZE;
+    *dst = *src;
+  }
+}
+
+void xTerrainVerts::ApplyStamps(const Stamp * stamps, int count, int threadsNumber)
+{
+  ASSERT(!IsPaged() && format == FORMAT_FLOAT);
+  // the bounding rects of the stamps in samples, features out of the grid are dropped
+  xArray<StampRect> rects;
+  rects.SetCount(count, true);
+  int tilesNumber = tilesX * tilesY;
+  xArray<int> offsets;
+  offsets.SetCount(tilesNumber + 1, true);
+  MEMSET(offsets.Ptr(), 0, sizeof(int) * offsets.Count());
+  int i, tileX, tileY;
+  for(i = 0; i < count; i++)
+  {
+    const Stamp& stamp = stamps[i];
+    StampRect& rect = rects[i];
+    float outer = stamp.type == Stamp::HILL ? stamp.radius + stamp.width : stamp.radius;
+    xVec2 center = MapPos(stamp.center);
+    float radiusX = outer / gridSize.x, radiusY = outer / gridSize.y;
+    rect.x0 = Max(0, (int)xMath::Floor(center.x - radiusX));
+    rect.y0 = Max(0, (int)xMath::Floor(center.y - radiusY));
+    rect.x1 = Min(steps.x-1, (int)xMath::Ceil(center.x + radiusX));
+    rect.y1 = Min(steps.y-1, (int)xMath::Ceil(center.y + radiusY));
+    if(outer < 0 || rect.x0 > rect.x1 || rect.y0 > rect.y1)
+    {
+      rect.x1 = rect.x0 - 1;
+      continue;
+    }
+    for(tileY = Min(rect.y0 >> TILE_SHIFT, tilesY-1); tileY <= Min(rect.y1 >> TILE_SHIFT, tilesY-1); tileY++)
+      for(tileX = Min(rect.x0 >> TILE_SHIFT, tilesX-1); tileX <= Min(rect.x1 >> TILE_SHIFT, tilesX-1); tileX++)
+        offsets[tileY * tilesX + tileX + 1]++;
+  }
+
+  // stamps are sorted into their tiles keeping the order
+  xArray<int> tileNums;
+  for(i = 0; i < tilesNumber; i++)
+  {
+    if(offsets[i + 1] > 0)
+      tileNums.Append(i);
+    offsets[i + 1] += offsets[i];
+  }
+  if(!tileNums.Count())
+  {
+    return;
+  }
+  xArray<int> indices, next;
+  indices.SetCount(offsets[tilesNumber], true);
+  next = offsets;
+  for(i = 0; i < count; i++)
+  {
+    const StampRect& rect = rects[i];
+    if(rect.x0 > rect.x1)
+      continue;
+    for(tileY = Min(rect.y0 >> TILE_SHIFT, tilesY-1); tileY <= Min(rect.y1 >> TILE_SHIFT, tilesY-1); tileY++)
+      for(tileX = Min(rect.x0 >> TILE_SHIFT, tilesX-1); tileX <= Min(rect.x1 >> TILE_SHIFT, tilesX-1); tileX++)
+        indices[next[tileY * tilesX + tileX]++] = i;
+  }
+
+  StampJob job;
+  job.terrain = this;
+  job.stamps = stamps;
+  job.rects = rects.Ptr();
+  job.offsets = offsets.Ptr();
+  job.indices = indices.Ptr();
+  job.tileNums = tileNums.Ptr();
+  if(tileNums.Count() <= STAMP_SERIAL_TILES)
+  {
+    // a single hill of CreateHill or ClearRadius isn't worth waking the threads
+    threadsNumber = 1;
+  }
+  xThread::ParallelFor(StampTileProc, &job, tileNums.Count(),
+    threadsNumber > 0 ? threadsNumber : xThread::ProcessorsNumber());
+
+  // repeated edges are copied after all tiles are done, then the bounds of the changed tiles
+  // and their neighbours on the left and above are made exact
+  for(i = 0; i < tileNums.Count(); i++)
+  {
+    CopyTileEdges(tileNums[i] % tilesX, tileNums[i] / tilesX);
+  }
+  for(i = 0; i < tileNums.Count(); i++)
+  {
+    tileX = tileNums[i] % tilesX;
+    tileY = tileNums[i] / tilesX;
+    for(int y = Max(0, tileY-1); y <= tileY; y++)
+    {
+      for(int x = Max(0, tileX-1); x <= tileX; x++)
+      {
+        UpdateTileBounds(x, y);
+        const Tile& tile = tiles[y * tilesX + x];
+        minHeight = Min(minHeight, tile.minHeight);
+        maxHeight = Max(maxHeight, tile.maxHeight);
+      }
+    }
+  }
+}
+
+void xTerrainVerts::StoreGrid(const float * grid)
+{
+  // every tile takes its edge samples too, so the repeated ones stay equal
+  for(int tileY = 0; tileY < tilesY; tileY++)
+  {
+    for(int tileX = 0; tileX < tilesX; tileX++)
+    {
+      int countX, countY;
+      TileCounts(tileX, tileY, countX, countY);
+      float * dst = (float*)tiles[tileY * tilesX + tileX].samples;
+      const float * src = grid + MapIndex(tileX << TILE_SHIFT, tileY << TILE_SHIFT);
+      for(int y = 0; y < countY; y++, dst += TILE_STRIDE, src += steps.x)
+      {
+        MEMCPY(dst, src, countX * sizeof(float));
+      }
+    }
+  }
+}
+
+void xTerrainVerts::SmoothRow(float * dst, float * sums, const float * up, const float * row, const float * down,
+  int width, bool isReference)
+{
+  // every sum is rounded to float on its own, so both paths add in the same order
+  const float scale = 1.0f / 9;
+  int x;
+  if(isReference)
+  {
+    for(x = 0; x < width; x++)
+    {
+      float s = up[x] + row[x];
+      sums[x] = s + down[x];
     }
+    for(x = 1; x < width-1; x++)
+    {
+      float h = sums[x-1] + sums[x];
+      h = h + sums[x+1];
+      dst[x] = h * scale;
+    }
+  }
+  else
+  {
+    xSIMD::Processor->Add(sums, (float*)up, (float*)row, width);
+    xSIMD::Processor->Add(sums, sums, (float*)down, width);
+    xSIMD::Processor->Add(dst + 1, sums, sums + 1, width - 2);
+    xSIMD::Processor->Add(dst + 1, dst + 1, sums + 2, width - 2);
+    xSIMD::Processor->Mul(dst + 1, scale, dst + 1, width - 2);
+  }
+  // edge samples are clamped, so they count twice
+  float h = sums[0] + sums[0];
+  h = h + sums[1];
+  dst[0] = h * scale;
+  h = sums[width-2] + sums[width-1];
+  h = h + sums[width-1];
+  dst[width-1] = h * scale;
 }
 
-void xTerrainVerts::Smooth(int count)
+void xTerrainVerts::SmoothBandProc(void * params, int i)
 {
-  xArray<float> temp = heights;
-  float newMinHeight = maxHeight, newMaxHeight = 0;
+  SmoothJob * job = (SmoothJob*)params;
+  int width = job->width;
+  int lastY = Min(job->height, (i + 1) * (int)SMOOTH_BAND);
+  for(int y = i * SMOOTH_BAND; y < lastY; y++)
+  {
+    const float * row = job->src + y * width;
+    const float * up = y > 0 ? row - width : row;
+    const float * down = y < job->height-1 ? row + width : row;
+    SmoothRow(job->dst + y * width, job->sums + i * width, up, row, down, width, job->isReference);
+  }
+}
+
+void xTerrainVerts::Smooth(int count, int threadsNumber, bool isReference)
+{
+  ASSERT(!IsPaged() && format == FORMAT_FLOAT);
+  if(count <= 0)
+  {
+    return;
+  }
+  // tiles repeat their edges, so the filter ping-pongs between two plain copies of the grid
+  int width = steps.x, height = steps.y;
+  int samplesNumber = width * height;
+  int bandsNumber = (height + SMOOTH_BAND - 1) / SMOOTH_BAND;
+  xArray<float> grids, sums;
+  grids.SetCount(samplesNumber * 2, true);
+  sums.SetCount(bandsNumber * width, true);
+  float * src = grids.Ptr();
+  float * dst = src + samplesNumber;
+  HeightsRect(0, 0, width, height, src, width);
+
+  SmoothJob job;
+  job.sums = sums.Ptr();
+  job.width = width;
+  job.height = height;
+  job.isReference = isReference;
+  if(isReference)
+  {
+    threadsNumber = 1;
+  }
+  else if(threadsNumber <= 0)
+  {
+    threadsNumber = xThread::ProcessorsNumber();
+  }
   int i;
-  for(i = 0; i < count; i++){
-    for(int x = 0; x < steps.x; x++)
-      for(int y = 0; y < steps.y; y++){
-        float h = 0;
-        int cnt = 0;
-        for(int dx = -1; dx <= 1; dx++)
-          for(int dy = -1; dy <= 1; dy++, cnt++){
-            int curX = Clamp(x + dx, 0, steps.x-1);
-            int curY = Clamp(y + dy, 0, steps.y-1);
-            h += Height(curX, curY);
-          }
-        h /= cnt;
-        temp[MapIndex(x, y)] = h;
-        if(i == count-1)
-        {
-          newMinHeight = Min(newMinHeight, h);
-          newMaxHeight = Max(newMaxHeight, h);
-        }
+  for(i = 0; i < count; i++)
+  {
+    job.src = src;
+    job.dst = dst;
+    xThread::ParallelFor(SmoothBandProc, &job, bandsNumber, threadsNumber);
+    dst = src;
+    src = job.dst;
+  }
+
+  float newMinHeight, newMaxHeight;
+  if(isReference)
+  {
+    newMinHeight = newMaxHeight = src[0];
+    for(i = 0; i < samplesNumber; i++)
+    {
+      newMinHeight = Min(newMinHeight, src[i]);
+      newMaxHeight = Max(newMaxHeight, src[i]);
+    }
+  }
+  else
+  {
+    xSIMD::Processor->MinMax(newMinHeight, newMaxHeight, src, samplesNumber);
+  }
+  // the range takes in 0 and the old maxHeight like it always did
+  newMinHeight = Min(newMinHeight, maxHeight);
+  newMaxHeight = Max(newMaxHeight, 0.0f);
+
+  // the smoothed range is stretched back to the one before
+  if(newMaxHeight - newMinHeight > 0)
+  {
+    float scale = (maxHeight - minHeight) / (newMaxHeight - newMinHeight);
+    float offset = (minHeight + maxHeight) * 0.5f - (newMinHeight + newMaxHeight) * 0.5f * scale;
+    if(isReference)
+    {
+      for(i = 0; i < samplesNumber; i++)
+      {
+        float h = src[i] * scale;
+        src[i] = h + offset;
       }
-    heights = temp;
+    }
+    else
+    {
+      xSIMD::Processor->Mul(src, scale, src, samplesNumber);
+      xSIMD::Processor->Add(src, offset, src, samplesNumber);
+    }
   }
-  if(newMaxHeight - newMinHeight <= 0)
+  StoreGrid(src);
+  UpdateBounds();
+}
+
+// =================================================================
+
+void xTerrainVerts::Quantize()
+{
+  ASSERT(!IsPaged());
+  if(format == FORMAT_UINT16)
+  {
     return;
+  }
+  // every tile spends the 16 bits on its own height range
+  UpdateBounds();
+  int tilesNumber = tilesX * tilesY;
+  xArray<byte> quantized;
+  quantized.SetCount(tilesNumber * TILE_SAMPLES * sizeof(word), true);
+  int i;
+  for(i = 0; i < tilesNumber; i++)
+  {
+    Tile& tile = tiles[i];
+    const float * src = (const float*)tile.samples;
+    word * dst = (word*)quantized.Ptr() + i * TILE_SAMPLES;
+    tile.scale = (tile.maxHeight - tile.minHeight) / 0xffff;
+    tile.bias = tile.minHeight;
+    float invScale = tile.scale > 0 ? 1.0f / tile.scale : 0;
+    for(int j = 0; j < TILE_SAMPLES; j++)
+    {
+      // samples past the grid are out of the tile range, they are clamped
+      dst[j] = (word)Clamp((int)((src[j] - tile.bias) * invScale + 0.5f), 0, 0xffff);
+    }
+  }
+  samples = quantized;
+  format = FORMAT_UINT16;
+  for(i = 0; i < tilesNumber; i++)
+  {
+    tiles[i].samples = samples.Ptr() + i * TileBytes();
+  }
+}
 
-  count = heights.Count();
-  float midHeight = (minHeight + maxHeight) * 0.5f;
-  float newMidHeight = (newMinHeight + newMaxHeight) * 0.5f;
-  float scale = (maxHeight - minHeight) / (newMaxHeight - newMinHeight);
-  for(i = 0; i < count; i++){
-    float h = heights[i];
-    // heights[i] = xMath::EpsRound((vert.z - newMidHeight) * scale + midHeight, TERRAIN_EPSILON_VERT);
-    heights[i] = (h - newMidHeight) * scale + midHeight;
+bool xTerrainVerts::Save(const xString& filename) const
+{
+  ASSERT(!IsPaged() && tiles);
+  FILE * f;
+  if(_tfopen_s(&f, filename.ToChar(), _T("wb")) != 0)
+  {
+    return false;
+  }
+
+  FileHeader header;
+  header.id = FileHeader::ID;
+  header.version = FileHeader::VERSION;
+  header.format = format;
+  header.stepsX = steps.x;
+  header.stepsY = steps.y;
+  header.tileSize = TILE_SIZE;
+  header.sizeX = size.x;
+  header.sizeY = size.y;
+  header.minHeight = minHeight;
+  header.maxHeight = maxHeight;
+
+  // float bounds are made exact, the in-memory ones may only have grown,
+  // quantized tiles can't be edited, so theirs are exact already
+  int tilesNumber = tilesX * tilesY;
+  xArray<FileTile> fileTiles;
+  fileTiles.SetCount(tilesNumber, true);
+  for(int tileY = 0; tileY < tilesY; tileY++)
+  {
+    for(int tileX = 0; tileX < tilesX; tileX++)
+    {
+      const Tile& tile = tiles[tileY * tilesX + tileX];
+      FileTile& fileTile = fileTiles[tileY * tilesX + tileX];
+      fileTile.minHeight = tile.minHeight;
+      fileTile.maxHeight = tile.maxHeight;
+      fileTile.scale = tile.scale;
+      fileTile.bias = tile.bias;
+      if(format == FORMAT_FLOAT)
+      {
+        int countX, countY;
+        TileCounts(tileX, tileY, countX, countY);
+        SampleBounds((const float*)tile.samples, countX, countY, fileTile.minHeight, fileTile.maxHeight);
+      }
+    }
+  }
+
+  bool isOk = fwrite(&header, sizeof(header), 1, f) == 1
+    && fwrite(fileTiles.Ptr(), sizeof(FileTile) * tilesNumber, 1, f) == 1;
+  for(int i = 0; isOk && i < tilesNumber; i++)
+  {
+    isOk = fwrite(tiles[i].samples, TileBytes(), 1, f) == 1;
+  }
+  return fclose(f) == 0 && isOk;
+}
+
+bool xTerrainVerts::Open(const xString& filename, int p_tileBudget, bool isMapped)
+{
+  Close();
+  file = CreateFile(filename.ToChar(), GENERIC_READ, FILE_SHARE_READ, NULL,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+  if(file == INVALID_HANDLE_VALUE)
+  {
+    return false;
+  }
+
+  LARGE_INTEGER fileSize;
+  FileHeader header;
+  if(!GetFileSizeEx(file, &fileSize)
+    || !ReadFileAt(file, 0, &header, sizeof(header))
+    || header.id != FileHeader::ID || header.version != FileHeader::VERSION
+    || (header.format != FORMAT_FLOAT && header.format != FORMAT_UINT16)
+    || header.tileSize != TILE_SIZE || header.stepsX < 2 || header.stepsY < 2)
+  {
+    Close();
+    return false;
+  }
+  InitGrid(xVec2(header.sizeX, header.sizeY), header.stepsX, header.stepsY);
+  format = header.format;
+  minHeight = header.minHeight;
+  maxHeight = header.maxHeight;
+
+  int tilesNumber = tilesX * tilesY;
+  tilesOffset = sizeof(header) + sizeof(FileTile) * tilesNumber;
+  xArray<FileTile> fileTiles;
+  fileTiles.SetCount(tilesNumber, true);
+  if((uint64)fileSize.QuadPart < tilesOffset + (uint64)tilesNumber * TileBytes()
+    || !ReadFileAt(file, sizeof(header), fileTiles.Ptr(), sizeof(FileTile) * tilesNumber))
+  {
+    Close();
+    return false;
+  }
+  for(int i = 0; i < tilesNumber; i++)
+  {
+    tiles[i].minHeight = fileTiles[i].minHeight;
+    tiles[i].maxHeight = fileTiles[i].maxHeight;
+    tiles[i].scale = fileTiles[i].scale;
+    tiles[i].bias = fileTiles[i].bias;
+  }
+
+  // four tiles at least, a bilinear sample or a culling block may cross tile edges
+  tileBudget = Max(4, p_tileBudget / TileBytes());
+  if(isMapped)
+  {
+    MapFile();
+  }
+  return true;
+}
+
+bool xTerrainVerts::MapFile()
+{
+  ASSERT(IsPaged() && !fileView);
+
+  // if the address space is too small tiles are read on demand as usual
+  fileMapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if(!fileMapping)
+  {
+    return false;
+  }
+  fileView = (byte*)MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+  if(!fileView)
+  {
+    CloseHandle(fileMapping);
+    fileMapping = NULL;
+    return false;
+  }
+  for(int i = 0; i < tilesX * tilesY; i++)
+  {
+    tiles[i].samples = fileView + tilesOffset + (uint64)i * TileBytes();
   }
+  return true;
 }
 
 //#define DEF_EPSILON_VERT 0.0001f // 1/10 mm
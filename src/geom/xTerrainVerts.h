@@ -7,7 +7,139 @@
 
 class xTerrainVerts
 {
-  xArray<float> heights;
+public:
+
+  enum
+  {
+    TILE_SHIFT = 6,
+    TILE_SIZE = 1 << TILE_SHIFT,   // grid cells per tile side
+    TILE_STRIDE = TILE_SIZE + 1,   // samples per tile row, the last ones repeat the next tile
+    TILE_SAMPLES = TILE_STRIDE * TILE_STRIDE
+  };
+
+  enum
+  {
+    FORMAT_FLOAT,  // 32-bit float samples, the terrain can be edited
+    FORMAT_UINT16  // 16-bit samples scaled to the height range of their tile, read only
+  };
+
+  // a feature stamped into the grid, only the samples of its bounding rect are visited
+  struct Stamp
+  {
+    enum
+    {
+      HILL,  // cosine hill on the ring [radius, radius + width], radius may be negative
+      CLEAR  // the height is set inside radius
+    };
+
+    int type;
+    xVec2 center;
+    float radius;
+    float width;
+    float height;
+    bool setHeight; // a hill sets heights instead of adding to them
+
+    static Stamp Hill(const xVec2& center, float width, float height, float clearRadius, bool setHeight)
+    {
+      Stamp stamp = { HILL, center, clearRadius, width, height, setHeight };
+      return stamp;
+    }
+    static Stamp Hill(const xVec2& center, float width, float height, bool setHeight)
+    {
+      return Hill(center, width, height, -width * 0.5f, setHeight);
+    }
+    static Stamp Clear(const xVec2& center, float radius, float height)
+    {
+      Stamp stamp = { CLEAR, center, radius, 0, height, true };
+      return stamp;
+    }
+  };
+
+private:
+
+  // tiles share their edge samples, so all four corners of any grid cell are in one tile
+  struct Tile
+  {
+    byte * samples;    // TILE_STRIDE rows, NULL if a paged tile isn't resident, may point to the file view
+    float minHeight, maxHeight;
+    float scale, bias; // FORMAT_UINT16 samples are value * scale + bias
+    xLinkList<Tile> lruNode; // in the LRU list while a paged tile is resident
+
+    Tile()
+    {
+      samples = NULL;
+      minHeight = maxHeight = 0;
+      scale = bias = 0;
+      lruNode.SetOwner(this);
+    }
+  };
+
+  // the packed file is the header, the table of tiles and tiles of TileBytes() row by row
+  struct FileHeader
+  {
+    enum
+    {
+      ID = 'H' | ('G' << 8) | ('T' << 16) | ('X' << 24),
+      VERSION = 2
+    };
+
+    int id;
+    int version;
+    int format;
+    int stepsX, stepsY;
+    int tileSize;
+    float sizeX, sizeY;
+    float minHeight, maxHeight;
+  };
+
+  struct FileTile
+  {
+    float minHeight, maxHeight;
+    float scale, bias;
+  };
+
+  enum
+  {
+    SAMPLE_BATCH = 256, // samples gathered on the stack before they are blended
+    SMOOTH_BAND = 32,   // grid rows smoothed by one job
+    STAMP_SERIAL_TILES = 2 // stamps touching so few tiles are applied on the calling thread
+  };
+
+  struct SampleJob
+  {
+    const xTerrainVerts * terrain;
+    const xVec2 * pos;
+    float * heights;
+    xVec3 * normals;
+    int count;
+  };
+
+  struct StampRect
+  {
+    int x0, y0, x1, y1; // samples, inclusive
+  };
+
+  struct StampJob
+  {
+    xTerrainVerts * terrain;
+    const Stamp * stamps;
+    const StampRect * rects;
+    const int * offsets;    // stamps of tile i are indices[offsets[i], offsets[i+1])
+    const int * indices;
+    const int * tileNums;   // tiles touched by the stamps
+  };
+
+  struct SmoothJob
+  {
+    const float * src;
+    float * dst;
+    float * sums;     // a row of vertical sums for every band
+    int width, height;
+    bool isReference;
+  };
+
+  xArray<byte> samples; // all tiles of the in-memory terrain
+  int format;
 
   struct {
     int x,y;
@@ -18,6 +150,50 @@ class xTerrainVerts
 
   xVec2 corner;
 
+  Tile * tiles;
+  int tilesX, tilesY;
+
+  // paged terrains are read only, tiles come from the packed file on demand
+  HANDLE file;
+  HANDLE fileMapping;
+  byte * fileView;
+  uint64 tilesOffset;
+  int tileBudget;             // resident tiles of the read path
+  mutable int residentTiles;
+  mutable xLinkList<Tile> tileLRU; // the most recently used go first
+
+  void Clear();
+  void InitGrid(const xVec2& size, int stepsX, int stepsY);
+  void UpdateBounds();
+  void UpdateTileBounds(int tileX, int tileY);
+  void CopyTileEdges(int tileX, int tileY);
+  void StampTile(int tileNum, const StampJob& job);
+  static void StampTileProc(void * params, int i);
+  bool MapFile();
+
+  Tile * TileAt(int x, int y, int& localX, int& localY) const;
+  const byte * TileSamples(Tile * tile) const;
+  float Sample(const Tile * tile, const byte * samples, int i) const
+  {
+    return format == FORMAT_FLOAT ? ((const float*)samples)[i]
+      : ((const word*)samples)[i] * tile->scale + tile->bias;
+  }
+  void LoadTile(Tile * tile) const;
+  void SetTileHeight(int tileX, int tileY, int localX, int localY, float h);
+  void TileCounts(int tileX, int tileY, int& countX, int& countY) const;
+
+  void StoreGrid(const float * grid);
+  void SampleBatch(const xVec2 * pos, float * heights, xVec3 * normals, int count) const;
+  static void SampleProc(void * params, int i);
+  static void SmoothRow(float * dst, float * sums, const float * up, const float * row, const float * down,
+    int width, bool isReference);
+  static void SmoothBandProc(void * params, int i);
+
+  static void SampleBounds(const float * heights, int countX, int countY, float& minHeight, float& maxHeight);
+  static bool ReadFileAt(HANDLE f, uint64 offset, void * buf, uint32 size);
+
+  xTerrainVerts(const xTerrainVerts&);
+  void operator=(const xTerrainVerts&);
 
   // void ExportPhys(xArray<xPhysConvex*>& convexList, const xArray<xDrawVert>& drawVerts, const xArray<int>& indexes, bool clearList = true);
   int CreateBrushPlanes(xPlane * out, xArray<xDrawVert>& drawVerts, int * vertMap, int vertCount, float downPlane);
@@ -29,6 +205,7 @@ public:
 
   xTerrainVerts();
   xTerrainVerts(const xVec2& size, const xVec2& gridSize);
+  ~xTerrainVerts();
 
   int XPointsNumber() const { return steps.x; }
   int YPointsNumber() const { return steps.y; }
@@ -38,23 +215,63 @@ public:
   int MapIndex(int x, int y) const;
   // xVec2 MapVert(float xScale, float yScale);
 
+  // a paged tile is loaded if it isn't resident, so the first touch of a tile reads the file;
+  // tiles are loaded by the calling thread and nothing is locked, use the terrain on one thread
   float Height(int x, int y) const;
-  float& Height(int x, int y);
+  void SetHeight(int x, int y, float h); // FORMAT_FLOAT only
 
   xVec2 Pos(int x, int y) const;
   xVec3 Vert(int x, int y) const;
 
   float Height(const xVec2& pos);
+  // bilinear heights of count positions, normals of the bilinear patches are optional;
+  // batches are shared by threadsNumber threads, all processors if it's 0,
+  // unless paged tiles would be read on the way
+  void Heights(const xVec2 * pos, float * heights, int count, xVec3 * normals = NULL, int threadsNumber = 1) const;
   void MapPos(const xVec2& pos, int& x, int& y, bool nearest = false, int mip = 0);
+  xVec2 MapPos(const xVec2& pos) const; // unclamped grid coordinates
 
   const xVec2& Size() const { return size; }
   const xVec2& GridSize() const { return gridSize; } 
 
+  int Format() const { return format; }
+  int TileBytes() const { return TILE_SAMPLES * (format == FORMAT_FLOAT ? (int)sizeof(float) : (int)sizeof(word)); }
+
+  // the samples [x, x+sizeX) x [y, y+sizeY) are decoded to out rows of pitch floats
+  // by xSIMDProcessor, so meshes take heights a row at a time
+  void HeightsRect(int x, int y, int sizeX, int sizeY, float * out, int pitch) const;
+
+  int TilesX() const { return tilesX; }
+  int TilesY() const { return tilesY; }
+  int ResidentTiles() const { return IsPaged() ? residentTiles : tilesX * tilesY; }
+  bool IsPaged() const { return file != INVALID_HANDLE_VALUE; }
+
+  // bounds of the samples [x, x+sizeX] x [y, y+sizeY] by the height ranges of the tiles
+  // they touch, heights aren't read, so paged tiles stay on disk
+  void Bounds(int x, int y, int sizeX, int sizeY, xBounds& bounds) const;
+
   void Init(const xVec2& size, const xVec2& gridSize);
   void CreateHill(const xVec2& centerPos, float width, float height, bool setHeight);
   void CreateHill(const xVec2& centerPos, float width, float height, float clearRadius, bool setHeight);
   void ClearRadius(const xVec2& centerPos, float radius, float height = 0);
-  void Smooth(int count = 1);
+  // stamps are applied in order, tiles touched by them are shared by threadsNumber threads,
+  // all processors if it's 0, or just the calling one for a couple of tiles; every tile owns its samples,
+  // so threads never write the same one
+  void ApplyStamps(const Stamp * stamps, int count, int threadsNumber = 0);
+  // 3x3 box filter by rows of vertical sums, bands of rows are shared by threadsNumber threads,
+  // all processors if it's 0; the reference mode is plain scalar code on the calling thread,
+  // the result is the same to the bit
+  void Smooth(int count = 1, int threadsNumber = 0, bool isReference = false);
+
+  // the finished in-memory terrain takes half of the memory, it can't be edited any longer
+  void Quantize();
+
+  // the in-memory terrain is written as the packed file of tiles in its format
+  bool Save(const xString& filename) const;
+  // the terrain is paged from the packed file, at most tileBudget bytes of tiles are resident,
+  // the whole file is mapped if isMapped is set and the address space is enough
+  bool Open(const xString& filename, int tileBudget, bool isMapped = false);
+  void Close();
 
   // void Export(xArray<xDrawVert>& drawVerts, xArray<int>& indexes, xBrushMap::Group * groupMap, xArray<xSurface*> * pConvexSurfList, xArray<xPhysConvex*> * pConvexList, int maxMergeCount = -1, float downPlane = xMath::INFINITY, bool quadSplit = false, int clearConvexList = CLEAR_SURF | CLEAR_PHYS, const xBrushMap::Material& material = xBrushMap::Material());
   // void Export(xBrushMap::Group * groupMap, xArray<xSurface*> * pConvexSurfList, xArray<xPhysConvex*> * pConvexList, int maxMergeCount = -1, float downPlane = xMath::INFINITY, bool quadSplit = false, int clearConvexList = CLEAR_SURF | CLEAR_PHYS, const xBrushMap::Material& material = xBrushMap::Material());
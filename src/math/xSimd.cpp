@@ -1,5 +1,9 @@
 #include <xForm.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 static xSIMDProcessor * processor = NULL;			// pointer to SIMD processor
 static xSIMDProcessor * generic = NULL;				// pointer to generic SIMD implementation
 xSIMDProcessor * xSIMD::Processor = NULL;
@@ -51,6 +55,71 @@ void __cdecl xSIMD::Shutdown()
   Initialized = false;
 }
 
+/*
+============
+GetCPUID
+
+  feature bits of the standard and the extended cpuid leaves
+============
+*/
+static cpuid_t GetCPUID()
+{
+#ifdef _MSC_VER
+	int regs[4];	// eax, ebx, ecx, edx
+	int flags = 0;
+
+	// the vendor string is in ebx, edx, ecx
+	char vendor[12];
+	__cpuid(regs, 0);
+	int maxLeaf = regs[0];
+	MEMCPY(vendor + 0, &regs[1], 4);
+	MEMCPY(vendor + 4, &regs[3], 4);
+	MEMCPY(vendor + 8, &regs[2], 4);
+	if (MEMCMP(vendor, "GenuineIntel", 12) == 0) {
+		flags |= CPUID_INTEL;
+	} else if (MEMCMP(vendor, "AuthenticAMD", 12) == 0) {
+		flags |= CPUID_AMD;
+	}
+
+	if (maxLeaf >= 1) {
+		__cpuid(regs, 1);
+		if (regs[3] & (1 << 15)) {
+			flags |= CPUID_CMOV;
+		}
+		if (regs[3] & (1 << 23)) {
+			flags |= CPUID_MMX;
+		}
+		if (regs[3] & (1 << 25)) {
+			flags |= CPUID_SSE;
+		}
+		if (regs[3] & (1 << 26)) {
+			flags |= CPUID_SSE2;
+		}
+		if (regs[3] & (1 << 28)) {
+			flags |= CPUID_HTT;
+		}
+		if (regs[2] & (1 << 0)) {
+			flags |= CPUID_SSE3;
+		}
+	}
+
+	__cpuid(regs, 0x80000000);
+	if ((unsigned)regs[0] >= 0x80000001) {
+		__cpuid(regs, 0x80000001);
+		if (regs[3] & (1 << 31)) {
+			flags |= CPUID_3DNOW;
+		}
+	}
+
+	if (!(flags & (CPUID_MMX | CPUID_SSE | CPUID_SSE2 | CPUID_SSE3 | CPUID_3DNOW))) {
+		flags |= CPUID_GENERIC;
+	}
+	return (cpuid_t)flags;
+#else
+	return CPUID_GENERIC;
+#endif
+}
+
 /*
 ============
 xSIMD::InitProcessor
@@ -60,7 +129,7 @@ void xSIMD::InitProcessor(const xString& module, bool forceGeneric)
 {
 	xSIMDProcessor *newProcessor;
 
-	cpuid_t cpuid = CPUID_GENERIC; // ??? get cpuid this
+	cpuid_t cpuid = GetCPUID();
 
 	if (forceGeneric) {
 
@@ -90,7 +159,9 @@ void xSIMD::InitProcessor(const xString& module, bool forceGeneric)
 
 	if (newProcessor != xSIMD::Processor) {
 		xSIMD::Processor = newProcessor;
-		xForm::x->Print(PT_Message, "%s using %s for SIMD processing\n", module, xSIMD::Processor->Name());
+		if (xForm::x) {
+			xForm::x->Print(PT_Message, _T("%s using %s for SIMD processing\n"), (const TCHAR *)module, xSIMD::Processor->Name());
+		}
 	}
 
 	if (cpuid & CPUID_FTZ) {
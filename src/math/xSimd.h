@@ -149,6 +149,19 @@ public:
 	virtual void VPCALL TracePointCull(byte *cullBits, byte &totalOr, float radius, const xPlane *planes, const xDrawVert *verts, const int numVerts) = 0;
 	virtual void VPCALL DecalPointCull(byte *cullBits, const xPlane *planes, const xDrawVert *verts, const int numVerts) = 0;
 	virtual void VPCALL OverlayPointCull(byte *cullBits, xVec2 *texCoords, const xPlane *planes, const xDrawVert *verts, const int numVerts) = 0;
+
+	// bilinear blend of the four corners by fracX and fracY, derivatives by the fractions are optional
+	virtual void VPCALL Bilinear(float *dst, float *derivX, float *derivY, const float *p00, const float *p10, const float *p01, const float *p11, const float *fracX, const float *fracY, const int count) = 0;
+
+	// the hill profile (cos(2 * PI * src[i] - PI) + 1) / 2, src is in [0, 1]
+	virtual void VPCALL RaisedCosine(float *dst, const float *src, const int count) = 0;
+
+	// BGR24 pixels to BGRA32 ones with opaque alpha
+	virtual void VPCALL ExpandBGR24(byte *dst, const byte *src, const int count) = 0;
+	// uint16 values to value * scale + bias
+	virtual void VPCALL Dequantize(float *dst, const word *src, const float scale, const float bias, const int count) = 0;
+	// BGR24 pixels to DXT1/BC1 blocks, dstPitch is the size of a row of blocks
+	virtual void VPCALL CompressBC1(byte *dst, const int dstPitch, const byte *src, const int srcPitch, const int blocksX, const int blocksY) = 0;
 };
 
 #endif /* !__X_SIMD_H__ */
@@ -780,3 +780,208 @@ void VPCALL xSIMD_Generic::OverlayPointCull(byte *cullBits, xVec2 *texCoords, co
 	}
 }
 
+/*
+============
+xSIMD_Generic::Bilinear
+============
+*/
+void VPCALL xSIMD_Generic::Bilinear(float *dst, float *derivX, float *derivY, const float *p00, const float *p10, const float *p01, const float *p11, const float *fracX, const float *fracY, const int count) {
+	for (int i = 0; i < count; i++) {
+		float dx0 = p10[i] - p00[i];
+		float dx1 = p11[i] - p01[i];
+		float h0 = p00[i] + dx0 * fracX[i];
+		float h1 = p01[i] + dx1 * fracX[i];
+		dst[i] = h0 + (h1 - h0) * fracY[i];
+		if (derivX) {
+			derivX[i] = dx0 + (dx1 - dx0) * fracY[i];
+			derivY[i] = h1 - h0;
+		}
+	}
+}
+
+/*
+============
+xSIMD_Generic::RaisedCosine
+============
+*/
+void VPCALL xSIMD_Generic::RaisedCosine(float *dst, const float *src, const int count) {
+	for (int i = 0; i < count; i++) {
+		dst[i] = (xMath::Cos16(xMath::PI*2 * src[i] - xMath::PI) + 1) * 0.5f;
+	}
+}
+
+/*
+============
+xSIMD_Generic::ExpandBGR24
+
+  four pixels are assembled from three dwords
+============
+*/
+void VPCALL xSIMD_Generic::ExpandBGR24(byte *dst, const byte *src, const int count) {
+	int i;
+	dword *d = (dword *)dst;
+	for (i = 0; i + 4 <= count; i += 4, src += 12, d += 4) {
+		dword s0 = ((const dword *)src)[0];
+		dword s1 = ((const dword *)src)[1];
+		dword s2 = ((const dword *)src)[2];
+		d[0] = s0 | 0xff000000;
+		d[1] = (s0 >> 24) | (s1 << 8) | 0xff000000;
+		d[2] = (s1 >> 16) | (s2 << 16) | 0xff000000;
+		d[3] = (s2 >> 8) | 0xff000000;
+	}
+	for (; i < count; i++, src += 3, d++) {
+		*d = src[0] | (src[1] << 8) | (src[2] << 16) | 0xff000000;
+	}
+}
+
+/*
+============
+xSIMD_Generic::Dequantize
+============
+*/
+void VPCALL xSIMD_Generic::Dequantize(float *dst, const word *src, const float scale, const float bias, const int count) {
+	int i;
+	for (i = 0; i + 4 <= count; i += 4) {
+		dst[i+0] = src[i+0] * scale + bias;
+		dst[i+1] = src[i+1] * scale + bias;
+		dst[i+2] = src[i+2] * scale + bias;
+		dst[i+3] = src[i+3] * scale + bias;
+	}
+	for (; i < count; i++) {
+		dst[i] = src[i] * scale + bias;
+	}
+}
+
+/*
+============
+xSIMD_Generic::BC1GatherBlock
+============
+*/
+void xSIMD_Generic::BC1GatherBlock(byte *block, const byte *src, const int srcPitch) {
+	for (int y = 0; y < 4; y++, src += srcPitch) {
+		for (int x = 0; x < 4; x++, block += 4) {
+			block[0] = src[x*3+0];
+			block[1] = src[x*3+1];
+			block[2] = src[x*3+2];
+			block[3] = 0;
+		}
+	}
+}
+
+static X_INLINE word BC1PackColor(const int *color) {
+	return (word)(((color[2] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[0] >> 3));
+}
+
+static X_INLINE void BC1UnpackColor(byte *dst, const word color) {
+	int b = color & 31, g = (color >> 5) & 63, r = color >> 11;
+	dst[0] = (byte)((b << 3) | (b >> 2));
+	dst[1] = (byte)((g << 2) | (g >> 4));
+	dst[2] = (byte)((r << 3) | (r >> 2));
+	dst[3] = 0;
+}
+
+/*
+============
+xSIMD_Generic::BC1Endpoints
+
+  returns color0 | color1 << 16 with color0 >= color1, the palette gets 4 BGRX colors
+============
+*/
+dword xSIMD_Generic::BC1Endpoints(byte *palette, const byte *block, const byte *minColor, const byte *maxColor) {
+	int i, c, t;
+	int minC[3], maxC[3], center[3];
+
+	for (c = 0; c < 3; c++) {
+		// the bounding box is inset a bit, the extreme colors are mostly noise
+		int inset = (maxColor[c] - minColor[c]) >> 4;
+		minC[c] = minColor[c] + inset;
+		maxC[c] = maxColor[c] - inset;
+		center[c] = (minC[c] + maxC[c]) >> 1;
+	}
+
+	// take the box diagonal which follows the colors, blue and red are flipped against green
+	int covBG = 0, covRG = 0;
+	for (i = 0; i < 16; i++, block += 4) {
+		int g = block[1] - center[1];
+		covBG += (block[0] - center[0]) * g;
+		covRG += (block[2] - center[2]) * g;
+	}
+	if (covBG < 0) {
+		t = minC[0]; minC[0] = maxC[0]; maxC[0] = t;
+	}
+	if (covRG < 0) {
+		t = minC[2]; minC[2] = maxC[2]; maxC[2] = t;
+	}
+
+	word color0 = BC1PackColor(maxC);
+	word color1 = BC1PackColor(minC);
+	if (color0 < color1) {
+		word w = color0; color0 = color1; color1 = w;
+	}
+
+	BC1UnpackColor(palette + 0, color0);
+	BC1UnpackColor(palette + 4, color1);
+	for (c = 0; c < 3; c++) {
+		palette[ 8+c] = (byte)((2 * palette[c] + palette[4+c]) / 3);
+		palette[12+c] = (byte)((palette[c] + 2 * palette[4+c]) / 3);
+	}
+	palette[11] = palette[15] = 0;
+
+	return color0 | ((dword)color1 << 16);
+}
+
+/*
+============
+xSIMD_Generic::BC1WriteBlock
+============
+*/
+void xSIMD_Generic::BC1WriteBlock(byte *dst, const dword colors, const dword indices) {
+	((dword *)dst)[0] = colors;
+	((dword *)dst)[1] = indices;
+}
+
+/*
+============
+xSIMD_Generic::CompressBC1
+============
+*/
+void VPCALL xSIMD_Generic::CompressBC1(byte *dst, const int dstPitch, const byte *src, const int srcPitch, const int blocksX, const int blocksY) {
+	byte block[16*4];
+	byte palette[4*4];
+
+	for (int by = 0; by < blocksY; by++) {
+		byte *dstBlock = dst + by * dstPitch;
+		for (int bx = 0; bx < blocksX; bx++, dstBlock += 8) {
+			BC1GatherBlock(block, src + by * 4 * srcPitch + bx * 4 * 3, srcPitch);
+
+			byte minColor[4] = { 255, 255, 255, 0 };
+			byte maxColor[4] = { 0, 0, 0, 0 };
+			int i, c;
+			for (i = 0; i < 16; i++) {
+				for (c = 0; c < 3; c++) {
+					minColor[c] = Min(minColor[c], block[i*4+c]);
+					maxColor[c] = Max(maxColor[c], block[i*4+c]);
+				}
+			}
+
+			dword colors = BC1Endpoints(palette, block, minColor, maxColor);
+			dword indices = 0;
+			if ((colors & 0xffff) != (colors >> 16)) {
+				for (i = 0; i < 16; i++) {
+					const byte *p = block + i*4;
+					int bestDist = 0x7fffffff, bestIndex = 0;
+					for (int k = 0; k < 4; k++) {
+						const byte *q = palette + k*4;
+						int d = (p[0] - q[0]) * (p[0] - q[0]) + (p[1] - q[1]) * (p[1] - q[1]) + (p[2] - q[2]) * (p[2] - q[2]);
+						if (d < bestDist) {
+							bestDist = d;
+							bestIndex = k;
+						}
+					}
+					indices |= bestIndex << (i*2);
+				}
+			}
+			BC1WriteBlock(dstBlock, colors, indices);
+		}
+	}
+}
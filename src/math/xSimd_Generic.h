@@ -72,6 +72,19 @@ public:
 	virtual void VPCALL TracePointCull(byte *cullBits, byte &totalOr, float radius, const xPlane *planes, const xDrawVert *verts, const int numVerts);
 	virtual void VPCALL DecalPointCull(byte *cullBits, const xPlane *planes, const xDrawVert *verts, const int numVerts);
 	virtual void VPCALL OverlayPointCull(byte *cullBits, xVec2 *texCoords, const xPlane *planes, const xDrawVert *verts, const int numVerts);
+
+	virtual void VPCALL Bilinear(float *dst, float *derivX, float *derivY, const float *p00, const float *p10, const float *p01, const float *p11, const float *fracX, const float *fracY, const int count);
+	virtual void VPCALL RaisedCosine(float *dst, const float *src, const int count);
+
+	virtual void VPCALL ExpandBGR24(byte *dst, const byte *src, const int count);
+	virtual void VPCALL Dequantize(float *dst, const word *src, const float scale, const float bias, const int count);
+	virtual void VPCALL CompressBC1(byte *dst, const int dstPitch, const byte *src, const int srcPitch, const int blocksX, const int blocksY);
+
+protected:
+	// BC1 helpers shared with the SIMD implementations, blocks are 16 BGRX pixels
+	static void BC1GatherBlock(byte *block, const byte *src, const int srcPitch);
+	static dword BC1Endpoints(byte *palette, const byte *block, const byte *minColor, const byte *maxColor);
+	static void BC1WriteBlock(byte *dst, const dword colors, const dword indices);
 };
 
 #endif /* !__X_SIMD_GENERIC_H__ */
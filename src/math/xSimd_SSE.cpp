@@ -4299,4 +4299,65 @@ void VPCALL xSIMD_SSE::OverlayPointCull(byte *cullBits, xVec2 *texCoords, const
 #endif
 }
 
+/*
+============
+xSIMD_SSE::Bilinear
+
+  four samples per iteration, the rows are blended along x first
+============
+*/
+void VPCALL xSIMD_SSE::Bilinear(float *dst, float *derivX, float *derivY, const float *p00, const float *p10, const float *p01, const float *p11, const float *fracX, const float *fracY, const int count) {
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 a00 = _mm_loadu_ps(p00 + i);
+		__m128 a01 = _mm_loadu_ps(p01 + i);
+		__m128 fx = _mm_loadu_ps(fracX + i);
+		__m128 fy = _mm_loadu_ps(fracY + i);
+		__m128 dx0 = _mm_sub_ps(_mm_loadu_ps(p10 + i), a00);
+		__m128 dx1 = _mm_sub_ps(_mm_loadu_ps(p11 + i), a01);
+		__m128 h0 = _mm_add_ps(a00, _mm_mul_ps(dx0, fx));
+		__m128 h1 = _mm_add_ps(a01, _mm_mul_ps(dx1, fx));
+		__m128 dy = _mm_sub_ps(h1, h0);
+		_mm_storeu_ps(dst + i, _mm_add_ps(h0, _mm_mul_ps(dy, fy)));
+		if (derivX) {
+			_mm_storeu_ps(derivX + i, _mm_add_ps(dx0, _mm_mul_ps(_mm_sub_ps(dx1, dx0), fy)));
+			_mm_storeu_ps(derivY + i, dy);
+		}
+	}
+	xSIMD_Generic::Bilinear(dst + i, derivX ? derivX + i : NULL, derivY ? derivY + i : NULL,
+		p00 + i, p10 + i, p01 + i, p11 + i, fracX + i, fracY + i, count - i);
+}
+
+/*
+============
+xSIMD_SSE::RaisedCosine
+
+  the angle is folded to [0, HALF_PI] without branches, then the polynomial of xMath::Cos16 is used
+============
+*/
+void VPCALL xSIMD_SSE::RaisedCosine(float *dst, const float *src, const int count) {
+	const __m128 twoPI = _mm_set1_ps(xMath::PI*2);
+	const __m128 PI = _mm_set1_ps(xMath::PI);
+	const __m128 halfPI = _mm_set1_ps(xMath::HALF_PI);
+	const __m128 absMask = _mm_load_ps((const float *)SIMD_SP_absMask);
+	const __m128 signMask = _mm_load_ps((const float *)SIMD_SP_signBitMask);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 a = _mm_and_ps(_mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(src + i), twoPI), PI), absMask);
+		__m128 flip = _mm_cmpgt_ps(a, halfPI);
+		a = _mm_or_ps(_mm_and_ps(flip, _mm_sub_ps(PI, a)), _mm_andnot_ps(flip, a));
+		__m128 s = _mm_mul_ps(a, a);
+		__m128 c = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-2.605e-07f), s), _mm_set1_ps(2.47609e-05f));
+		c = _mm_add_ps(_mm_mul_ps(c, s), _mm_set1_ps(-1.3888397e-03f));
+		c = _mm_add_ps(_mm_mul_ps(c, s), _mm_set1_ps(4.16666418e-02f));
+		c = _mm_add_ps(_mm_mul_ps(c, s), _mm_set1_ps(-4.999999963e-01f));
+		c = _mm_add_ps(_mm_mul_ps(c, s), one);
+		c = _mm_xor_ps(c, _mm_and_ps(flip, signMask));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(c, one), half));
+	}
+	xSIMD_Generic::RaisedCosine(dst + i, src + i, count - i);
+}
+
 #endif /* _WIN32 */
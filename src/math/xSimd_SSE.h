@@ -71,6 +71,9 @@ public:
 	virtual void VPCALL DecalPointCull(byte *cullBits, const xPlane *planes, const xDrawVert *verts, const int numVerts);
 	virtual void VPCALL OverlayPointCull(byte *cullBits, xVec2 *texCoords, const xPlane *planes, const xDrawVert *verts, const int numVerts);
 
+	virtual void VPCALL Bilinear(float *dst, float *derivX, float *derivY, const float *p00, const float *p10, const float *p01, const float *p11, const float *fracX, const float *fracY, const int count);
+	virtual void VPCALL RaisedCosine(float *dst, const float *src, const int count);
+
 #endif
 };
 
@@ -8,6 +8,8 @@
 
 #ifdef _WIN32
 
+#include <emmintrin.h>
+
 /*
 ============
 xSIMD_SSE2::GetName
@@ -17,4 +19,124 @@ const TCHAR * xSIMD_SSE2::Name() const {
 	return _T("MMX & SSE & SSE2");
 }
 
+/*
+============
+xSIMD_SSE2::ExpandBGR24
+
+  there is no byte shuffle before SSSE3, the pixels are shifted into the dword lanes instead
+============
+*/
+void VPCALL xSIMD_SSE2::ExpandBGR24(byte *dst, const byte *src, const int count) {
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	int i = 0;
+	// 16 bytes are loaded for every 12 bytes of pixels, so the last pixels are done by the generic code
+	for (; i + 8 + 2 <= count; i += 8, src += 24, dst += 32) {
+		__m128i s0 = _mm_loadu_si128((const __m128i *)(src + 0));
+		__m128i s1 = _mm_loadu_si128((const __m128i *)(src + 12));
+		__m128i p01 = _mm_unpacklo_epi32(s0, _mm_srli_si128(s0, 3));
+		__m128i p23 = _mm_unpacklo_epi32(_mm_srli_si128(s0, 6), _mm_srli_si128(s0, 9));
+		__m128i p45 = _mm_unpacklo_epi32(s1, _mm_srli_si128(s1, 3));
+		__m128i p67 = _mm_unpacklo_epi32(_mm_srli_si128(s1, 6), _mm_srli_si128(s1, 9));
+		_mm_storeu_si128((__m128i *)(dst + 0), _mm_or_si128(_mm_unpacklo_epi64(p01, p23), alpha));
+		_mm_storeu_si128((__m128i *)(dst + 16), _mm_or_si128(_mm_unpacklo_epi64(p45, p67), alpha));
+	}
+	xSIMD_Generic::ExpandBGR24(dst, src, count - i);
+}
+
+/*
+============
+xSIMD_SSE2::Dequantize
+
+  eight values per iteration, the words are zero extended to the dword lanes
+============
+*/
+void VPCALL xSIMD_SSE2::Dequantize(float *dst, const word *src, const float scale, const float bias, const int count) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 s = _mm_set1_ps(scale);
+	const __m128 b = _mm_set1_ps(bias);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i q = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(q, zero));
+		__m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(q, zero));
+		_mm_storeu_ps(dst + i + 0, _mm_add_ps(_mm_mul_ps(lo, s), b));
+		_mm_storeu_ps(dst + i + 4, _mm_add_ps(_mm_mul_ps(hi, s), b));
+	}
+	xSIMD_Generic::Dequantize(dst + i, src + i, scale, bias, count - i);
+}
+
+/*
+============
+xSIMD_SSE2::CompressBC1
+
+  the bounding box and the nearest palette colors are found for 4 pixels at once
+============
+*/
+void VPCALL xSIMD_SSE2::CompressBC1(byte *dst, const int dstPitch, const byte *src, const int srcPitch, const int blocksX, const int blocksY) {
+	ALIGN16(byte block[16*4]);
+	ALIGN16(byte palette[4*4]);
+	ALIGN16(int bestIndexes[4]);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (int by = 0; by < blocksY; by++) {
+		byte *dstBlock = dst + by * dstPitch;
+		for (int bx = 0; bx < blocksX; bx++, dstBlock += 8) {
+			BC1GatherBlock(block, src + by * 4 * srcPitch + bx * 4 * 3, srcPitch);
+
+			__m128i rows[4];
+			rows[0] = _mm_load_si128((const __m128i *)(block + 0));
+			rows[1] = _mm_load_si128((const __m128i *)(block + 16));
+			rows[2] = _mm_load_si128((const __m128i *)(block + 32));
+			rows[3] = _mm_load_si128((const __m128i *)(block + 48));
+
+			__m128i minColor = _mm_min_epu8(_mm_min_epu8(rows[0], rows[1]), _mm_min_epu8(rows[2], rows[3]));
+			__m128i maxColor = _mm_max_epu8(_mm_max_epu8(rows[0], rows[1]), _mm_max_epu8(rows[2], rows[3]));
+			minColor = _mm_min_epu8(minColor, _mm_shuffle_epi32(minColor, _MM_SHUFFLE(1, 0, 3, 2)));
+			maxColor = _mm_max_epu8(maxColor, _mm_shuffle_epi32(maxColor, _MM_SHUFFLE(1, 0, 3, 2)));
+			minColor = _mm_min_epu8(minColor, _mm_shuffle_epi32(minColor, _MM_SHUFFLE(2, 3, 0, 1)));
+			maxColor = _mm_max_epu8(maxColor, _mm_shuffle_epi32(maxColor, _MM_SHUFFLE(2, 3, 0, 1)));
+
+			dword minBGRX = _mm_cvtsi128_si32(minColor);
+			dword maxBGRX = _mm_cvtsi128_si32(maxColor);
+			dword colors = BC1Endpoints(palette, block, (const byte *)&minBGRX, (const byte *)&maxBGRX);
+			dword indices = 0;
+			if ((colors & 0xffff) != (colors >> 16)) {
+				// palette colors as 16 bit BGRX, replicated for two pixels
+				__m128i colors16[4];
+				for (int k = 0; k < 4; k++) {
+					__m128i c = _mm_unpacklo_epi8(_mm_cvtsi32_si128(((const int *)palette)[k]), zero);
+					colors16[k] = _mm_unpacklo_epi64(c, c);
+				}
+				for (int i = 0; i < 4; i++) {
+					__m128i pixels01 = _mm_unpacklo_epi8(rows[i], zero);
+					__m128i pixels23 = _mm_unpackhi_epi8(rows[i], zero);
+					__m128i bestDist, bestIndex;
+					for (int k = 0; k < 4; k++) {
+						// (b*b + g*g, r*r + x*x) pairs, summed into the pixel order 0, 2, 1, 3
+						__m128i d01 = _mm_sub_epi16(pixels01, colors16[k]);
+						__m128i d23 = _mm_sub_epi16(pixels23, colors16[k]);
+						d01 = _mm_madd_epi16(d01, d01);
+						d23 = _mm_madd_epi16(d23, d23);
+						__m128i lo = _mm_unpacklo_epi32(d01, d23);
+						__m128i hi = _mm_unpackhi_epi32(d01, d23);
+						__m128i dist = _mm_add_epi32(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+						if (k == 0) {
+							bestDist = dist;
+							bestIndex = zero;
+							continue;
+						}
+						__m128i less = _mm_cmplt_epi32(dist, bestDist);
+						bestDist = _mm_or_si128(_mm_and_si128(less, dist), _mm_andnot_si128(less, bestDist));
+						bestIndex = _mm_or_si128(_mm_and_si128(less, _mm_set1_epi32(k)), _mm_andnot_si128(less, bestIndex));
+					}
+					_mm_store_si128((__m128i *)bestIndexes, bestIndex);
+					indices |= (bestIndexes[0] << (i*8 + 0)) | (bestIndexes[2] << (i*8 + 2))
+						| (bestIndexes[1] << (i*8 + 4)) | (bestIndexes[3] << (i*8 + 6));
+				}
+			}
+			BC1WriteBlock(dstBlock, colors, indices);
+		}
+	}
+}
+
 #endif /* _WIN32 */
@@ -16,6 +16,10 @@ class xSIMD_SSE2 : public xSIMD_SSE {
 public:
 	virtual const TCHAR * VPCALL Name() const;
 
+	virtual void VPCALL ExpandBGR24(byte *dst, const byte *src, const int count);
+	virtual void VPCALL Dequantize(float *dst, const word *src, const float scale, const float bias, const int count);
+	virtual void VPCALL CompressBC1(byte *dst, const int dstPitch, const byte *src, const int srcPitch, const int blocksX, const int blocksY);
+
 #endif
 };
 
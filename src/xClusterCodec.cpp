@@ -0,0 +1,533 @@
+#include "xForm.h"
+
+// =================================================================
+// =================================================================
+// =================================================================
+
+const xClusterCodec::Codec xClusterCodec::codecs[CODEC_COUNT] =
+{
+  { EncodeRaw, DecodeRaw },
+  { EncodeLZ, DecodeLZ },
+  { EncodeDelta, DecodeDelta },
+};
+
+uint32 xClusterCodec::Encode(int codec, byte * dst, uint32 dstSize, const byte * src, uint32 srcSize,
+  int width, int tolerance)
+{
+  if(!IsValid(codec))
+  {
+    return 0;
+  }
+  return codecs[codec].Encode(dst, dstSize, src, srcSize, width, tolerance);
+}
+
+bool xClusterCodec::Decode(int codec, byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width)
+{
+  if(!IsValid(codec))
+  {
+    return false;
+  }
+  return codecs[codec].Decode(dst, dstSize, src, srcSize, width);
+}
+
+// =================================================================
+
+uint32 xClusterCodec::EncodeRaw(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int, int)
+{
+  if(srcSize > dstSize)
+  {
+    return 0;
+  }
+  MEMCPY(dst, src, srcSize);
+  return srcSize;
+}
+
+bool xClusterCodec::DecodeRaw(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int)
+{
+  if(srcSize != dstSize)
+  {
+    return false;
+  }
+  MEMCPY(dst, src, srcSize);
+  return true;
+}
+
+// =================================================================
+
+// a sequence is a token, literals, the match offset and the match length:
+// the high nibble of the token is the literals length, the low one is the match length - LZ_MIN_MATCH,
+// 15 is continued by bytes which are added up until one of them is less than 255.
+// the last sequence has literals only
+
+static inline dword ReadDword(const byte * p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((dword)p[3] << 24);
+}
+
+static bool WriteLZLength(byte *& dst, byte * end, uint32 length)
+{
+  for(; length >= 255; length -= 255)
+  {
+    if(dst == end)
+    {
+      return false;
+    }
+    *dst++ = 255;
+  }
+  if(dst == end)
+  {
+    return false;
+  }
+  *dst++ = (byte)length;
+  return true;
+}
+
+static bool ReadLZLength(const byte *& src, const byte * end, uint32& length)
+{
+  for(;;)
+  {
+    if(src == end)
+    {
+      return false;
+    }
+    byte value = *src++;
+    length += value;
+    if(value < 255)
+    {
+      return true;
+    }
+  }
+}
+
+static bool WriteLZSequence(byte *& dst, byte * end, const byte * literals, uint32 literalsLength,
+  uint32 offset, uint32 matchLength, uint32 minMatch)
+{
+  // matchLength is 0 for the last sequence
+  if(dst == end)
+  {
+    return false;
+  }
+  byte * token = dst++;
+  *token = (byte)(Min(literalsLength, (uint32)15) << 4);
+  if(literalsLength >= 15 && !WriteLZLength(dst, end, literalsLength - 15))
+  {
+    return false;
+  }
+  if(literalsLength > (uint32)(end - dst))
+  {
+    return false;
+  }
+  MEMCPY(dst, literals, literalsLength);
+  dst += literalsLength;
+  if(!matchLength)
+  {
+    return true;
+  }
+
+  if(end - dst < 2)
+  {
+    return false;
+  }
+  *dst++ = (byte)offset;
+  *dst++ = (byte)(offset >> 8);
+  matchLength -= minMatch;
+  *token |= (byte)Min(matchLength, (uint32)15);
+  return matchLength < 15 || WriteLZLength(dst, end, matchLength - 15);
+}
+
+uint32 xClusterCodec::EncodeLZ(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int, int)
+{
+  // greedy parsing, the table keeps the last position of every hashed dword
+  int table[1 << LZ_HASH_BITS];
+  for(int i = 0; i < (1 << LZ_HASH_BITS); i++)
+  {
+    table[i] = -1;
+  }
+  byte * out = dst;
+  byte * outEnd = dst + dstSize;
+  const byte * end = src + srcSize;
+  const byte * anchor = src;
+  const byte * p = src;
+  while(end - p >= LZ_MIN_MATCH)
+  {
+    dword value = ReadDword(p);
+    int hash = (int)((value * 2654435761u) >> (32 - LZ_HASH_BITS));
+    int pos = (int)(p - src);
+    int candidate = table[hash];
+    table[hash] = pos;
+    if(candidate < 0 || pos - candidate > LZ_MAX_OFFSET || ReadDword(src + candidate) != value)
+    {
+      p++;
+      continue;
+    }
+    const byte * match = src + candidate;
+    uint32 length = LZ_MIN_MATCH;
+    while(p + length < end && p[length] == match[length])
+    {
+      length++;
+    }
+    if(!WriteLZSequence(out, outEnd, anchor, (uint32)(p - anchor), (uint32)(pos - candidate), length, LZ_MIN_MATCH))
+    {
+      return 0;
+    }
+    p += length;
+    anchor = p;
+  }
+  if(!WriteLZSequence(out, outEnd, anchor, (uint32)(end - anchor), 0, 0, LZ_MIN_MATCH))
+  {
+    return 0;
+  }
+  return (uint32)(out - dst);
+}
+
+bool xClusterCodec::DecodeLZ(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int)
+{
+  // every length and offset is checked, broken data never writes out of dst
+  byte * out = dst;
+  byte * outEnd = dst + dstSize;
+  const byte * end = src + srcSize;
+  while(src < end)
+  {
+    byte token = *src++;
+    uint32 length = token >> 4;
+    if(length == 15 && !ReadLZLength(src, end, length))
+    {
+      return false;
+    }
+    if(length > (uint32)(end - src) || length > (uint32)(outEnd - out))
+    {
+      return false;
+    }
+    MEMCPY(out, src, length);
+    out += length;
+    src += length;
+    if(src == end)
+    {
+      break;
+    }
+
+    if(end - src < 2)
+    {
+      return false;
+    }
+    uint32 offset = src[0] | (src[1] << 8);
+    src += 2;
+    if(!offset || offset > (uint32)(out - dst))
+    {
+      return false;
+    }
+    length = token & 15;
+    if(length == 15 && !ReadLZLength(src, end, length))
+    {
+      return false;
+    }
+    length += LZ_MIN_MATCH;
+    if(length > (uint32)(outEnd - out))
+    {
+      return false;
+    }
+    // the match may overlap the bytes it produces
+    const byte * match = out - offset;
+    for(uint32 i = 0; i < length; i++)
+    {
+      out[i] = match[i];
+    }
+    out += length;
+  }
+  return out == outEnd;
+}
+
+// =================================================================
+
+// MSB first bit stream of Rice codes
+struct xRiceWriter
+{
+  byte * dst, * end;
+  dword bits;
+  int bitsNumber;
+  bool isOk;
+
+  xRiceWriter(byte * p_dst, uint32 size)
+  {
+    dst = p_dst;
+    end = p_dst + size;
+    bits = 0;
+    bitsNumber = 0;
+    isOk = true;
+  }
+
+  // count is 24 at most
+  void Put(dword value, int count)
+  {
+    bits = (bits << count) | value;
+    for(bitsNumber += count; bitsNumber >= 8; bitsNumber -= 8)
+    {
+      if(dst == end)
+      {
+        isOk = false;
+        return;
+      }
+      *dst++ = (byte)(bits >> (bitsNumber - 8));
+    }
+  }
+
+  void Flush()
+  {
+    if(bitsNumber > 0)
+    {
+      Put(0, 8 - bitsNumber);
+    }
+  }
+};
+
+struct xRiceReader
+{
+  const byte * src, * end;
+  dword bits;
+  int bitsNumber;
+  bool isOk;
+
+  xRiceReader(const byte * p_src, uint32 size)
+  {
+    src = p_src;
+    end = p_src + size;
+    bits = 0;
+    bitsNumber = 0;
+    isOk = true;
+  }
+
+  // count is 24 at most, reading past the end gives zeros
+  dword Get(int count)
+  {
+    for(; bitsNumber < count; bitsNumber += 8)
+    {
+      byte value = 0;
+      if(src < end)
+      {
+        value = *src++;
+      }
+      else
+      {
+        isOk = false;
+      }
+      bits = (bits << 8) | value;
+    }
+    bitsNumber -= count;
+    return (bits >> bitsNumber) & ((1 << count) - 1);
+  }
+
+  // the whole stream is read and only the zero padding of the writer's Flush is left
+  bool IsAtEnd() const
+  {
+    return src == end && !(bits & ((1 << bitsNumber) - 1));
+  }
+};
+
+// adaptive Golomb-Rice parameter, the mean of the coded values is tracked
+struct xRiceContext
+{
+  int sum, count;
+
+  xRiceContext()
+  {
+    sum = 4;
+    count = 1;
+  }
+
+  int K() const
+  {
+    int k = 0;
+    while((count << k) < sum && k < 16)
+    {
+      k++;
+    }
+    return k;
+  }
+
+  void Update(dword value, int reset)
+  {
+    sum += (int)value;
+    if(++count >= reset)
+    {
+      sum >>= 1;
+      count >>= 1;
+    }
+  }
+};
+
+static inline int MedPredict(int a, int b, int c)
+{
+  // the median edge detector of LOCO-I, a is the left pixel, b is the upper one
+  if(c >= Max(a, b))
+  {
+    return Min(a, b);
+  }
+  if(c <= Min(a, b))
+  {
+    return Max(a, b);
+  }
+  return a + b - c;
+}
+
+static inline int ActivityContext(int a, int b, int c, int contexts)
+{
+  int activity = abs(a - c) + abs(b - c);
+  int context = 0;
+  for(int limit = 1; activity >= limit && context < contexts - 1; limit <<= 1)
+  {
+    context++;
+  }
+  return context;
+}
+
+static void PutRice(xRiceWriter& writer, xRiceContext& context, int value, int limit, int escapeBits, int reset)
+{
+  dword u = value >= 0 ? (dword)value << 1 : ((dword)-value << 1) - 1;
+  int k = context.K();
+  dword q = u >> k;
+  if(q < (dword)limit)
+  {
+    writer.Put((1 << (q + 1)) - 2, q + 1);
+    writer.Put(u & ((1 << k) - 1), k);
+  }
+  else
+  {
+    writer.Put((1 << limit) - 1, limit);
+    writer.Put(u, escapeBits);
+  }
+  context.Update(u, reset);
+}
+
+static int GetRice(xRiceReader& reader, xRiceContext& context, int limit, int escapeBits, int reset)
+{
+  int k = context.K();
+  int q = 0;
+  while(q < limit && reader.Get(1))
+  {
+    q++;
+  }
+  dword u = q < limit ? ((dword)q << k) | reader.Get(k) : reader.Get(escapeBits);
+  context.Update(u, reset);
+  return (u & 1) ? -(int)((u + 1) >> 1) : (int)(u >> 1);
+}
+
+// green is coded first, blue and red residuals are coded as differences to the green one.
+// the first byte of the stream is the tolerance, residuals are quantized to 2 * tolerance + 1 steps
+// and the pixels are predicted by reconstructed neighbours, so the decoder sees the same values
+
+uint32 xClusterCodec::EncodeDelta(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize,
+  int width, int tolerance)
+{
+  if(width <= 0 || width > DELTA_MAX_WIDTH || srcSize % (3 * width) || !dstSize
+    || tolerance < 0 || tolerance > 255)
+  {
+    return 0;
+  }
+  int height = srcSize / (3 * width);
+  int step = 2 * tolerance + 1;
+  dst[0] = (byte)tolerance;
+  xRiceWriter writer(dst + 1, dstSize - 1);
+  xRiceContext contexts[3][DELTA_CONTEXTS];
+  static const int channels[3] = { 1, 0, 2 };
+
+  byte rows[2][3 * DELTA_MAX_WIDTH];
+  for(int y = 0; y < height; y++)
+  {
+    byte * cur = rows[y & 1];
+    const byte * prev = rows[(y & 1) ^ 1];
+    const byte * p = src + 3 * width * y;
+    for(int x = 0; x < width; x++, p += 3)
+    {
+      int a[3] = { 0, 0, 0 }, b[3] = { 0, 0, 0 }, c[3] = { 0, 0, 0 };
+      for(int i = 0; i < 3; i++)
+      {
+        a[i] = x > 0 ? cur[3*(x-1) + i] : 0;
+        b[i] = y > 0 ? prev[3*x + i] : 0;
+        c[i] = x > 0 && y > 0 ? prev[3*(x-1) + i] : 0;
+      }
+      int context = ActivityContext(a[1], b[1], c[1], DELTA_CONTEXTS);
+      int green = 0;
+      for(int n = 0; n < 3; n++)
+      {
+        int i = channels[n];
+        int pred = MedPredict(a[i], b[i], c[i]);
+        int error = p[i] - pred;
+        int q = error >= 0 ? (error + tolerance) / step : -((tolerance - error) / step);
+        cur[3*x + i] = (byte)Min(Max(pred + q * step, 0), 255);
+        if(n == 0)
+        {
+          green = q;
+        }
+        else
+        {
+          q -= green;
+        }
+        PutRice(writer, contexts[n][context], q, RICE_LIMIT, RICE_ESCAPE_BITS, RICE_RESET);
+      }
+      if(!writer.isOk)
+      {
+        return 0;
+      }
+    }
+  }
+  writer.Flush();
+  if(!writer.isOk)
+  {
+    return 0;
+  }
+  return (uint32)(writer.dst - dst);
+}
+
+bool xClusterCodec::DecodeDelta(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width)
+{
+  if(width <= 0 || dstSize % (3 * width) || !srcSize)
+  {
+    return false;
+  }
+  int height = dstSize / (3 * width);
+  int tolerance = src[0];
+  int step = 2 * tolerance + 1;
+  xRiceReader reader(src + 1, srcSize - 1);
+  xRiceContext contexts[3][DELTA_CONTEXTS];
+  static const int channels[3] = { 1, 0, 2 };
+
+  // the decoded pixels are the reconstructed ones
+  int pitch = 3 * width;
+  byte * out = dst;
+  for(int y = 0; y < height; y++)
+  {
+    for(int x = 0; x < width; x++, out += 3)
+    {
+      int a[3] = { 0, 0, 0 }, b[3] = { 0, 0, 0 }, c[3] = { 0, 0, 0 };
+      for(int i = 0; i < 3; i++)
+      {
+        a[i] = x > 0 ? out[i - 3] : 0;
+        b[i] = y > 0 ? out[i - pitch] : 0;
+        c[i] = x > 0 && y > 0 ? out[i - pitch - 3] : 0;
+      }
+      int context = ActivityContext(a[1], b[1], c[1], DELTA_CONTEXTS);
+      int green = 0;
+      for(int n = 0; n < 3; n++)
+      {
+        int i = channels[n];
+        int q = GetRice(reader, contexts[n][context], RICE_LIMIT, RICE_ESCAPE_BITS, RICE_RESET);
+        if(n == 0)
+        {
+          green = q;
+        }
+        else
+        {
+          q += green;
+        }
+        int pred = MedPredict(a[i], b[i], c[i]);
+        out[i] = (byte)Min(Max(pred + q * step, 0), 255);
+      }
+    }
+    if(!reader.isOk)
+    {
+      return false;
+    }
+  }
+  // like DecodeLZ, the payload must use up src exactly
+  return reader.IsAtEnd();
+}
@@ -0,0 +1,64 @@
+#ifndef __X_CLUSTER_CODEC_H__
+#define __X_CLUSTER_CODEC_H__
+
+#pragma once
+
+// codecs of the megatexture cluster payloads, every cluster is coded on its own,
+// so it can be decoded by any stream thread; nothing is allocated while coding
+class xClusterCodec
+{
+public:
+
+  enum
+  {
+    CODEC_RAW,    // stored as is
+    CODEC_LZ,     // LZ77 byte codec of the LZ4 family, the fastest to decode, any format
+    CODEC_DELTA,  // pixels predicted by their neighbours, residuals Rice coded, BGR24 only
+    CODEC_COUNT
+  };
+
+protected:
+
+  enum
+  {
+    LZ_HASH_BITS = 12,
+    LZ_MIN_MATCH = 4,
+    LZ_MAX_OFFSET = 0xffff,
+
+    RICE_LIMIT = 24,       // longer unary prefixes are escaped to the plain value
+    RICE_ESCAPE_BITS = 10, // residual differences fit 10 bits
+    RICE_RESET = 64,       // statistics are halved every RICE_RESET values
+    DELTA_CONTEXTS = 8,    // local activity classes per channel
+    DELTA_MAX_WIDTH = 1024 // reconstructed rows of the lossy encoder live on the stack
+  };
+
+  struct Codec
+  {
+    // width is the row of the payload in pixels, tolerance is the max error of a lossy codec
+    uint32 (*Encode)(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width, int tolerance);
+    bool (*Decode)(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width);
+  };
+
+  static const Codec codecs[CODEC_COUNT];
+
+  static uint32 EncodeRaw(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width, int tolerance);
+  static bool DecodeRaw(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width);
+  static uint32 EncodeLZ(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width, int tolerance);
+  static bool DecodeLZ(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width);
+  static uint32 EncodeDelta(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width, int tolerance);
+  static bool DecodeDelta(byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width);
+
+public:
+
+  static bool IsValid(int codec){ return codec >= 0 && codec < CODEC_COUNT; }
+
+  // returns the coded size, 0 if it doesn't fit dstSize, so the payload should be stored raw.
+  // CODEC_DELTA requires 3 bytes per pixel, it's near lossless if the tolerance isn't 0:
+  // every channel differs by tolerance at most; other codecs ignore it
+  static uint32 Encode(int codec, byte * dst, uint32 dstSize, const byte * src, uint32 srcSize,
+    int width, int tolerance = 0);
+  // dstSize is the size of the payload, it's reached exactly or the data is broken
+  static bool Decode(int codec, byte * dst, uint32 dstSize, const byte * src, uint32 srcSize, int width);
+};
+
+#endif // __X_CLUSTER_CODEC_H__
@@ -27,6 +27,9 @@ typedef unsigned int    uint32;
 typedef unsigned short  uint16;
 typedef unsigned char   uint8;
 
+typedef __int64           int64;
+typedef unsigned __int64  uint64;
+
 #define X_INLINE __forceinline 
 #define _alloca16(x) ((void*)((((int)_alloca((x)+15)) + 15) & ~15))
 
@@ -12,6 +12,7 @@
 #include "common/xHeap.h"
 #include "common/xString.h"
 #include "common/xBitArray.h"
+#include "common/xThread.h"
 
 #include "containers/xArray.h"
 #include "containers/xHashTable.h"
@@ -42,7 +43,9 @@
 #include "geom/xFrustum.h"
 #include "geom/xTerrainVerts.h"
 
+#include "xClusterCodec.h"
 #include "xMegaTexture.h"
+#include "xTerrainFeedback.h"
 
 /*
 #ifdef DEBUG_APP_HEAP
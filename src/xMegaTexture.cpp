@@ -25,11 +25,181 @@ static byte ReadByte(FILE * f)
 }
 */
 
-bool xMegaTexture::Make(const xString& filename,
-  const xString& dstPrefix, int clusterSize)
+// ===============================================================================
+
+enum
+{
+  LINEAR_TO_GAMMA_SIZE = 1 << 14
+};
+
+// adds the time of the scope to the counter, main thread counters only
+struct xStatsTimer
+{
+  double& counter;
+  double start;
+
+  xStatsTimer(double& p_counter): counter(p_counter){ start = xMegaTexture::StatsTime(); }
+  ~xStatsTimer(){ counter += xMegaTexture::StatsTime() - start; }
+};
+
+// ===============================================================================
+
+static float gammaToLinear[256];
+static float byteToLinear[256]; // linear planes are only scaled
+static byte linearToGamma[LINEAR_TO_GAMMA_SIZE];
+
+void xMegaTexture::InitGammaTables()
+{
+  int i;
+  for(i = 0; i < 256; i++)
+  {
+    float c = (float)i / 255.0f;
+    gammaToLinear[i] = c <= 0.04045f ? c / 12.92f : xMath::Pow((c + 0.055f) / 1.055f, 2.4f);
+    byteToLinear[i] = c;
+  }
+  for(i = 0; i < LINEAR_TO_GAMMA_SIZE; i++)
+  {
+    float c = (float)i / (LINEAR_TO_GAMMA_SIZE - 1);
+    c = c <= 0.0031308f ? c * 12.92f : 1.055f * xMath::Pow(c, 1.0f / 2.4f) - 0.055f;
+    linearToGamma[i] = (byte)(c * 255.0f + 0.5f);
+  }
+}
+
+static byte EncodeGamma(float c)
+{
+  int i = (int)(c * (LINEAR_TO_GAMMA_SIZE - 1) + 0.5f);
+  return linearToGamma[i < 0 ? 0 : (i >= LINEAR_TO_GAMMA_SIZE ? LINEAR_TO_GAMMA_SIZE - 1 : i)];
+}
+
+static byte EncodeLinear(float c)
+{
+  int i = (int)(c * 255.0f + 0.5f);
+  return (byte)(i < 0 ? 0 : (i > 255 ? 255 : i));
+}
+
+static float Sinc(float x)
+{
+  x *= xMath::PI;
+  return x > -0.0001f && x < 0.0001f ? 1.0f : xMath::Sin(x) / x;
+}
+
+// zero order modified Bessel function of the first kind
+static float BesselI0(float x)
+{
+  float sum = 1.0f, term = 1.0f;
+  for(int k = 1; k < 32 && term > sum * 1e-7f; k++)
+  {
+    float t = x / (2.0f * k);
+    term *= t * t;
+    sum += term;
+  }
+  return sum;
+}
+
+float xMegaTexture::FilterRadius(int filter)
+{
+  switch(filter)
+  {
+  case FILTER_KAISER:
+  case FILTER_LANCZOS:
+    return 3.0f;
+  }
+  return 0.5f;
+}
+
+float xMegaTexture::FilterWeight(int filter, float x)
+{
+  float radius = FilterRadius(filter);
+  if(x <= -radius || x >= radius)
+  {
+    return filter == FILTER_BOX && (x == -radius || x == radius) ? 1.0f : 0.0f;
+  }
+  switch(filter)
+  {
+  case FILTER_KAISER:
+    {
+      const float alpha = 4.0f;
+      float t = x / radius;
+      return Sinc(x) * BesselI0(alpha * xMath::Sqrt(1.0f - t * t)) / BesselI0(alpha);
+    }
+
+  case FILTER_LANCZOS:
+    return Sinc(x) * Sinc(x / radius);
+  }
+  return 1.0f;
+}
+
+void xMegaTexture::InitMakeFilter(MakeFilter& filter, int type, int srcSize, int dstSize)
+{
+  // the kernel is stretched by the scale, taps out of the image are folded onto the edge pixels
+  float scale = (float)srcSize / dstSize;
+  float stretch = scale > 1.0f ? scale : 1.0f;
+  float radius = FilterRadius(type) * stretch;
+  filter.maxTaps = (int)xMath::Ceil(radius * 2.0f) + 2;
+  filter.first.SetCount(dstSize);
+  filter.count.SetCount(dstSize);
+  filter.weights.SetCount(dstSize * filter.maxTaps);
+  MEMSET(filter.weights.Ptr(), 0, sizeof(float) * dstSize * filter.maxTaps);
+  for(int i = 0; i < dstSize; i++)
+  {
+    float center = (i + 0.5f) * scale - 0.5f;
+    int lo = (int)xMath::Ceil(center - radius);
+    int hi = (int)xMath::Floor(center + radius);
+    int first = Max(lo, 0);
+    int last = Min(hi, srcSize - 1);
+    if(first > last)
+    {
+      first = last = Min(Max((int)(center + 0.5f), 0), srcSize - 1);
+    }
+    ASSERT(last - first < filter.maxTaps);
+    float * weights = &filter.weights[i * filter.maxTaps];
+    float sum = 0;
+    for(int j = lo; j <= hi; j++)
+    {
+      float w = FilterWeight(type, (j - center) / stretch);
+      weights[Min(Max(j, first), last) - first] += w;
+      sum += w;
+    }
+    if(sum > -0.0001f && sum < 0.0001f)
+    {
+      // nothing is covered, the nearest pixel is taken
+      MEMSET(weights, 0, sizeof(float) * filter.maxTaps);
+      first = last = Min(Max((int)(center + 0.5f), 0), srcSize - 1);
+      weights[0] = sum = 1.0f;
+    }
+    for(int j = first; j <= last; j++)
+    {
+      weights[j - first] /= sum;
+    }
+    filter.first[i] = first;
+    filter.count[i] = last - first + 1;
+  }
+}
+
+// ===============================================================================
+
+bool xMegaTexture::Make(const xString& filename, const xString& dstPrefix, int clusterSize,
+  int format, int filter, int border, int codec, int tolerance, int threadsNumber)
+{
+  return MakePlane(filename, dstPrefix, clusterSize, format, filter, border, codec, tolerance, false, threadsNumber);
+}
+
+int xMegaTexture::MakePlaneCodec(int format, int codec)
+{
+  // the blocks of BC1 and single channels aren't BGR pixels, so they aren't predicted
+  return format != FORMAT_BGR24 && codec == xClusterCodec::CODEC_DELTA ? xClusterCodec::CODEC_LZ : codec;
+}
+
+bool xMegaTexture::MakePlane(const xString& filename, const xString& dstPrefix, int clusterSize,
+  int format, int filter, int border, int codec, int tolerance, bool isLinear, int threadsNumber)
 {
   ASSERT(xMath::IsPowerOfTwo(clusterSize) && clusterSize >= 64);
   ASSERT(!dstPrefix.IsEmpty());
+  ASSERT(format == FORMAT_BGR24 || format == FORMAT_BC1 || format == FORMAT_L8);
+  ASSERT(filter == FILTER_BOX || filter == FILTER_KAISER || filter == FILTER_LANCZOS);
+  ASSERT(border >= 0 && border <= clusterSize / 2 && border <= (HEADER_BORDER_MASK >> HEADER_BORDER_SHIFT));
+  ASSERT(format != FORMAT_BC1 || (border % 4) == 0);
+  ASSERT(xClusterCodec::IsValid(codec) && tolerance >= 0 && tolerance <= 255);
 
   FILE * f;
   errno_t err = _tfopen_s(&f, filename.ToChar(), _T("rb"));
@@ -46,220 +216,2576 @@ bool xMegaTexture::Make(const xString& filename,
   // Only true color, non-mapped images are supported
   if(tgaHeader.colormapType != 0 || tgaHeader.imageType != 2
     || (tgaHeader.pixelBitCount != 24 && tgaHeader.pixelBitCount != 32)
-    || tgaHeader.width != tgaHeader.height)
+    || tgaHeader.width == 0 || tgaHeader.height == 0)
+  {
+    fclose(f);
+    return false;
+  }
+  // Skip the ID field. The first byte of the header is the length of this field
+  if(tgaHeader.idLength)
+  {
+    fseek(f, tgaHeader.idLength, SEEK_CUR);
+  }
+
+  int width  = tgaHeader.width;
+  int height = tgaHeader.height;
+  int pixelBytes = tgaHeader.pixelBitCount / 8;
+  bool isBottomUp = !(tgaHeader.imageDescriptor & 0x0010);
+  int64 dataStart = _ftelli64(f);
+
+  // every mip is half of the previous one rounded up, the last one fits a single cluster
+  int x, y;
+  int mipsNumber = 0;
+  int clustersNumber = 0;
+  for(x = width, y = height;; x = (x + 1) / 2, y = (y + 1) / 2)
+  {
+    clustersNumber += ((x + clusterSize - 1) / clusterSize) * ((y + clusterSize - 1) / clusterSize);
+    mipsNumber++;
+    if(x <= clusterSize && y <= clusterSize)
+      break;
+  }
+
+  Header header;
+  MEMSET(&header, 0, sizeof(header));
+  header.id = ID;
+  header.version = VERSION;
+  header.fullWidth = width;
+  header.fullHeight = height;
+  header.clusterSize = clusterSize;
+  header.mipsNumber = mipsNumber;
+  header.clustersNumber = clustersNumber;
+  header.flags = format | (border << HEADER_BORDER_SHIFT);
+
+  xArray<MipHeader> mips;
+  xArray<ClusterHeader> clusters;
+  mips.SetCount(mipsNumber);
+  clusters.SetCount(clustersNumber);
+  MEMSET(clusters.Ptr(), 0, sizeof(ClusterHeader) * clustersNumber);
+
+  // clusters of all mips are produced in the same pass, so the table is laid out up front
+  int mipmap, clusterNum = 0;
+  for(mipmap = 0, x = width, y = height; mipmap < mipsNumber; mipmap++, x = (x + 1) / 2, y = (y + 1) / 2)
+  {
+    MipHeader& mip = mips[mipmap];
+    mip.width = (x + clusterSize - 1) / clusterSize;
+    mip.height = (y + clusterSize - 1) / clusterSize;
+    mip.firstCluster = clusterNum;
+    clusterNum += mip.width * mip.height;
+  }
+  ASSERT(clusterNum == clustersNumber);
+
+  FILE * archive;
+  xString archiveFilename = ArchiveFilename(dstPrefix);
+  err = _tfopen_s(&archive, archiveFilename.ToChar(), _T("wb"));
+  if(err != 0)
+  {
+    fclose(f);
+    return false;
+  }
+
+  // reserve space for the tables, they are rewritten when all offsets are known
+  if(!WriteArchiveTables(archive, header, NULL, mips, clusters))
+  {
+    fclose(archive);
+    fclose(f);
+    return false;
+  }
+
+  // only one band of clusterSize rows per mip and two cluster rows of payload are in memory,
+  // the band keeps border rows above and below for the borders of the clusters
+  int bandRows = clusterSize + 2 * border;
+  MakeState state;
+  state.format = format;
+  state.isLinear = isLinear;
+  state.clusterSize = clusterSize;
+  state.border = border;
+  state.clusterDataSize = ClusterDataSize(format, bandRows);
+  state.filter = filter;
+  state.codec = MakePlaneCodec(format, codec);
+  state.tolerance = tolerance;
+  state.threadsNumber = threadsNumber > 0 ? threadsNumber : xThread::ProcessorsNumber();
+  state.levelsNumber = mipsNumber;
+  state.levels = new MakeLevel[mipsNumber];
+  state.mips = mips.Ptr();
+  state.clusters = clusters.Ptr();
+  state.offset = sizeof(Header) + sizeof(MipHeader) * mipsNumber
+    + sizeof(ClusterHeader) * clustersNumber;
+  state.payloads[0] = new byte[state.clusterDataSize * mips[0].width];
+  state.payloads[1] = new byte[state.clusterDataSize * mips[0].width];
+  state.payloadNum = 0;
+  state.coded = NULL;
+  if(state.codec != xClusterCodec::CODEC_RAW)
+  {
+    state.coded = new byte[state.clusterDataSize * mips[0].width];
+    state.codedSizes.SetCount(mips[0].width);
+  }
+  state.accum = NULL;
+  state.write.f = archive;
+  state.write.isOk = true;
+  for(mipmap = 0, x = width, y = height; mipmap < mipsNumber; mipmap++, x = (x + 1) / 2, y = (y + 1) / 2)
+  {
+    MakeLevel& level = state.levels[mipmap];
+    level.width = x;
+    level.height = y;
+    level.pitch = mips[mipmap].width * clusterSize + 2 * border;
+    level.clustersX = mips[mipmap].width;
+    level.clusterRow = 0;
+    level.bandFirst = -border;
+    level.rows = border; // the rows above the image are repeated when the first row of clusters is done
+    level.srcRows = 0;
+    level.band = new byte[sizeof(byte)*3 * level.pitch * bandRows];
+    level.hRows = NULL;
+    level.hFirst = 0;
+    level.hCount = 0;
+    level.nextRow = 0;
+  }
+
+  // filters and gamma tables are built here, the worker threads only read them
+  InitGammaTables();
+  for(mipmap = 0; mipmap < mipsNumber - 1; mipmap++)
+  {
+    MakeLevel& level = state.levels[mipmap];
+    const MakeLevel& next = state.levels[mipmap + 1];
+    InitMakeFilter(level.filterX, filter, level.width, next.width);
+    InitMakeFilter(level.filterY, filter, level.height, next.height);
+    level.hRows = new float[3 * next.width * (bandRows + level.filterY.maxTaps)];
+  }
+  if(mipsNumber > 1)
+  {
+    state.accum = new float[3 * state.levels[1].width * bandRows];
+  }
+
+  // the source is read a band at a time, bands of bottom-up files are read backwards
+  uint32 lineSize = sizeof(byte) * pixelBytes * width;
+  byte * lines = new byte[lineSize * clusterSize];
+  MakeLevel& level0 = state.levels[0];
+  bool isOk = true;
+  for(int bandY = 0; bandY < height && isOk; bandY += clusterSize)
+  {
+    int rows = Min(clusterSize, height - bandY);
+    if(isBottomUp && _fseeki64(f, dataStart + (int64)(height - bandY - rows) * lineSize, SEEK_SET) != 0)
+    {
+      isOk = false;
+      break;
+    }
+    if(fread(lines, lineSize * rows, 1, f) != 1)
+    {
+      isOk = false;
+      break;
+    }
+    for(y = 0; y < rows && isOk; y++)
+    {
+      const byte * line = lines + lineSize * (isBottomUp ? rows - y - 1 : y);
+      byte * dst = level0.band + sizeof(byte)*3 * (level0.rows * level0.pitch + border);
+      if(pixelBytes == 4)
+      {
+        for(x = 0; x < width; x++, dst += 3)
+        {
+          dword color[] =
+          {
+            line[x*4 + 0],
+            line[x*4 + 1],
+            line[x*4 + 2],
+            line[x*4 + 3]
+          };
+          dst[0] = (color[0] * color[3]) / 0xff;
+          dst[1] = (color[1] * color[3]) / 0xff;
+          dst[2] = (color[2] * color[3]) / 0xff;
+        }
+      }
+      else
+      {
+        MEMCPY(dst, line, sizeof(byte)*3 * width);
+      }
+      // the band is processed as soon as it's full, it overlaps the next one by the borders
+      level0.rows++;
+      if(level0.rows == bandRows || level0.bandFirst + level0.rows == height)
+      {
+        isOk = MakeProcessBand(state, 0);
+      }
+    }
+  }
+  fclose(f);
+  delete [] lines;
+
+  state.writer.Wait();
+  isOk = isOk && state.write.isOk;
+
+  for(mipmap = 0; mipmap < mipsNumber; mipmap++)
+  {
+    ASSERT(!isOk || state.levels[mipmap].clusterRow == mips[mipmap].height);
+    delete [] state.levels[mipmap].band;
+    delete [] state.levels[mipmap].hRows;
+  }
+  delete [] state.levels;
+  delete [] state.payloads[0];
+  delete [] state.payloads[1];
+  delete [] state.coded;
+  delete [] state.accum;
+
+  if(!isOk || fseek(archive, 0, SEEK_SET) != 0 || !WriteArchiveTables(archive, header, NULL, mips, clusters))
+  {
+    fclose(archive);
+    return false;
+  }
+  fclose(archive);
+
+  return true;
+}
+
+bool xMegaTexture::Make(const PlaneDesc * planeDescs, int planesNumber, const xString& dstPrefix, int clusterSize,
+  int filter, int border, int threadsNumber)
+{
+  ASSERT(planeDescs && planesNumber > 0 && planesNumber <= MAX_PLANES);
+  if(planesNumber == 1)
+  {
+    const PlaneDesc& desc = planeDescs[0];
+    return MakePlane(desc.filename, dstPrefix, clusterSize, desc.format, filter, border,
+      desc.codec, desc.tolerance, desc.isLinear, threadsNumber);
+  }
+
+  // every plane is made to its own archive next to the result, they are packed together afterwards
+  xString planePrefixes[MAX_PLANES];
+  PlaneHeader planes[MAX_PLANES];
+  bool isOk = true;
+  int i;
+  for(i = 0; i < planesNumber && isOk; i++)
+  {
+    const PlaneDesc& desc = planeDescs[i];
+    planePrefixes[i] = dstPrefix + xString::Format(_T(".plane%d"), i);
+    planes[i].format = desc.format;
+    planes[i].codec = MakePlaneCodec(desc.format, desc.codec);
+    isOk = MakePlane(desc.filename, planePrefixes[i], clusterSize, desc.format, filter, border,
+      desc.codec, desc.tolerance, desc.isLinear, threadsNumber);
+  }
+  isOk = isOk && MergePlanes(dstPrefix, planePrefixes, planes, planesNumber);
+  for(int j = 0; j < i; j++)
+  {
+    DeleteFile(ArchiveFilename(planePrefixes[j]));
+  }
+  return isOk;
+}
+
+bool xMegaTexture::MergePlanes(const xString& dstPrefix, const xString * planePrefixes,
+  const PlaneHeader * planes, int planesNumber)
+{
+  // the archives of the planes are made from images of the same size, so their tables match
+  FILE * srcs[MAX_PLANES];
+  Header srcHeaders[MAX_PLANES];
+  xArray<ClusterHeader> srcClusters[MAX_PLANES];
+  xArray<MipHeader> mips;
+  int i, opened = 0;
+  bool isOk = true;
+  for(i = 0; i < planesNumber && isOk; i++, opened++)
+  {
+    if(_tfopen_s(&srcs[i], ArchiveFilename(planePrefixes[i]).ToChar(), _T("rb")) != 0)
+    {
+      isOk = false;
+      break;
+    }
+    const Header& src = srcHeaders[i];
+    isOk = fread(&srcHeaders[i], sizeof(Header), 1, srcs[i]) == 1;
+    if(isOk && i > 0)
+    {
+      const Header& first = srcHeaders[0];
+      isOk = src.fullWidth == first.fullWidth && src.fullHeight == first.fullHeight
+        && src.clusterSize == first.clusterSize && src.mipsNumber == first.mipsNumber
+        && src.clustersNumber == first.clustersNumber
+        && (src.flags & HEADER_BORDER_MASK) == (first.flags & HEADER_BORDER_MASK);
+    }
+    if(isOk)
+    {
+      if(i == 0)
+      {
+        mips.SetCount(src.mipsNumber);
+        isOk = fread(mips.Ptr(), sizeof(MipHeader) * src.mipsNumber, 1, srcs[i]) == 1;
+      }
+      else
+      {
+        isOk = _fseeki64(srcs[i], sizeof(MipHeader) * src.mipsNumber, SEEK_CUR) == 0;
+      }
+    }
+    if(isOk)
+    {
+      srcClusters[i].SetCount(src.clustersNumber);
+      isOk = fread(srcClusters[i].Ptr(), sizeof(ClusterHeader) * src.clustersNumber, 1, srcs[i]) == 1;
+    }
+  }
+
+  FILE * archive = NULL;
+  Header header = srcHeaders[0];
+  xArray<ClusterHeader> clusters;
+  if(isOk)
+  {
+    header.version = VERSION_PLANES;
+    header.flags = planes[0].format | (srcHeaders[0].flags & HEADER_BORDER_MASK) | (planesNumber << HEADER_PLANES_SHIFT);
+    clusters.SetCount(header.clustersNumber);
+    MEMSET(clusters.Ptr(), 0, sizeof(ClusterHeader) * header.clustersNumber);
+    isOk = _tfopen_s(&archive, ArchiveFilename(dstPrefix).ToChar(), _T("wb")) == 0
+      && WriteArchiveTables(archive, header, planes, mips, clusters);
+  }
+
+  if(isOk)
+  {
+    int paddedSize = header.clusterSize + 2 * ((header.flags & HEADER_BORDER_MASK) >> HEADER_BORDER_SHIFT);
+    uint32 planeBytes[MAX_PLANES], offsets[MAX_PLANES + 1];
+    offsets[0] = 0;
+    for(i = 0; i < planesNumber; i++)
+    {
+      planeBytes[i] = ClusterDataSize(planes[i].format, paddedSize);
+      offsets[i + 1] = offsets[i] + planeBytes[i];
+    }
+    uint32 clusterBytes = offsets[planesNumber];
+    xArray<byte> payload, decoded;
+    payload.SetCount(clusterBytes);
+    decoded.SetCount(clusterBytes);
+    uint64 offset = sizeof(Header) + sizeof(PlaneHeader) * planesNumber
+      + sizeof(MipHeader) * header.mipsNumber + sizeof(ClusterHeader) * header.clustersNumber;
+    for(int c = 0; c < header.clustersNumber && isOk; c++)
+    {
+      // every plane is read to its place in the cluster image, coded ones are smaller
+      uint32 sizes[MAX_PLANES];
+      uint32 codedSize = sizeof(uint32) * planesNumber;
+      bool isRaw = true;
+      for(i = 0; i < planesNumber && isOk; i++)
+      {
+        const ClusterHeader& src = srcClusters[i][c];
+        sizes[i] = src.size;
+        isOk = src.size > 0 && src.size <= planeBytes[i]
+          && (ClusterCodec(&src) == xClusterCodec::CODEC_RAW) == (src.size == planeBytes[i])
+          && _fseeki64(srcs[i], src.offset, SEEK_SET) == 0
+          && fread(payload.Ptr() + offsets[i], src.size, 1, srcs[i]) == 1;
+        isRaw = isRaw && src.size == planeBytes[i];
+        codedSize += src.size;
+      }
+      if(!isOk)
+      {
+        break;
+      }
+
+      ClusterHeader& cluster = clusters[c];
+      cluster.offset = offset;
+      if(isRaw)
+      {
+        // raw planes are the cluster image as is, so mapped archives use them in place
+        cluster.size = clusterBytes;
+        cluster.flags = xClusterCodec::CODEC_RAW;
+        isOk = fwrite(payload.Ptr(), clusterBytes, 1, archive) == 1;
+      }
+      else if(codedSize < clusterBytes)
+      {
+        cluster.size = codedSize;
+        cluster.flags = CLUSTER_CODEC_PLANES;
+        isOk = fwrite(sizes, sizeof(uint32) * planesNumber, 1, archive) == 1;
+        for(i = 0; i < planesNumber && isOk; i++)
+        {
+          isOk = fwrite(payload.Ptr() + offsets[i], sizes[i], 1, archive) == 1;
+        }
+      }
+      else
+      {
+        // the coded planes don't pay for the size table
+        for(i = 0; i < planesNumber && isOk; i++)
+        {
+          if(sizes[i] == planeBytes[i])
+          {
+            MEMCPY(decoded.Ptr() + offsets[i], payload.Ptr() + offsets[i], planeBytes[i]);
+            continue;
+          }
+          isOk = xClusterCodec::Decode(planes[i].codec, decoded.Ptr() + offsets[i], planeBytes[i],
+            payload.Ptr() + offsets[i], sizes[i], paddedSize);
+        }
+        cluster.size = clusterBytes;
+        cluster.flags = xClusterCodec::CODEC_RAW;
+        isOk = isOk && fwrite(decoded.Ptr(), clusterBytes, 1, archive) == 1;
+      }
+      offset += cluster.size;
+    }
+  }
+
+  for(i = 0; i < opened; i++)
+  {
+    fclose(srcs[i]);
+  }
+  if(archive)
+  {
+    isOk = isOk && fseek(archive, 0, SEEK_SET) == 0 && WriteArchiveTables(archive, header, planes, mips, clusters);
+    fclose(archive);
+  }
+  return isOk;
+}
+
+void xMegaTexture::MakeWriteProc(void * params)
+{
+  MakeWrite * write = (MakeWrite*)params;
+  write->isOk = fwrite(write->data, write->size, 1, write->f) == 1;
+}
+
+void xMegaTexture::MakeHorizontalProc(void * params, int i)
+{
+  MakeRowsJob * job = (MakeRowsJob*)params;
+  const MakeLevel& level = *job->level;
+  const MakeFilter& filter = level.filterX;
+  int nextWidth = job->next->width;
+  int row = level.srcRows + i;
+  const byte * src = level.band + sizeof(byte)*3 * ((row - level.bandFirst) * level.pitch + job->border);
+  float * dst = level.hRows + 3 * nextWidth * (row - level.hFirst);
+  const int * first = filter.first.Ptr();
+  const int * count = filter.count.Ptr();
+  const float * weights = filter.weights.Ptr();
+  const float * toLinear = job->isLinear ? byteToLinear : gammaToLinear;
+  for(int x = 0; x < nextWidth; x++, dst += 3, weights += filter.maxTaps)
+  {
+    const byte * s = src + 3 * first[x];
+    float b = 0, g = 0, r = 0;
+    for(int t = 0; t < count[x]; t++, s += 3)
+    {
+      b += weights[t] * toLinear[s[0]];
+      g += weights[t] * toLinear[s[1]];
+      r += weights[t] * toLinear[s[2]];
+    }
+    dst[0] = b;
+    dst[1] = g;
+    dst[2] = r;
+  }
+}
+
+void xMegaTexture::MakeVerticalProc(void * params, int i)
+{
+  MakeRowsJob * job = (MakeRowsJob*)params;
+  const MakeLevel& level = *job->level;
+  const MakeLevel& next = *job->next;
+  const MakeFilter& filter = level.filterY;
+  int row = job->firstRow + i;
+  int n = 3 * next.width;
+  const float * weights = &filter.weights[row * filter.maxTaps];
+  float * src = level.hRows + n * (filter.first[row] - level.hFirst);
+  float * accum = job->accum + n * i;
+
+  // whole rows are weighted and summed by the SIMD processor
+  xSIMD::Processor->Mul(accum, weights[0], src, n);
+  for(int t = 1; t < filter.count[row]; t++)
+  {
+    xSIMD::Processor->MulAdd(accum, weights[t], src + n * t, n);
+  }
+  byte * dst = next.band + sizeof(byte)*3 * ((next.rows + i) * next.pitch + job->border);
+  if(job->isLinear)
+  {
+    for(int x = 0; x < n; x++)
+    {
+      dst[x] = EncodeLinear(accum[x]);
+    }
+    return;
+  }
+  for(int x = 0; x < n; x++)
+  {
+    dst[x] = EncodeGamma(accum[x]);
+  }
+}
+
+bool xMegaTexture::MakeEmitClusters(MakeState& state, int levelNum)
+{
+  MakeLevel& level = state.levels[levelNum];
+  int clusterSize = state.clusterSize;
+  int border = state.border;
+  int bandRows = clusterSize + 2 * border;
+  ASSERT(level.bandFirst == level.clusterRow * clusterSize - border);
+
+  // the borders out of the image repeat the edge pixels, so do partial clusters
+  int row, rowSize = sizeof(byte)*3 * level.pitch;
+  int firstRow = Max(-level.bandFirst, 0);
+  for(row = firstRow; row < level.rows; row++)
+  {
+    byte * dst = level.band + rowSize * row;
+    int x;
+    for(x = 0; x < border; x++)
+    {
+      MEMCPY(dst + 3*x, dst + 3*border, sizeof(byte)*3);
+    }
+    for(x = border + level.width; x < level.pitch; x++)
+    {
+      MEMCPY(dst + 3*x, dst + 3*(border + level.width - 1), sizeof(byte)*3);
+    }
+  }
+  for(row = 0; row < firstRow; row++)
+  {
+    MEMCPY(level.band + rowSize * row, level.band + rowSize * firstRow, rowSize);
+  }
+  for(row = level.rows; row < bandRows; row++)
+  {
+    MEMCPY(level.band + rowSize * row, level.band + rowSize * (level.rows - 1), rowSize);
+  }
+
+  // the payload is written while the next band is being prepared
+  byte * payload = state.payloads[state.payloadNum];
+  if(state.format == FORMAT_BC1)
+  {
+    CompressClusters(payload, level.band, level.pitch, level.clustersX, bandRows, clusterSize, state.threadsNumber);
+  }
+  else if(state.format == FORMAT_L8)
+  {
+    // gray sources have equal channels, the green one is kept
+    byte * dst = payload;
+    for(int i = 0; i < level.clustersX; i++)
+    {
+      for(row = 0; row < bandRows; row++)
+      {
+        const byte * src = level.band + rowSize * row + sizeof(byte)*3 * i * clusterSize + 1;
+        for(int x = 0; x < bandRows; x++, src += 3)
+        {
+          *dst++ = *src;
+        }
+      }
+    }
+  }
+  else
+  {
+    // rows are stored top-down, the same way the cluster lives in memory
+    byte * dst = payload;
+    for(int i = 0; i < level.clustersX; i++)
+    {
+      for(row = 0; row < bandRows; row++, dst += sizeof(byte)*3 * bandRows)
+      {
+        MEMCPY(dst, level.band + rowSize * row + sizeof(byte)*3 * i * clusterSize, sizeof(byte)*3 * bandRows);
+      }
+    }
+  }
+
+  if(state.codec != xClusterCodec::CODEC_RAW)
+  {
+    EncodeJob job;
+    job.src = payload;
+    job.dst = state.coded;
+    job.sizes = state.codedSizes.Ptr();
+    job.clusterDataSize = state.clusterDataSize;
+    job.clusterSize = bandRows;
+    job.codec = state.codec;
+    job.tolerance = state.tolerance;
+    xThread::ParallelFor(EncodeClusterProc, &job, level.clustersX, state.threadsNumber);
+  }
+
+  state.writer.Wait();
+  if(!state.write.isOk)
+  {
+    return false;
+  }
+  // coded clusters are packed over the raw ones, the clusters which don't shrink stay raw
+  const MipHeader& mip = state.mips[levelNum];
+  ClusterHeader * cluster = state.clusters + mip.firstCluster + level.clusterRow * mip.width;
+  uint32 payloadSize = 0;
+  for(int i = 0; i < level.clustersX; i++, cluster++)
+  {
+    uint32 size = state.coded ? state.codedSizes[i] : 0;
+    if(size)
+    {
+      MEMCPY(payload + payloadSize, state.coded + state.clusterDataSize * i, size);
+      cluster->flags = state.codec;
+    }
+    else
+    {
+      size = state.clusterDataSize;
+      if(payloadSize != state.clusterDataSize * i)
+      {
+        memmove(payload + payloadSize, payload + state.clusterDataSize * i, size);
+      }
+      cluster->flags = xClusterCodec::CODEC_RAW;
+    }
+    cluster->offset = state.offset;
+    cluster->size = size;
+    state.offset += size;
+    payloadSize += size;
+  }
+  state.write.data = payload;
+  state.write.size = payloadSize;
+  if(!state.writer.Start(MakeWriteProc, &state.write))
+  {
+    MakeWriteProc(&state.write);
+  }
+  state.payloadNum ^= 1;
+
+  // the rows around the bottom edge of the clusters are the top border of the next ones
+  if(border > 0)
+  {
+    MEMCPY(level.band, level.band + rowSize * clusterSize, rowSize * 2 * border);
+  }
+  level.bandFirst += clusterSize;
+  level.rows = Max(level.rows - clusterSize, 0);
+  level.clusterRow++;
+  return true;
+}
+
+bool xMegaTexture::MakeProcessBand(MakeState& state, int levelNum)
+{
+  MakeLevel& level = state.levels[levelNum];
+  int clusterSize = state.clusterSize;
+  int bandRows = clusterSize + 2 * state.border;
+  bool isLast = levelNum + 1 >= state.levelsNumber;
+  int srcRows = level.bandFirst + level.rows;
+  ASSERT(level.rows == bandRows || srcRows == level.height);
+
+  // the new rows are filtered horizontally before the band moves on
+  MakeRowsJob job;
+  job.level = &level;
+  job.next = isLast ? NULL : &state.levels[levelNum + 1];
+  job.accum = state.accum;
+  job.border = state.border;
+  job.firstRow = 0;
+  job.isLinear = state.isLinear;
+  if(!isLast)
+  {
+    ASSERT(srcRows - level.hFirst <= bandRows + level.filterY.maxTaps);
+    xThread::ParallelFor(MakeHorizontalProc, &job, srcRows - level.srcRows, state.threadsNumber);
+    level.hCount = srcRows - level.hFirst;
+  }
+  level.srcRows = srcRows;
+
+  // the last band may hold more than one row of clusters
+  const MipHeader& mip = state.mips[levelNum];
+  while(level.clusterRow < mip.height && (level.rows == bandRows || srcRows == level.height))
+  {
+    if(!MakeEmitClusters(state, levelNum))
+    {
+      return false;
+    }
+  }
+  if(isLast)
+  {
+    return true;
+  }
+
+  // every row of the next mip whose taps are all filtered is produced,
+  // a chunk never crosses the end of the next band
+  MakeLevel& next = state.levels[levelNum + 1];
+  const MakeFilter& filterY = level.filterY;
+  while(level.nextRow < next.height)
+  {
+    int rows = 0;
+    while(level.nextRow + rows < next.height && next.rows + rows < bandRows
+      && filterY.first[level.nextRow + rows] + filterY.count[level.nextRow + rows] <= level.srcRows)
+    {
+      rows++;
+    }
+    if(!rows)
+    {
+      break;
+    }
+    job.firstRow = level.nextRow;
+    xThread::ParallelFor(MakeVerticalProc, &job, rows, state.threadsNumber);
+    level.nextRow += rows;
+    next.rows += rows;
+    if(next.rows == bandRows || level.nextRow == next.height)
+    {
+      if(!MakeProcessBand(state, levelNum + 1))
+      {
+        return false;
+      }
+    }
+  }
+
+  // rows no longer needed by the vertical pass are dropped
+  int hFirst = level.nextRow < next.height ? Min(filterY.first[level.nextRow], level.srcRows) : level.srcRows;
+  if(hFirst > level.hFirst)
+  {
+    int n = 3 * next.width;
+    int keep = level.hFirst + level.hCount - hFirst;
+    if(keep > 0)
+    {
+      memmove(level.hRows, level.hRows + n * (hFirst - level.hFirst), sizeof(float) * n * keep);
+    }
+    level.hFirst = hFirst;
+    level.hCount = keep > 0 ? keep : 0;
+  }
+  return true;
+}
+
+bool xMegaTexture::WriteArchiveTables(FILE * f, const Header& header, const PlaneHeader * planes,
+  const xArray<MipHeader>& mips, const xArray<ClusterHeader>& clusters)
+{
+  // the plane table is there only if the version says so
+  int planesNumber = header.version == VERSION_PLANES ? (header.flags & HEADER_PLANES_MASK) >> HEADER_PLANES_SHIFT : 0;
+  ASSERT(!planesNumber || planes);
+  return fwrite(&header, sizeof(header), 1, f) == 1
+    && (!planesNumber || fwrite(planes, sizeof(PlaneHeader) * planesNumber, 1, f) == 1)
+    && fwrite(mips.Ptr(), sizeof(MipHeader) * mips.Count(), 1, f) == 1
+    && fwrite(clusters.Ptr(), sizeof(ClusterHeader) * clusters.Count(), 1, f) == 1;
+}
+
+xString xMegaTexture::ArchiveFilename(const xString& prefix)
+{
+  return prefix + _T(".mega");
+}
+
+uint32 xMegaTexture::ClusterDataSize(int format, int clusterSize)
+{
+  if(format == FORMAT_BC1)
+  {
+    return 8 * (clusterSize / 4) * (clusterSize / 4);
+  }
+  if(format == FORMAT_L8)
+  {
+    return sizeof(byte) * clusterSize * clusterSize;
+  }
+  return sizeof(byte)*3 * clusterSize * clusterSize;
+}
+
+void xMegaTexture::EncodeClusterProc(void * params, int i)
+{
+  EncodeJob * job = (EncodeJob*)params;
+  // a coded cluster has to be smaller than the raw one to be worth decoding
+  job->sizes[i] = xClusterCodec::Encode(job->codec, job->dst + job->clusterDataSize * i, job->clusterDataSize - 1,
+    job->src + job->clusterDataSize * i, job->clusterDataSize, job->clusterSize, job->tolerance);
+}
+
+void xMegaTexture::CompressClusterProc(void * params, int i)
+{
+  CompressJob * job = (CompressJob*)params;
+  uint32 clusterDataSize = ClusterDataSize(FORMAT_BC1, job->clusterSize);
+  int blocks = job->clusterSize / 4;
+  xSIMD::Processor->CompressBC1(job->dst + clusterDataSize * i, 8 * blocks,
+    job->image + sizeof(byte)*3 * i * job->clusterStep, sizeof(byte)*3 * job->width, blocks, blocks);
+}
+
+void xMegaTexture::CompressClusters(byte * dst, const byte * image, int width, int clustersNumber,
+  int clusterSize, int clusterStep, int threadsNumber)
+{
+  CompressJob job;
+  job.image = image;
+  job.width = width;
+  job.clusterSize = clusterSize;
+  job.clusterStep = clusterStep;
+  job.dst = dst;
+
+  // clusters are taken one by one, the calling thread does its share too
+  xThread::ParallelFor(CompressClusterProc, &job, clustersNumber, threadsNumber);
+}
+
+void xMegaTexture::DecodeBC1Block(byte * dst, int pitch, const byte * block, int pixelBytes)
+{
+  word colors[2] = { (word)(block[0] | (block[1] << 8)), (word)(block[2] | (block[3] << 8)) };
+  byte palette[4][3];
+  for(int k = 0; k < 2; k++)
+  {
+    int b = colors[k] & 31, g = (colors[k] >> 5) & 63, r = colors[k] >> 11;
+    palette[k][0] = (byte)((b << 3) | (b >> 2));
+    palette[k][1] = (byte)((g << 2) | (g >> 4));
+    palette[k][2] = (byte)((r << 3) | (r >> 2));
+  }
+  for(int c = 0; c < 3; c++)
+  {
+    if(colors[0] > colors[1])
+    {
+      palette[2][c] = (byte)((2 * palette[0][c] + palette[1][c]) / 3);
+      palette[3][c] = (byte)((palette[0][c] + 2 * palette[1][c]) / 3);
+    }
+    else
+    {
+      palette[2][c] = (byte)((palette[0][c] + palette[1][c]) / 2);
+      palette[3][c] = 0;
+    }
+  }
+  dword indices = block[4] | (block[5] << 8) | (block[6] << 16) | (block[7] << 24);
+  for(int y = 0; y < 4; y++, dst += pitch)
+  {
+    byte * rowDest = dst;
+    for(int x = 0; x < 4; x++, indices >>= 2)
+    {
+      const byte * color = palette[indices & 3];
+      *rowDest++ = color[0];
+      *rowDest++ = color[1];
+      *rowDest++ = color[2];
+      if(pixelBytes == 4)
+      {
+        *rowDest++ = 0xff;
+      }
+    }
+  }
+}
+
+bool xMegaTexture::ReadArchive(HANDLE f, uint64 offset, void * buf, uint32 size)
+{
+  // positioned read, the file pointer is never used
+  OVERLAPPED overlapped;
+  MEMSET(&overlapped, 0, sizeof(overlapped));
+  overlapped.Offset = (DWORD)offset;
+  overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+  DWORD readSize = 0;
+  return ReadFile(f, buf, size, &readSize, &overlapped) && readSize == size;
+}
+
+bool xMegaTexture::OpenArchive()
+{
+  CloseArchive();
+
+  archiveFilename = ArchiveFilename(filename);
+  archiveFile = CreateFile(archiveFilename.ToChar(), GENERIC_READ, FILE_SHARE_READ, NULL,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+  if(archiveFile == INVALID_HANDLE_VALUE)
+  {
+    return false;
+  }
+
+  LARGE_INTEGER fileSize;
+  if(!GetFileSizeEx(archiveFile, &fileSize))
+  {
+    CloseArchive();
+    return false;
+  }
+  archiveSize = (uint64)fileSize.QuadPart;
+
+  if(!ReadArchive(archiveFile, 0, &archiveHeader, sizeof(archiveHeader))
+    || archiveHeader.id != ID || (archiveHeader.version != VERSION && archiveHeader.version != VERSION_PLANES)
+    || archiveHeader.clusterSize != clusterSize
+    || archiveHeader.mipsNumber <= 0 || archiveHeader.clustersNumber <= 0)
+  {
+    CloseArchive();
+    return false;
+  }
+  clusterBorder = (archiveHeader.flags & HEADER_BORDER_MASK) >> HEADER_BORDER_SHIFT;
+
+  // archives of a single plane have no plane table
+  uint64 offset = sizeof(Header);
+  PlaneHeader archivePlanes[MAX_PLANES];
+  int archivePlanesNumber = 1;
+  archivePlanes[0].format = archiveHeader.flags & HEADER_FORMAT_MASK;
+  archivePlanes[0].codec = xClusterCodec::CODEC_RAW;
+  if(archiveHeader.version == VERSION_PLANES)
+  {
+    archivePlanesNumber = (archiveHeader.flags & HEADER_PLANES_MASK) >> HEADER_PLANES_SHIFT;
+    if(archivePlanesNumber < 1 || archivePlanesNumber > MAX_PLANES
+      || !ReadArchive(archiveFile, offset, archivePlanes, sizeof(PlaneHeader) * archivePlanesNumber))
+    {
+      CloseArchive();
+      return false;
+    }
+    offset += sizeof(PlaneHeader) * archivePlanesNumber;
+  }
+  bool isOk = clusterBorder <= clusterSize / 2;
+  for(int i = 0; i < archivePlanesNumber; i++)
+  {
+    int format = archivePlanes[i].format;
+    isOk = isOk && (format == FORMAT_BGR24 || format == FORMAT_BC1 || format == FORMAT_L8)
+      && (format != FORMAT_BC1 || (clusterBorder % 4) == 0) && xClusterCodec::IsValid(archivePlanes[i].codec);
+  }
+  if(!isOk)
+  {
+    CloseArchive();
+    return false;
+  }
+  SetPlanes(archivePlanes, archivePlanesNumber);
+
+  archiveMips.SetCount(archiveHeader.mipsNumber);
+  archiveClusters.SetCount(archiveHeader.clustersNumber);
+
+  uint32 mipsSize = sizeof(MipHeader) * archiveHeader.mipsNumber;
+  uint32 clustersSize = sizeof(ClusterHeader) * archiveHeader.clustersNumber;
+  if(!ReadArchive(archiveFile, offset, archiveMips.Ptr(), mipsSize)
+    || !ReadArchive(archiveFile, offset + mipsSize, archiveClusters.Ptr(), clustersSize))
+  {
+    CloseArchive();
+    return false;
+  }
+
+  for(int i = 0; i < archiveHeader.mipsNumber; i++)
+  {
+    const MipHeader& mip = archiveMips[i];
+    if(mip.width <= 0 || mip.height <= 0 || mip.firstCluster < 0
+      || mip.firstCluster + mip.width * mip.height > archiveHeader.clustersNumber)
+    {
+      CloseArchive();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool xMegaTexture::MapArchive()
+{
+  ASSERT(IsArchive() && !IsMapped());
+
+  // the whole archive is mapped at once, if the address space is too small
+  // clusters are read through ReadArchive as usual
+  archiveMapping = CreateFileMapping(archiveFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if(!archiveMapping)
+  {
+    return false;
+  }
+  archiveView = (byte*)MapViewOfFile(archiveMapping, FILE_MAP_READ, 0, 0, 0);
+  if(!archiveView)
+  {
+    CloseHandle(archiveMapping);
+    archiveMapping = NULL;
+    return false;
+  }
+  // the error cluster comes from the image pool, see InitImagePool
+  return true;
+}
+
+void xMegaTexture::CloseArchive()
+{
+  if(archiveView)
+  {
+    UnmapViewOfFile(archiveView);
+    archiveView = NULL;
+  }
+  if(archiveMapping)
+  {
+    CloseHandle(archiveMapping);
+    archiveMapping = NULL;
+  }
+  if(archiveFile != INVALID_HANDLE_VALUE)
+  {
+    CloseHandle(archiveFile);
+    archiveFile = INVALID_HANDLE_VALUE;
+  }
+  archiveSize = 0;
+  clusterBorder = 0;
+  MEMSET(&archiveHeader, 0, sizeof(archiveHeader));
+  archiveMips.Clear();
+  archiveClusters.Clear();
+
+  // separate tga files are of a single BGR plane
+  PlaneHeader plane;
+  plane.format = FORMAT_BGR24;
+  plane.codec = xClusterCodec::CODEC_RAW;
+  SetPlanes(&plane, 1);
+}
+
+void xMegaTexture::SetPlanes(const PlaneHeader * p_planes, int count)
+{
+  ASSERT(count > 0 && count <= MAX_PLANES);
+  planesNumber = count;
+  planeOffsets[0] = 0;
+  for(int i = 0; i < count; i++)
+  {
+    planes[i] = p_planes[i];
+    planeOffsets[i + 1] = planeOffsets[i] + ClusterDataSize(planes[i].format, PaddedClusterSize());
+  }
+  clusterFormat = planes[0].format;
+}
+
+const xMegaTexture::ClusterHeader * xMegaTexture::FindArchiveCluster(int mip, int x, int y) const
+{
+  if(mip < 0 || mip >= archiveMips.Count())
+  {
+    return NULL;
+  }
+  const MipHeader& mipHeader = archiveMips[mip];
+  if(x < 0 || y < 0 || x >= mipHeader.width || y >= mipHeader.height)
+  {
+    return NULL;
+  }
+  return &archiveClusters[mipHeader.firstCluster + y * mipHeader.width + x];
+}
+
+bool xMegaTexture::IsClusterValid(const ClusterHeader * cluster) const
+{
+  int codec = ClusterCodec(cluster);
+  if(cluster->offset + cluster->size > archiveSize)
+  {
+    return false;
+  }
+  if(codec == xClusterCodec::CODEC_RAW)
+  {
+    return cluster->size == ClusterBytes();
+  }
+  if(codec == CLUSTER_CODEC_PLANES)
+  {
+    return planesNumber > 1 && cluster->size > sizeof(uint32) * planesNumber && cluster->size < ClusterBytes();
+  }
+  // coded payloads are read to the scratch buffers of the stream threads
+  return xClusterCodec::IsValid(codec) && cluster->size > 0 && cluster->size < ClusterBytes();
+}
+
+bool xMegaTexture::DecodeCluster(byte * dst, const byte * src, uint32 size, int codec) const
+{
+  if(codec != CLUSTER_CODEC_PLANES)
+  {
+    return xClusterCodec::Decode(codec, dst, ClusterBytes(), src, size, PaddedClusterSize());
+  }
+  // the sizes of the planes go first, a plane of the full size is stored raw
+  uint32 sizes[MAX_PLANES];
+  uint32 tableSize = sizeof(uint32) * planesNumber;
+  if(size < tableSize)
+  {
+    return false;
+  }
+  MEMCPY(sizes, src, tableSize);
+  src += tableSize;
+  size -= tableSize;
+  for(int i = 0; i < planesNumber; i++)
+  {
+    uint32 planeBytes = planeOffsets[i + 1] - planeOffsets[i];
+    if(sizes[i] > size || sizes[i] > planeBytes)
+    {
+      return false;
+    }
+    if(sizes[i] == planeBytes)
+    {
+      MEMCPY(dst + planeOffsets[i], src, planeBytes);
+    }
+    else if(!xClusterCodec::Decode(planes[i].codec, dst + planeOffsets[i], planeBytes, src, sizes[i], PaddedClusterSize()))
+    {
+      return false;
+    }
+    src += sizes[i];
+    size -= sizes[i];
+  }
+  return size == 0;
+}
+
+byte * xMegaTexture::FillErrorCluster(byte * buf)
+{
+  // pool images aren't heap blocks, so the size can't be checked
+  ASSERT(buf);
+  static byte colors[][3] = 
+  {
+    {0xC8, 0x00, 0x00},
+    {0x30, 0x30, 0x30},
+  };
+  // the squares are counted from the corner of the cluster inside the border
+  int colorSize = clusterSize / 8;
+  int size = PaddedClusterSize();
+  int start = clusterSize - clusterBorder;
+  for(int plane = 0; plane < planesNumber; plane++)
+  {
+    byte * dst = buf + planeOffsets[plane];
+    int format = planes[plane].format;
+    if(format == FORMAT_BC1)
+    {
+      // the squares are aligned to the blocks, so every block has a single color
+      int blocks = size / 4;
+      for(int y = 0; y < blocks; y++)
+      {
+        for(int x = 0; x < blocks; x++, dst += 8)
+        {
+          int i = ((start + x*4)/colorSize ^ (start + y*4)/colorSize) & 1;
+          word color = (word)(((colors[i][2] >> 3) << 11) | ((colors[i][1] >> 2) << 5) | (colors[i][0] >> 3));
+          dst[0] = dst[2] = (byte)color;
+          dst[1] = dst[3] = (byte)(color >> 8);
+          dst[4] = dst[5] = dst[6] = dst[7] = 0;
+        }
+      }
+      continue;
+    }
+    if(format == FORMAT_L8)
+    {
+      for(int y = 0; y < size; y++)
+      {
+        for(int x = 0; x < size; x++)
+        {
+          *dst++ = colors[((start + x)/colorSize ^ (start + y)/colorSize) & 1][0];
+        }
+      }
+      continue;
+    }
+    for(int y = 0; y < size; y++)
+    {
+      for(int x = 0; x < size; x++, dst += 3)
+      { 
+        int i = ((start + x)/colorSize ^ (start + y)/colorSize) & 1;
+        dst[0] = colors[i][0];
+        dst[1] = colors[i][1];
+        dst[2] = colors[i][2];
+      }
+    }
+  }
+  return buf;
+}
+
+byte * xMegaTexture::LoadMip(byte * buf, int mip, int px, int py)
+{
+  if(!buf)
+  {
+    buf = AllocImage();
+  }
+  if(!IsArchive())
+  {
+    return LoadMipTGA(buf, mip, px, py);
+  }
+
+  const ClusterHeader * cluster = FindArchiveCluster(mip, px, py);
+  if(!cluster || !IsClusterValid(cluster))
+  {
+    return FillErrorCluster(buf);
+  }
+  int codec = ClusterCodec(cluster);
+  if(codec == xClusterCodec::CODEC_RAW)
+  {
+    return ReadArchive(archiveFile, cluster->offset, buf, cluster->size) ? buf : FillErrorCluster(buf);
+  }
+
+  // coded clusters of a mapped archive are decoded straight from the view
+  const byte * data = IsMapped() ? archiveView + cluster->offset : NULL;
+  byte * coded = NULL;
+  if(!data)
+  {
+    // the coded payload is smaller than the image, so a pool image holds it
+    coded = AllocImage();
+    if(ReadArchive(archiveFile, cluster->offset, coded, cluster->size))
+    {
+      data = coded;
+    }
+  }
+  bool isOk = false;
+  if(data)
+  {
+    xStatsTimer timer(frameStats.decodeTime);
+    isOk = DecodeCluster(buf, data, cluster->size, codec);
+  }
+  if(coded)
+  {
+    FreeImage(coded);
+  }
+  return isOk ? buf : FillErrorCluster(buf);
+}
+
+byte * xMegaTexture::MapMip(int mip, int px, int py)
+{
+  ASSERT(IsMapped());
+  const ClusterHeader * cluster = FindArchiveCluster(mip, px, py);
+  if(!cluster || !IsClusterValid(cluster))
+  {
+    return errorCluster;
+  }
+  // coded clusters can't be used in place, LoadMip decodes them
+  if(ClusterCodec(cluster) != xClusterCodec::CODEC_RAW)
+  {
+    return NULL;
+  }
+  return archiveView + cluster->offset;
+}
+
+void xMegaTexture::LoadCluster(Cluster * cluster, int mip, float delay)
+{
+  DetachRequest(cluster);
+  if(IsStreaming())
+  {
+    const ClusterHeader * header = FindArchiveCluster(mip, cluster->x, cluster->y);
+    if(header && IsClusterValid(header))
+    {
+      int codec = ClusterCodec(header);
+      if(IsMapped() && codec == xClusterCodec::CODEC_RAW)
+      {
+        if(!cluster->isMapped && cluster->image)
+        {
+          FreeImage(cluster->image);
+        }
+        cluster->image = archiveView + header->offset;
+        cluster->isMapped = true;
+      }
+      else if(!cluster->image || cluster->isMapped)
+      {
+        cluster->image = AllocImage();
+        cluster->isMapped = false;
+      }
+
+      StreamRequest * request = AllocRequest();
+      request->mip = mip;
+      request->x = cluster->x;
+      request->y = cluster->y;
+      request->offset = header->offset;
+      request->size = header->size;
+      request->buf = cluster->image;
+      request->cluster = cluster;
+      request->isMapped = cluster->isMapped;
+      request->isLoaded = false;
+      request->codec = codec;
+      request->issueTime = StatsTime();
+      request->loadTime = 0;
+      request->decodeTime = 0;
+      request->deadline = viewerTime + delay;
+      request->priority = RequestPriority(request);
+      request->heapIndex = -1;
+      request->next = NULL;
+
+      cluster->request = request;
+      cluster->isReady = false;
+
+      streamMutex.Lock();
+      PushRequest(request);
+      streamMutex.Unlock();
+      streamSemaphore.Release();
+      return;
+    }
+    // broken clusters are resolved right away
+  }
+  cluster->isReady = true;
+  xStatsTimer timer(frameStats.loadTime);
+  const ClusterHeader * header = IsArchive() ? FindArchiveCluster(mip, cluster->x, cluster->y) : NULL;
+  if(header && IsClusterValid(header))
+  {
+    cacheStats.loads++;
+    cacheStats.bytesRead += header->size;
+    FrameMipStats(mip).loads++;
+    frameStats.bytesRead += header->size;
+    AddResidentTime(0);
+  }
+  const byte * mapped = IsMapped() ? MapMip(mip, cluster->x, cluster->y) : NULL;
+  if(mapped)
+  {
+    if(!cluster->isMapped && cluster->image)
+    {
+      FreeImage(cluster->image);
+    }
+    cluster->image = (byte*)mapped;
+    cluster->isMapped = true;
+    return;
+  }
+  if(cluster->isMapped)
+  {
+    cluster->image = NULL;
+    cluster->isMapped = false;
+  }
+  cluster->image = LoadMip(cluster->image, mip, cluster->x, cluster->y);
+}
+
+const byte * xMegaTexture::FallbackCluster(int layerNum, int x, int y, int plane)
+{
+  ASSERT(fallbackCluster);
+  // only the plane is filled, the others are left as they are
+  int size = PaddedClusterSize();
+  for(int k = 1; layerNum + k < layersNumber && (clusterSize >> k) > 0; k++)
+  {
+    Cluster * parent = layers[layerNum + k].FindCluster(x >> k, y >> k);
+    if(!parent || !parent->isReady)
+    {
+      continue;
+    }
+    // the nearest coarser cluster is scaled up to cover the missing one, the border too:
+    // it's never wider than the border of the parent. subX and subY are padded coords in the parent,
+    // (c + clusterSize) >> k is used instead of c >> k to round down negative coords
+    int subSize = clusterSize >> k;
+    int subX = (x & ((1 << k) - 1)) * subSize + clusterBorder - subSize;
+    int subY = (y & ((1 << k) - 1)) * subSize + clusterBorder - subSize;
+    byte * dst = fallbackCluster + planeOffsets[plane];
+    const byte * parentImage = parent->image + planeOffsets[plane];
+    if(planes[plane].format == FORMAT_BC1)
+    {
+      // all the pixels of a block come from one parent block, so its colors are kept
+      // and only the indices are scaled up
+      int blocks = size / 4;
+      for(int by = 0; by < blocks; by++)
+      {
+        for(int bx = 0; bx < blocks; bx++, dst += 8)
+        {
+          int parentX = subX + ((bx*4 - clusterBorder + clusterSize) >> k);
+          int parentY = subY + ((by*4 - clusterBorder + clusterSize) >> k);
+          const byte * src = parentImage + 8 * ((parentY >> 2) * blocks + (parentX >> 2));
+          dword srcIndices = *(const dword*)(src + 4);
+          dword indices = 0;
+          for(int py = 0; py < 4; py++)
+          {
+            int sy = (subY + ((by*4 + py - clusterBorder + clusterSize) >> k)) & 3;
+            for(int px = 0; px < 4; px++)
+            {
+              int sx = (subX + ((bx*4 + px - clusterBorder + clusterSize) >> k)) & 3;
+              indices |= ((srcIndices >> (2 * (sy*4 + sx))) & 3) << (2 * (py*4 + px));
+            }
+          }
+          *(dword*)dst = *(const dword*)src;
+          *(dword*)(dst + 4) = indices;
+        }
+      }
+      return fallbackCluster;
+    }
+    if(planes[plane].format == FORMAT_L8)
+    {
+      for(int row = 0; row < size; row++)
+      {
+        const byte * srcRow = parentImage + (subY + ((row - clusterBorder + clusterSize) >> k)) * size + subX;
+        for(int col = 0; col < size; col++)
+        {
+          *dst++ = srcRow[(col - clusterBorder + clusterSize) >> k];
+        }
+      }
+      return fallbackCluster;
+    }
+    for(int row = 0; row < size; row++)
+    {
+      const byte * srcRow = parentImage + sizeof(byte)*3 * ((subY + ((row - clusterBorder + clusterSize) >> k)) * size + subX);
+      for(int col = 0; col < size; col++, dst += 3)
+      {
+        const byte * src = srcRow + sizeof(byte)*3 * ((col - clusterBorder + clusterSize) >> k);
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+      }
+    }
+    return fallbackCluster;
+  }
+  return FillErrorCluster(fallbackCluster);
+}
+
+int xMegaTexture::ComparePrefetchItems(const PrefetchItem * a, const PrefetchItem * b)
+{
+  if(a->time != b->time)
+  {
+    return a->time < b->time ? -1 : 1;
+  }
+  // coarser clusters are fallbacks for finer ones
+  return b->mip - a->mip;
+}
+
+void xMegaTexture::Prefetch(const xVec2& pos, const xVec2& velocity, float time)
+{
+  enum { STEPS = 8 };
+  xVec2 path[STEPS+1];
+  float times[STEPS+1];
+  for(int i = 0; i <= STEPS; i++)
+  {
+    times[i] = time * (float)i / (float)STEPS;
+    path[i] = pos + velocity * times[i];
+  }
+  Prefetch(path, times, STEPS+1);
+}
+
+void xMegaTexture::Prefetch(const xVec2 * path, const float * times, int count)
+{
+  if(!IsStreaming() || count < 2)
+  {
+    return;
+  }
+  ProcessStreaming();
+
+  xArray<PrefetchItem>& items = prefetchItems;
+  items.SetCount(0, false);
+  prefetchStamp++;
+  for(int mip = 0; mip < layersNumber; mip++)
+  {
+    MipLayer * layer = layers + mip;
+    if(!layer->width || !layer->height)
+    {
+      continue;
+    }
+    // the window keeps its offset from the camera while moving
+    float scale = 1.0f / (float)(1 << mip);
+    float offsX = (float)layer->x - path[0].x * scale;
+    float offsY = (float)layer->y - path[0].y * scale;
+    int lastX = layer->x, lastY = layer->y;
+    for(int i = 1; i < count; i++)
+    {
+      int wx = (int)xMath::Floor(path[i].x * scale + offsX);
+      int wy = (int)xMath::Floor(path[i].y * scale + offsY);
+      if(wx == lastX && wy == lastY)
+      {
+        continue;
+      }
+      lastX = wx;
+      lastY = wy;
+      for(int y = wy; y < wy + layer->height; y++)
+      {
+        for(int x = wx; x < wx + layer->width; x++)
+        {
+          if(x >= layer->x && x < layer->x + layer->width
+            && y >= layer->y && y < layer->y + layer->height)
+          {
+            continue;
+          }
+          if(!FindArchiveCluster(mip, x, y))
+          {
+            continue;
+          }
+          int index = PageTableIndex(mip, x, y);
+          if(prefetchStamps[index] == prefetchStamp)
+          {
+            continue;
+          }
+          prefetchStamps[index] = prefetchStamp;
+          PrefetchItem& item = items.Alloc();
+          item.mip = mip;
+          item.x = x;
+          item.y = y;
+          item.time = times[i];
+        }
+      }
+    }
+  }
+  items.Sort(ComparePrefetchItems);
+
+  // clusters used by this pass are never evicted by it, the budget stops prefetching
+  cacheStamp++;
+  int requested = 0;
+  for(int i = 0; i < items.Count(); i++)
+  {
+    const PrefetchItem& item = items[i];
+    bool isCached = FindCachedCluster(item.mip, item.x, item.y) != NULL;
+    if(!isCached && requested >= prefetchLimit)
+    {
+      continue;
+    }
+    if(!AcquireCluster(item.mip, item.x, item.y, false, false, item.time))
+    {
+      break;
+    }
+    if(!isCached)
+    {
+      requested++;
+      cacheStats.prefetches++;
+    }
+  }
+}
+
+// =================================================================
+// =================================================================
+// =================================================================
+
+xMegaTexture::Cluster * xMegaTexture::FindCachedCluster(int mip, int x, int y)
+{
+  Cluster ** p = cache.Get(ClusterKey(mip, x, y));
+  return p ? *p : NULL;
+}
+
+xMegaTexture::Cluster * xMegaTexture::AcquireCluster(int mip, int x, int y, bool pin, bool canGrow, float delay)
+{
+  Cluster * cluster = FindCachedCluster(mip, x, y);
+  FrameMipStats(mip).requests++;
+  if(cluster)
+  {
+    cacheStats.hits++;
+    FrameMipStats(mip).hits++;
+  }
+  else
+  {
+    if(cacheBytes + ClusterBytes() > cacheBudget)
+    {
+      // the least recently used cluster is recycled unless it's needed by the current pass
+      Cluster * last = cacheLRU.Prev();
+      if(last && last->stamp != cacheStamp)
+      {
+        EvictCluster(last);
+        cluster = last;
+      }
+      else if(!canGrow)
+      {
+        return NULL;
+      }
+    }
+    if(!cluster)
+    {
+      cluster = AllocCluster();
+    }
+    cacheStats.misses++;
+    cacheBytes += ClusterBytes();
+
+    cluster->mip = mip;
+    cluster->x = x;
+    cluster->y = y;
+    cluster->pinsNumber = 0;
+    cache.Set(ClusterKey(mip, x, y), cluster);
+    LoadCluster(cluster, mip, delay);
+  }
+  cluster->stamp = cacheStamp;
+  if(pin)
+  {
+    cluster->lruNode.Remove();
+    cluster->pinsNumber++;
+  }
+  else if(!cluster->pinsNumber)
+  {
+    cluster->lruNode.InsertAfter(cacheLRU);
+  }
+  return cluster;
+}
+
+void xMegaTexture::ReleaseCluster(Cluster * cluster)
+{
+  ASSERT(cluster->pinsNumber > 0);
+  if(--cluster->pinsNumber > 0)
+  {
+    // a page or another layer still holds it
+    return;
+  }
+  cluster->lruNode.InsertAfter(cacheLRU);
+  // the window has moved on before the cluster has been read
+  StreamRequest * request = cluster->request;
+  if(request && IsStaleRequest(request) && CancelRequest(request))
+  {
+    DropRequest(request);
+  }
+}
+
+void xMegaTexture::EvictCluster(Cluster * cluster)
+{
+  ASSERT(!cluster->pinsNumber);
+  cluster->lruNode.Remove();
+  cache.Remove(ClusterKey(cluster->mip, cluster->x, cluster->y));
+  cacheBytes -= ClusterBytes();
+  cacheStats.evictions++;
+  FrameMipStats(cluster->mip).evictions++;
+}
+
+void xMegaTexture::TrimCache(uint32 budget)
+{
+  while(cacheBytes > budget)
+  {
+    Cluster * cluster = cacheLRU.Prev();
+    if(!cluster)
+    {
+      break;
+    }
+    EvictCluster(cluster);
+    DetachRequest(cluster);
+    DeleteCluster(cluster);
+  }
+}
+
+void xMegaTexture::ClearCache()
+{
+  cacheLRU.Clear();
+  cache.ForEach(DeleteClusterProc, this);
+  cacheBytes = 0;
+}
+
+void xMegaTexture::DeleteCluster(Cluster * cluster)
+{
+  // a streaming request keeps the image until it's completed
+  if(!cluster->request && !cluster->isMapped && cluster->image)
+  {
+    FreeImage(cluster->image);
+  }
+  FreeCluster(cluster);
+}
+
+int xMegaTexture::DeleteClusterProc(const ClusterKey& key, Cluster *& cluster, void * params)
+{
+  ((xMegaTexture*)params)->DeleteCluster(cluster);
+  return ITERATE_DELETE_ITEM;
+}
+
+void xMegaTexture::SetCacheBudget(uint32 bytes)
+{
+  cacheBudget = bytes;
+  TrimCache(cacheBudget);
+  // the pool follows a bigger budget, it doesn't shrink before the next Init
+  if(imageStride && !IsMapped())
+  {
+    ReserveImages((int)(cacheBudget / imageStride) - imagesNumber);
+  }
+  if(imageStride)
+  {
+    ReserveRecords((int)(cacheBudget / ClusterBytes()) - recordsNumber);
+  }
+}
+
+xMegaTexture::CacheStats xMegaTexture::GetCacheStats() const
+{
+  CacheStats stats = cacheStats;
+  stats.clustersNumber = cache.Count();
+  stats.bytes = cacheBytes;
+  stats.budget = cacheBudget;
+  stats.poolBytes = imageStride * imagesNumber;
+  return stats;
+}
+
+void xMegaTexture::ResetCacheStats()
+{
+  MEMSET(&cacheStats, 0, sizeof(cacheStats));
+}
+
+// =================================================================
+
+void xMegaTexture::InitImagePool()
+{
+  FreeImagePool();
+  imageStride = (ClusterBytes() + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1);
+  // clusters of a mapped archive usually point to the view, so its pool grows on demand
+  if(!IsMapped())
+  {
+    ReserveImages((int)(cacheBudget / imageStride));
+  }
+  else
+  {
+    // broken clusters of the view all point to one image
+    ReserveImages(1);
+    errorCluster = FillErrorCluster(AllocImage());
+  }
+  ReserveRecords((int)(cacheBudget / ClusterBytes()));
+}
+
+void xMegaTexture::FreeImagePool()
+{
+  if(errorCluster)
+  {
+    FreeImage(errorCluster);
+    errorCluster = NULL;
+  }
+  ASSERT(freeImagesNumber == imagesNumber);
+  for(int i = 0; i < imageSlabs.Count(); i++)
+  {
+    VirtualFree(imageSlabs[i].memory, 0, MEM_RELEASE);
+  }
+  imageSlabs.Clear();
+  freeImages = NULL;
+  imagesNumber = 0;
+  freeImagesNumber = 0;
+
+  ASSERT(freeClustersNumber == recordsNumber && freeRequestsNumber == recordsNumber);
+  for(int i = 0; i < clusterSlabs.Count(); i++)
+  {
+    delete [] clusterSlabs[i];
+    delete [] requestSlabs[i];
+  }
+  clusterSlabs.Clear();
+  requestSlabs.Clear();
+  freeClusters = NULL;
+  freeRequests = NULL;
+  recordsNumber = 0;
+  freeClustersNumber = 0;
+  freeRequestsNumber = 0;
+}
+
+bool xMegaTexture::ReserveImages(int count)
+{
+  ASSERT(imageStride > 0);
+  if(count <= 0)
+  {
+    return true;
+  }
+  ImageSlab slab;
+  slab.memory = (byte*)VirtualAlloc(NULL, (SIZE_T)imageStride * count, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if(!slab.memory)
+  {
+    return false;
+  }
+  slab.imagesNumber = count;
+  imageSlabs.Append(slab);
+
+  // images are handed out in the address order
+  for(int i = count - 1; i >= 0; i--)
+  {
+    byte * image = slab.memory + imageStride * i;
+    *(byte**)image = freeImages;
+    freeImages = image;
+  }
+  imagesNumber += count;
+  freeImagesNumber += count;
+  return true;
+}
+
+byte * xMegaTexture::AllocImage()
+{
+  if(!freeImages)
+  {
+    // pinned clusters and buffers of detached requests may exceed the budget
+    ReserveImages(IMAGE_SLAB_GROW);
+    ASSERT(freeImages);
+  }
+  byte * image = freeImages;
+  freeImages = *(byte**)image;
+  freeImagesNumber--;
+  return image;
+}
+
+void xMegaTexture::FreeImage(byte * image)
+{
+  ASSERT(image && freeImagesNumber < imagesNumber);
+  *(byte**)image = freeImages;
+  freeImages = image;
+  freeImagesNumber++;
+}
+
+void xMegaTexture::ReserveRecords(int count)
+{
+  if(count <= 0)
+  {
+    return;
+  }
+  Cluster * clusters = new Cluster[count];
+  StreamRequest * requests = new StreamRequest[count];
+  ASSERT(clusters && requests);
+  clusterSlabs.Append(clusters);
+  requestSlabs.Append(requests);
+  for(int i = count - 1; i >= 0; i--)
+  {
+    clusters[i].next = freeClusters;
+    freeClusters = clusters + i;
+    requests[i].next = freeRequests;
+    freeRequests = requests + i;
+  }
+  recordsNumber += count;
+  freeClustersNumber += count;
+  freeRequestsNumber += count;
+}
+
+xMegaTexture::Cluster * xMegaTexture::AllocCluster()
+{
+  if(!freeClusters)
+  {
+    // pinned clusters may exceed the budget
+    ReserveRecords(RECORD_SLAB_GROW);
+  }
+  Cluster * cluster = freeClusters;
+  freeClusters = cluster->next;
+  freeClustersNumber--;
+  cluster->next = NULL;
+  return cluster;
+}
+
+void xMegaTexture::FreeCluster(Cluster * cluster)
+{
+  ASSERT(!cluster->lruNode.InList() && freeClustersNumber < recordsNumber);
+  // the image belongs to the image pool, DeleteCluster returns it
+  if(cluster->request)
+  {
+    // the request owns the buffer now, it's freed when the request is completed
+    cluster->request->cluster = NULL;
+  }
+  cluster->Reset();
+  cluster->next = freeClusters;
+  freeClusters = cluster;
+  freeClustersNumber++;
+}
+
+xMegaTexture::StreamRequest * xMegaTexture::AllocRequest()
+{
+  if(!freeRequests)
+  {
+    // detached requests keep loading while their clusters have new ones
+    ReserveRecords(RECORD_SLAB_GROW);
+  }
+  StreamRequest * request = freeRequests;
+  freeRequests = request->next;
+  freeRequestsNumber--;
+  MEMSET(request, 0, sizeof(*request));
+  return request;
+}
+
+void xMegaTexture::FreeRequest(StreamRequest * request)
+{
+  ASSERT(freeRequestsNumber < recordsNumber);
+  request->next = freeRequests;
+  freeRequests = request;
+  freeRequestsNumber++;
+}
+
+// =================================================================
+
+double xMegaTexture::StatsTime()
+{
+  static LARGE_INTEGER freq = { 0 };
+  if(!freq.QuadPart)
+  {
+    QueryPerformanceFrequency(&freq);
+  }
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)freq.QuadPart;
+}
+
+void xMegaTexture::AddResidentTime(double seconds)
+{
+  int ms = (int)(seconds * 1000.0);
+  int bucket = 0;
+  for(; ms > 0 && bucket < STATS_HISTOGRAM_SIZE - 1; ms >>= 1)
+  {
+    bucket++;
+  }
+  frameStats.residentHistogram[bucket]++;
+}
+
+void xMegaTexture::FinishStatsFrame()
+{
+  streamMutex.Lock();
+  frameStats.queueDepth = pendingHeap.Count();
+  streamMutex.Unlock();
+  frameStats.maxQueueDepth = Max(frameStats.maxQueueDepth, frameStats.queueDepth);
+
+  int i;
+  for(i = 0; i < STATS_MIPS; i++)
+  {
+    MipStats& total = totalStats.mips[i];
+    const MipStats& frame = frameStats.mips[i];
+    total.requests += frame.requests;
+    total.hits += frame.hits;
+    total.loads += frame.loads;
+    total.evictions += frame.evictions;
+    total.cancels += frame.cancels;
+  }
+  for(i = 0; i < STATS_HISTOGRAM_SIZE; i++)
+  {
+    totalStats.residentHistogram[i] += frameStats.residentHistogram[i];
+  }
+  totalStats.frame = frameStats.frame;
+  totalStats.bytesRead += frameStats.bytesRead;
+  totalStats.loadTime += frameStats.loadTime;
+  totalStats.decodeTime += frameStats.decodeTime;
+  totalStats.convertTime += frameStats.convertTime;
+  totalStats.textureTime += frameStats.textureTime;
+  totalStats.queueDepth = frameStats.queueDepth;
+  totalStats.maxQueueDepth = Max(totalStats.maxQueueDepth, frameStats.maxQueueDepth);
+
+  // the history is allocated once, then the oldest frame is overwritten
+  if(!statsHistory.Count())
+  {
+    statsHistory.SetCount(STATS_HISTORY_SIZE);
+  }
+  statsHistory[statsFrames % STATS_HISTORY_SIZE] = frameStats;
+  statsFrames++;
+
+  int frame = frameStats.frame;
+  MEMSET(&frameStats, 0, sizeof(frameStats));
+  frameStats.frame = frame + 1;
+}
+
+const xMegaTexture::StreamStats& xMegaTexture::FrameStats() const
+{
+  return statsFrames > 0 ? statsHistory[(statsFrames - 1) % STATS_HISTORY_SIZE] : frameStats;
+}
+
+void xMegaTexture::ResetStats()
+{
+  MEMSET(&frameStats, 0, sizeof(frameStats));
+  MEMSET(&totalStats, 0, sizeof(totalStats));
+  statsFrames = 0;
+}
+
+void xMegaTexture::WriteStatsCSV(FILE * f, const StreamStats& stats, int mipsNumber)
+{
+  fprintf(f, "%d,%d,%d,%I64u,%.3f,%.3f,%.3f,%.3f", stats.frame, stats.queueDepth, stats.maxQueueDepth,
+    stats.bytesRead, stats.loadTime * 1000.0, stats.decodeTime * 1000.0,
+    stats.convertTime * 1000.0, stats.textureTime * 1000.0);
+  int i;
+  for(i = 0; i < mipsNumber; i++)
+  {
+    const MipStats& mip = stats.mips[i];
+    fprintf(f, ",%d,%d,%d,%d,%d", mip.requests, mip.hits, mip.loads, mip.evictions, mip.cancels);
+  }
+  for(i = 0; i < STATS_HISTOGRAM_SIZE; i++)
+  {
+    fprintf(f, ",%d", stats.residentHistogram[i]);
+  }
+  fprintf(f, "\n");
+}
+
+void xMegaTexture::WriteStatsJSON(FILE * f, const StreamStats& stats, int mipsNumber)
+{
+  fprintf(f, "{\"frame\": %d, \"queueDepth\": %d, \"maxQueueDepth\": %d, \"bytesRead\": %I64u, "
+    "\"loadMs\": %.3f, \"decodeMs\": %.3f, \"convertMs\": %.3f, \"textureMs\": %.3f, \"mips\": [",
+    stats.frame, stats.queueDepth, stats.maxQueueDepth, stats.bytesRead, stats.loadTime * 1000.0,
+    stats.decodeTime * 1000.0, stats.convertTime * 1000.0, stats.textureTime * 1000.0);
+  int i;
+  for(i = 0; i < mipsNumber; i++)
+  {
+    const MipStats& mip = stats.mips[i];
+    fprintf(f, "%s{\"requests\": %d, \"hits\": %d, \"loads\": %d, \"evictions\": %d, \"cancels\": %d}",
+      i ? ", " : "", mip.requests, mip.hits, mip.loads, mip.evictions, mip.cancels);
+  }
+  fprintf(f, "], \"residentHistogram\": [");
+  for(i = 0; i < STATS_HISTOGRAM_SIZE; i++)
+  {
+    fprintf(f, "%s%d", i ? ", " : "", stats.residentHistogram[i]);
+  }
+  fprintf(f, "]}");
+}
+
+bool xMegaTexture::DumpStats(const xString& filename, int format) const
+{
+  FILE * f = NULL;
+  _tfopen_s(&f, filename, _T("wt"));
+  if(!f)
+    return false;
+
+  int mipsNumber = Min(Max(archiveMips.Count(), layersNumber), (int)STATS_MIPS);
+  int first = Max(statsFrames - STATS_HISTORY_SIZE, 0);
+  int i;
+  if(format == STATS_JSON)
+  {
+    fprintf(f, "{\n\"total\": ");
+    WriteStatsJSON(f, totalStats, mipsNumber);
+    fprintf(f, ",\n\"frames\": [\n");
+    for(i = first; i < statsFrames; i++)
+    {
+      WriteStatsJSON(f, statsHistory[i % STATS_HISTORY_SIZE], mipsNumber);
+      fprintf(f, i + 1 < statsFrames ? ",\n" : "\n");
+    }
+    fprintf(f, "]\n}\n");
+  }
+  else
+  {
+    fprintf(f, "frame,queue_depth,max_queue_depth,bytes_read,load_ms,decode_ms,convert_ms,texture_ms");
+    for(i = 0; i < mipsNumber; i++)
+    {
+      fprintf(f, ",mip%d_requests,mip%d_hits,mip%d_loads,mip%d_evictions,mip%d_cancels", i, i, i, i, i);
+    }
+    for(i = 0; i < STATS_HISTOGRAM_SIZE; i++)
+    {
+      fprintf(f, ",resident_%d", i);
+    }
+    fprintf(f, "\n");
+    for(i = first; i < statsFrames; i++)
+    {
+      WriteStatsCSV(f, statsHistory[i % STATS_HISTORY_SIZE], mipsNumber);
+    }
+    // the totals row has no frame number
+    StreamStats total = totalStats;
+    total.frame = -1;
+    WriteStatsCSV(f, total, mipsNumber);
+  }
+
+  fclose(f);
+  return true;
+}
+
+// =================================================================
+// =================================================================
+// =================================================================
+
+bool xMegaTexture::InitPages(int poolSize)
+{
+  ClearPages();
+  // page table entries keep the pool position in a byte
+  if(!IsArchive() || poolSize <= 0 || poolSize > 256)
+  {
+    return false;
+  }
+  int coarsest = archiveMips.Count() - 1;
+  const MipHeader& coarsestMip = archiveMips[coarsest];
+  if(poolSize * poolSize < coarsestMip.width * coarsestMip.height + 1)
+  {
+    return false;
+  }
+
+  pagePoolSize = poolSize;
+  pagesNumber = poolSize * poolSize;
+  pages = new Page[pagesNumber];
+  pageTable.SetCount(archiveHeader.clustersNumber);
+  pageStamps.SetCount(archiveHeader.clustersNumber);
+  for(int i = 0; i < archiveHeader.clustersNumber; i++)
+  {
+    pageTable[i] = -1;
+    pageStamps[i] = 0;
+  }
+  pageStamp = 0;
+  // every cluster is missing once at most, so the lists of UpdatePages never grow
+  missingPages.SetCount(archiveHeader.clustersNumber, true);
+  missingPages.SetCount(0, false);
+  dirtyPages.SetCount(pagesNumber, true);
+  dirtyPages.SetCount(0, false);
+
+  int i;
+  for(i = 0; i < pagesNumber; i++)
+  {
+    pages[i].lruNode.InsertBefore(pageLRU);
+  }
+  // the coarsest mip is the last resort of the page table, so it's always resident
+  for(int y = 0; y < coarsestMip.height; y++)
+  {
+    for(int x = 0; x < coarsestMip.width; x++)
+    {
+      Page * page = pageLRU.Prev();
+      LoadPage(page, coarsest, x, y);
+      page->isLocked = true;
+      page->lruNode.Remove();
+    }
+  }
+  for(i = 0; i < pagesNumber; i++)
+  {
+    if(pages[i].mip >= 0 && pages[i].cluster->isReady)
+    {
+      dirtyPages.Append(i);
+    }
+  }
+  return true;
+}
+
+void xMegaTexture::ClearPages()
+{
+  if(!pages)
+  {
+    return;
+  }
+  for(int i = 0; i < pagesNumber; i++)
+  {
+    if(pages[i].mip >= 0)
+    {
+      pages[i].isLocked = false;
+      FreePage(pages + i);
+    }
+  }
+  pageLRU.Clear();
+  delete [] pages;
+  pages = NULL;
+  pagePoolSize = 0;
+  pagesNumber = 0;
+  pageTable.Clear();
+  pageStamps.Clear();
+  dirtyPages.SetCount(0, false);
+}
+
+int xMegaTexture::PageTableIndex(int mip, int x, int y) const
+{
+  const MipHeader& mipHeader = archiveMips[mip];
+  return mipHeader.firstCluster + y * mipHeader.width + x;
+}
+
+void xMegaTexture::LoadPage(Page * page, int mip, int x, int y)
+{
+  if(page->mip >= 0)
+  {
+    FreePage(page);
+  }
+  page->mip = mip;
+  page->x = x;
+  page->y = y;
+  page->cluster = AcquireCluster(mip, x, y, true);
+  page->stamp = pageStamp;
+  page->isUploaded = false;
+  pageTable[PageTableIndex(mip, x, y)] = (int)(page - pages);
+  page->lruNode.InsertAfter(pageLRU);
+}
+
+void xMegaTexture::FreePage(Page * page)
+{
+  ASSERT(page->mip >= 0 && !page->isLocked);
+  // the cluster stays in the cache until the budget runs out
+  pageTable[PageTableIndex(page->mip, page->x, page->y)] = -1;
+  ReleaseCluster(page->cluster);
+  page->cluster = NULL;
+  page->mip = -1;
+  page->isUploaded = false;
+}
+
+int xMegaTexture::CompareFeedbackTiles(const FeedbackTile * a, const FeedbackTile * b)
+{
+  // coarser tiles are fallbacks for finer ones
+  return b->mip - a->mip;
+}
+
+int xMegaTexture::UpdatePages(const FeedbackTile * tiles, int count)
+{
+  ASSERT(IsPaged());
+  ProcessStreaming();
+
+  // resident tiles and their parents are touched, missing ones are collected once
+  pageStamp++;
+  int mipsNumber = archiveMips.Count();
+  xArray<FeedbackTile>& missing = missingPages;
+  missing.SetCount(0, false);
+  for(int i = 0; i < count; i++)
+  {
+    const FeedbackTile& tile = tiles[i];
+    if(tile.mip < 0 || tile.mip >= mipsNumber)
+    {
+      continue;
+    }
+    for(int mip = tile.mip; mip < mipsNumber; mip++)
+    {
+      int k = mip - tile.mip;
+      int x = tile.x >> k, y = tile.y >> k;
+      const MipHeader& mipHeader = archiveMips[mip];
+      if(x < 0 || y < 0 || x >= mipHeader.width || y >= mipHeader.height)
+      {
+        break;
+      }
+      int index = PageTableIndex(mip, x, y);
+      if(pageStamps[index] == pageStamp)
+      {
+        break; // the parents are done too
+      }
+      pageStamps[index] = pageStamp;
+      int pageNum = pageTable[index];
+      if(pageNum >= 0)
+      {
+        Page * page = pages + pageNum;
+        page->stamp = pageStamp;
+        if(!page->isLocked)
+        {
+          page->lruNode.InsertAfter(pageLRU);
+        }
+        continue;
+      }
+      FeedbackTile& item = missing.Alloc();
+      item.mip = mip;
+      item.x = x;
+      item.y = y;
+    }
+  }
+  missing.Sort(CompareFeedbackTiles);
+
+  // pages requested by this pass are never evicted by it, the pool stops loading
+  cacheStamp++;
+  int loadsNumber = Min(missing.Count(), pageLoadLimit);
+  for(int i = 0; i < loadsNumber; i++)
+  {
+    Page * page = pageLRU.Prev();
+    if(!page || page->stamp == pageStamp)
+    {
+      break;
+    }
+    LoadPage(page, missing[i].mip, missing[i].x, missing[i].y);
+  }
+  TrimCache(cacheBudget);
+
+  dirtyPages.SetCount(0, false);
+  for(int i = 0; i < pagesNumber; i++)
+  {
+    const Page& page = pages[i];
+    if(page.mip >= 0 && !page.isUploaded && page.cluster->isReady)
+    {
+      dirtyPages.Append(i);
+    }
+  }
+  return dirtyPages.Count();
+}
+
+void xMegaTexture::DirtyPagePos(int i, int& x, int& y) const
+{
+  int pageNum = dirtyPages[i];
+  x = pageNum % pagePoolSize;
+  y = pageNum / pagePoolSize;
+}
+
+void xMegaTexture::GetDirtyPage(int i, byte * dst, int pitch, int pixelBits, int plane)
+{
+  ASSERT(IsPixelBitsValid(pixelBits, plane));
+  Page * page = pages + dirtyPages[i];
+  ASSERT(page->mip >= 0 && page->cluster->isReady);
+  xStatsTimer timer(frameStats.textureTime);
+  CopyCluster(page->mip, page->cluster, dst, pitch, pixelBits, true, plane);
+  page->isUploaded = true;
+}
+
+void xMegaTexture::GetPageTable(int mip, byte * dst, int pitch)
+{
+  ASSERT(IsPaged() && mip >= 0 && mip < archiveMips.Count());
+  const MipHeader& mipHeader = archiveMips[mip];
+  for(int y = 0; y < mipHeader.height; y++, dst += pitch)
+  {
+    dword * entry = (dword*)dst;
+    for(int x = 0; x < mipHeader.width; x++)
+    {
+      entry[x] = 0;
+      for(int k = 0; mip + k < archiveMips.Count(); k++)
+      {
+        int pageNum = pageTable[PageTableIndex(mip + k, x >> k, y >> k)];
+        if(pageNum >= 0 && pages[pageNum].isUploaded)
+        {
+          entry[x] = (dword)(pageNum % pagePoolSize) | ((dword)(pageNum / pagePoolSize) << 8)
+            | ((dword)(mip + k) << 16) | 0xff000000;
+          break;
+        }
+      }
+    }
+  }
+}
+
+// =================================================================
+// =================================================================
+// =================================================================
+
+void xMegaTexture::StreamThreadProc(void * params)
+{
+  StreamWorker * worker = (StreamWorker*)params;
+  worker->texture->StreamThread(worker->scratch);
+}
+
+void xMegaTexture::StreamThread(byte * scratch)
+{
+  // reads through one handle are serialized by the system, so every thread opens its own one
+  HANDLE f = INVALID_HANDLE_VALUE;
+  if(!IsMapped())
+  {
+    f = CreateFile(archiveFilename.ToChar(), GENERIC_READ, FILE_SHARE_READ, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+  }
+  for(;;)
+  {
+    streamSemaphore.Wait();
+    if(streamStop)
+    {
+      break;
+    }
+
+    streamMutex.Lock();
+    StreamRequest * request = PopRequest();
+    streamMutex.Unlock();
+    if(!request)
+    {
+      continue;
+    }
+
+    double start = StatsTime();
+    if(request->isMapped)
+    {
+      // touch the pages so GetTexture doesn't stall on page faults
+      volatile dword sum = 0;
+      for(uint32 i = 0; i < request->size; i += 4096)
+      {
+        sum += request->buf[i];
+      }
+      request->isLoaded = true;
+    }
+    else if(request->codec == xClusterCodec::CODEC_RAW)
+    {
+      request->isLoaded = f != INVALID_HANDLE_VALUE
+        && ReadArchive(f, request->offset, request->buf, request->size);
+    }
+    else
+    {
+      // the view is only read, the decoded cluster has its own buffer
+      const byte * data = IsMapped() ? archiveView + request->offset : NULL;
+      if(!data && f != INVALID_HANDLE_VALUE && ReadArchive(f, request->offset, scratch, request->size))
+      {
+        data = scratch;
+      }
+      double decodeStart = StatsTime();
+      request->isLoaded = data && DecodeCluster(request->buf, data, request->size, request->codec);
+      request->decodeTime = StatsTime() - decodeStart;
+    }
+    request->loadTime = StatsTime() - start;
+
+    streamMutex.Lock();
+    request->next = completedFirst;
+    completedFirst = request;
+    streamMutex.Unlock();
+  }
+  if(f != INVALID_HANDLE_VALUE)
+  {
+    CloseHandle(f);
+  }
+}
+
+bool xMegaTexture::StartStreaming(int threadsNumber)
+{
+  ASSERT(!IsStreaming() && IsArchive());
+  if(threadsNumber <= 0)
+  {
+    threadsNumber = Max(1, xThread::ProcessorsNumber() - 1);
+  }
+  fallbackCluster = new byte[ClusterBytes()];
+  // Prefetch collects every cluster once at most, so its lists never grow
+  prefetchItems.SetCount(archiveHeader.clustersNumber, true);
+  prefetchItems.SetCount(0, false);
+  prefetchStamps.SetCount(archiveHeader.clustersNumber, true);
+  MEMSET(prefetchStamps.Ptr(), 0, sizeof(int) * prefetchStamps.Count());
+  prefetchStamp = 0;
+  streamStop = false;
+  streamThreads = new xThread[threadsNumber];
+  streamWorkers = new StreamWorker[threadsNumber];
+  // coded clusters of a mapped archive are decoded from the view
+  streamScratch = IsMapped() ? NULL : new byte[ClusterBytes() * threadsNumber];
+  for(int i = 0; i < threadsNumber; i++)
+  {
+    streamWorkers[i].texture = this;
+    streamWorkers[i].scratch = streamScratch ? streamScratch + ClusterBytes() * i : NULL;
+  }
+  for(int i = 0; i < threadsNumber; i++)
+  {
+    if(!streamThreads[i].Start(StreamThreadProc, streamWorkers + i))
+    {
+      break;
+    }
+    streamThreadsNumber++;
+  }
+  if(!streamThreadsNumber)
+  {
+    StopStreaming();
+    return false;
+  }
+  return true;
+}
+
+void xMegaTexture::StopStreaming()
+{
+  if(streamThreads)
+  {
+    streamStop = true;
+    streamSemaphore.Release(streamThreadsNumber);
+    delete [] streamThreads; // waits for the threads
+    streamThreads = NULL;
+    streamThreadsNumber = 0;
+  }
+  delete [] streamWorkers;
+  streamWorkers = NULL;
+  delete [] streamScratch;
+  streamScratch = NULL;
+
+  ProcessStreaming();
+  while(pendingHeap.Count())
+  {
+    CompleteRequest(PopRequest());
+  }
+  pendingHeap.Clear();
+
+  delete [] fallbackCluster;
+  fallbackCluster = NULL;
+}
+
+void xMegaTexture::ProcessStreaming()
+{
+  streamMutex.Lock();
+  StreamRequest * request = completedFirst;
+  completedFirst = NULL;
+  streamMutex.Unlock();
+
+  while(request)
+  {
+    StreamRequest * next = request->next;
+    CompleteRequest(request);
+    request = next;
+  }
+}
+
+void xMegaTexture::CompleteRequest(StreamRequest * request)
+{
+  frameStats.loadTime += request->loadTime;
+  frameStats.decodeTime += request->decodeTime;
+  if(request->isLoaded)
+  {
+    cacheStats.loads++;
+    cacheStats.bytesRead += request->size;
+    FrameMipStats(request->mip).loads++;
+    frameStats.bytesRead += request->size;
+    AddResidentTime(StatsTime() - request->issueTime);
+  }
+  Cluster * cluster = request->cluster;
+  if(cluster)
+  {
+    ASSERT(cluster->request == request);
+    cluster->request = NULL;
+    cluster->isReady = true;
+    if(!request->isLoaded)
+    {
+      if(request->isMapped)
+      {
+        cluster->image = errorCluster;
+      }
+      else
+      {
+        FillErrorCluster(cluster->image);
+      }
+    }
+    // clusters pinned by pages may be out of the layer windows
+    if(cluster->pinsNumber && request->mip < layersNumber && layers[request->mip].Contains(cluster->x, cluster->y))
+    {
+      AddDirtyRect(layers + request->mip, cluster->x, cluster->y, 1, 1);
+    }
+  }
+  else if(!request->isMapped)
+  {
+    FreeImage(request->buf);
+  }
+  FreeRequest(request);
+}
+
+void xMegaTexture::DetachRequest(Cluster * cluster)
+{
+  StreamRequest * request = cluster->request;
+  if(!request)
   {
-    fclose(f);
-    return false;
+    return;
   }
-  // Skip the ID field. The first byte of the header is the length of this field
-  if(tgaHeader.idLength)
+  if(CancelRequest(request))
   {
-    fseek(f, tgaHeader.idLength, SEEK_CUR);
+    // nothing has been read yet, the cluster keeps its buffer
+    cluster->request = NULL;
+    cacheStats.cancels++;
+    FrameMipStats(request->mip).cancels++;
+    FreeRequest(request);
+    return;
   }
+  // the buffer is still being written, it goes away together with the request
+  request->cluster = NULL;
+  cluster->request = NULL;
+  cluster->image = NULL;
+  cluster->isMapped = false;
+}
 
-  ASSERT(xMath::IsPowerOfTwo(tgaHeader.width));
-  ASSERT(xMath::IsPowerOfTwo(tgaHeader.height));
-  // ASSERT(tgaHeader.width == tgaHeader.height);
+// =================================================================
 
-  int width  = tgaHeader.width;
-  int height = tgaHeader.height;
-  byte * image = new byte[width * height * 3];
-  if(!image)
+float xMegaTexture::RequestPriority(const StreamRequest * request) const
+{
+  // the distance to the cluster square, so the cluster under the viewer is the nearest one
+  float size = (float)(1 << request->mip);
+  float dx = Max(0.0f, Max(request->x * size - viewerPos.x, viewerPos.x - (request->x + 1) * size));
+  float dy = Max(0.0f, Max(request->y * size - viewerPos.y, viewerPos.y - (request->y + 1) * size));
+  float error = size / (xMath::Sqrt(dx*dx + dy*dy) + 1.0f);
+  // prefetched clusters wait for the ones needed right now
+  return error / (1.0f + Max(0.0f, request->deadline - viewerTime));
+}
+
+bool xMegaTexture::IsStaleRequest(const StreamRequest * request) const
+{
+  const Cluster * cluster = request->cluster;
+  return !cluster || (!cluster->pinsNumber && request->deadline <= viewerTime);
+}
+
+bool xMegaTexture::IsRequestBefore(const StreamRequest * a, const StreamRequest * b)
+{
+  // finer mips fall back to coarser ones, so the coarser are always loaded first
+  if(a->mip != b->mip)
   {
-    fclose(f);
-    return false;
+    return a->mip > b->mip;
   }
-  byte * line = NULL;
-  if(tgaHeader.pixelBitCount == 32)
+  return a->priority > b->priority;
+}
+
+void xMegaTexture::SwapRequests(int i, int j)
+{
+  StreamRequest * request = pendingHeap[i];
+  pendingHeap[i] = pendingHeap[j];
+  pendingHeap[j] = request;
+  pendingHeap[i]->heapIndex = i;
+  pendingHeap[j]->heapIndex = j;
+}
+
+void xMegaTexture::SiftRequestUp(int i)
+{
+  while(i > 0)
   {
-    line = new byte[width * 4];
-    if(!line)
+    int parent = (i - 1) / 2;
+    if(!IsRequestBefore(pendingHeap[i], pendingHeap[parent]))
     {
-      delete [] image;
-      fclose(f);
-      return false;
+      break;
     }
+    SwapRequests(i, parent);
+    i = parent;
   }
+}
 
-  int x, y;
-  for(y = 0; y < height; y++)
+void xMegaTexture::SiftRequestDown(int i)
+{
+  int count = pendingHeap.Count();
+  for(;;)
   {
-    int offs;
-    if(!(tgaHeader.imageDescriptor & 0x0010))
-    {
-      offs = (height-y-1) * width;
-    }
-    else
+    int best = i * 2 + 1;
+    if(best >= count)
     {
-      offs = y * width;
+      break;
     }
-    if(line)
+    if(best + 1 < count && IsRequestBefore(pendingHeap[best + 1], pendingHeap[best]))
     {
-      if(fread(line, sizeof(byte)*4*width, 1, f) != 1)
-      {
-        delete [] line;
-        delete [] image;
-        fclose(f);
-        return false;
-      }
-      byte * dst = image + offs * 3;
-      for(x = 0; x < width; x++, dst += 3)
-      {
-        dword color[] =
-        {
-          line[x*4 + 0],
-          line[x*4 + 1],
-          line[x*4 + 2],
-          line[x*4 + 3]
-        };
-        dst[0] = (color[0] * color[3]) / 0xff;
-        dst[1] = (color[1] * color[3]) / 0xff;
-        dst[2] = (color[2] * color[3]) / 0xff;
-      }
+      best++;
     }
-    else
+    if(!IsRequestBefore(pendingHeap[best], pendingHeap[i]))
     {
-      if(fread(image + offs * 3, sizeof(byte)*3*width, 1, f) != 1)
-      {
-        delete [] line;
-        delete [] image;
-        fclose(f);
-        return false;
-      }
+      break;
     }
+    SwapRequests(i, best);
+    i = best;
   }
-  fclose(f);
-  delete [] line;
+}
 
-  MEMSET(&tgaHeader, 0, sizeof(tgaHeader));
-  tgaHeader.imageType = 2;
-  tgaHeader.pixelBitCount = 24;
-  // tgaHeader.imageDescriptor = 0x0010;
-  tgaHeader.width = clusterSize;
-  tgaHeader.height = clusterSize;
+void xMegaTexture::PushRequest(StreamRequest * request)
+{
+  // called by the main thread only, so the heap grows there
+  request->heapIndex = pendingHeap.Append(request);
+  SiftRequestUp(request->heapIndex);
+  frameStats.maxQueueDepth = Max(frameStats.maxQueueDepth, pendingHeap.Count());
+}
 
-  /*
-  Header mageHeader;
-  mageHeader.id = ID;
-  mageHeader.fullWidth = width;
-  mageHeader.fullHeight = height;
-  mageHeader.clusterWidth = size;
-  mageHeader.clusterHeight = size;
-  mageHeader.flags = 0;
-  */
+xMegaTexture::StreamRequest * xMegaTexture::PopRequest()
+{
+  if(!pendingHeap.Count())
+  {
+    return NULL;
+  }
+  StreamRequest * request = pendingHeap[0];
+  RemoveRequest(request);
+  return request;
+}
 
-  for(int mipmap = 0;; mipmap++)
+void xMegaTexture::RemoveRequest(StreamRequest * request)
+{
+  int i = request->heapIndex;
+  ASSERT(i >= 0 && pendingHeap[i] == request);
+  int last = pendingHeap.Count() - 1;
+  if(i != last)
   {
-    for(y = 0; y < height; y += clusterSize)
-    {
-      for(x = 0; x < width; x += clusterSize)
-      {
-        xString filename = xString::Format(_T("%s-%d-%d-%dx%d.tga"), dstPrefix, 
-          mipmap, clusterSize, x/clusterSize, y/clusterSize);
+    SwapRequests(i, last);
+  }
+  // stream threads use the heap too, so it's never reallocated by them
+  pendingHeap.SetCount(last, false);
+  request->heapIndex = -1;
+  if(i != last)
+  {
+    SiftRequestUp(i);
+    SiftRequestDown(pendingHeap[i]->heapIndex);
+  }
+}
 
-        err = _tfopen_s(&f, filename.ToChar(), _T("wb"));
-        if(err != 0)
-        {
-          delete [] image;
-          return false;
-        }
+bool xMegaTexture::CancelRequest(StreamRequest * request)
+{
+  // false if a thread is reading the cluster already
+  streamMutex.Lock();
+  bool isPending = request->heapIndex >= 0;
+  if(isPending)
+  {
+    RemoveRequest(request);
+  }
+  streamMutex.Unlock();
+  return isPending;
+}
 
-        if(fwrite(&tgaHeader, sizeof(tgaHeader), 1, f) != 1)
-        {
-          fclose(f);
-          delete [] image;
-          return false;
-        }
+void xMegaTexture::DropRequest(StreamRequest * request)
+{
+  ASSERT(request->heapIndex < 0);
+  Cluster * cluster = request->cluster;
+  if(cluster)
+  {
+    // the cluster has no data and nobody fills it, so it leaves the cache
+    ASSERT(cluster->request == request && !cluster->pinsNumber);
+    cluster->request = NULL;
+    EvictCluster(cluster);
+    DeleteCluster(cluster);
+  }
+  else if(!request->isMapped)
+  {
+    FreeImage(request->buf);
+  }
+  cacheStats.cancels++;
+  FrameMipStats(request->mip).cancels++;
+  FreeRequest(request);
+}
 
-        for(int ay = 0; ay < clusterSize; ay++)
-        {
-          byte * src = image + sizeof(byte)*3 * ((y+clusterSize-1-ay) * width + x);
-          if(fwrite(src, sizeof(byte)*3 * clusterSize, 1, f) != 1)
-          {
-            fclose(f);
-            delete [] image;
-            return false;
-          }
-        }
-        fclose(f);
-      }
-    }
-    int oldWidth = width;
-    int oldHeight = height;
-    byte * oldImage = image;
-    width /= 2; // Max(clusterSize, width / 2);
-    height /= 2; // Max(clusterSize, height / 2);
+void xMegaTexture::SetViewer(const xVec2& pos, float time)
+{
+  viewerPos = pos;
+  viewerTime = time;
+  if(!IsStreaming())
+  {
+    return;
+  }
+  ProcessStreaming();
 
-    if(width >= clusterSize) // || height > clusterSize)
+  // stale requests are taken out, the others are reordered for the new position
+  StreamRequest * stale = NULL;
+  streamMutex.Lock();
+  for(int i = pendingHeap.Count()-1; i >= 0; i--)
+  {
+    StreamRequest * request = pendingHeap[i];
+    if(IsStaleRequest(request))
     {
-      ASSERT(width == height);
-      /*
-      image = new byte[width * height * 3];
-      if(!image)
-      {
-        delete [] oldImage;
-        return false;
-      }
-      */
-
-      for(y = 0; y < height; y++)
+      int last = pendingHeap.Count() - 1;
+      if(i != last)
       {
-        for(x = 0; x < width; x++)
-        {
-          byte * dst = image + sizeof(byte)*3 * (y * height + x);
-          byte * src00 = oldImage + sizeof(byte)*3 * (y * 2 * oldHeight + x * 2);
-          byte * src01 = src00 + sizeof(byte)*3; // image + sizeof(byte)*3 * (y * oldHeight + x+1);
-          byte * src10 = src00 + sizeof(byte)*3 * oldHeight; // image + sizeof(byte)*3 * ((y+1) * oldHeight + x+1);
-          byte * src11 = src10 + sizeof(byte)*3; // image + sizeof(byte)*3 * ((y+1) * oldHeight + x);
-          for(int i = 0; i < 3; i++)
-          {
-            dst[i] = (src00[i] + src01[i] + src11[i] + src10[i]) / 4;
-          }
-        }
+        SwapRequests(i, last);
       }
-      // delete [] oldImage;
-    }
-    else
-    {
-      break;
+      pendingHeap.SetCount(last, false);
+      request->heapIndex = -1;
+      request->next = stale;
+      stale = request;
+      continue;
     }
+    request->priority = RequestPriority(request);
   }
-
-  delete [] image;
-
-  return false;
-}
-
-byte * xMegaTexture::FillErrorCluster(byte * buf)
-{
-  ASSERT(buf && (int)xHeap::Instance()->Size(buf) >= clusterSize * clusterSize * 3);
-  byte * dst = buf;
-  static byte colors[][3] = 
+  for(int i = pendingHeap.Count()/2 - 1; i >= 0; i--)
   {
-    {0xC8, 0x00, 0x00},
-    {0x30, 0x30, 0x30},
-  };
-  int colorSize = clusterSize / 8;
-  for(int y = 0; y < clusterSize; y++)
+    SiftRequestDown(i);
+  }
+  streamMutex.Unlock();
+
+  while(stale)
   {
-    for(int x = 0; x < clusterSize; x++, dst += 3)
-    { 
-      int i = (x/colorSize ^ y/colorSize) & 1;
-      dst[0] = colors[i][0];
-      dst[1] = colors[i][1];
-      dst[2] = colors[i][2];
-    }
+    StreamRequest * next = stale->next;
+    DropRequest(stale);
+    stale = next;
   }
-  return buf;
 }
 
-byte * xMegaTexture::LoadMip(byte * buf, int mip, int px, int py)
+byte * xMegaTexture::LoadMipTGA(byte * buf, int mip, int px, int py)
 {
-  if(!buf)
-  {
-    buf = new byte[clusterSize * clusterSize * 3];
-    ASSERT(buf);
-  }
   xString mipFilename = xString::Format(_T("%s-%d-%d-%dx%d.tga"), filename, mip, clusterSize, px, py);
 
   FILE * f;
@@ -289,13 +2815,13 @@ byte * xMegaTexture::LoadMip(byte * buf, int mip, int px, int py)
 
   int srcRowSize = sizeof(byte) * 3 * tgaHeader.width;
   int srcSize = srcRowSize * tgaHeader.height;
-  byte * src = new byte[srcSize];
-  ASSERT(src);
+  ASSERT((uint32)srcSize <= ClusterBytes());
+  byte * src = AllocImage();
 
   if(fread(src, srcSize, 1, f) != 1)
   {
     fclose(f);
-    delete [] src;
+    FreeImage(src);
     return FillErrorCluster(buf);
   }
   fclose(f);
@@ -316,96 +2842,288 @@ byte * xMegaTexture::LoadMip(byte * buf, int mip, int px, int py)
     srcRow += srcRowSize;
   }
 
-  delete [] src;
+  FreeImage(src);
 
   return buf;
 }
 
-void xMegaTexture::UpdateLayer(int layerNum, int x, int y, int width, int height)
+bool xMegaTexture::UpdateLayer(int layerNum, int x, int y, int width, int height)
 {
   ASSERT(layerNum >= 0 && layerNum < layersNumber);
+  ProcessStreaming();
+
   MipLayer * layer = layers + layerNum;
   if(layer->x == x && layer->y == y && layer->width == width && layer->height == height)
   {
-    return;
+    return layer->dirtyRects.Count() > 0;
   }
 
-  int oldSize = layer->width * layer->height;
-  Cluster ** oldClusters = layer->clusters;
+  int i, j;
+  cacheStamp++;
+  if(layer->clusters && layer->width == width && layer->height == height)
+  {
+    // the window is shifted, every entering cluster takes the slot of the leaving one
+    for(j = y; j < y + height; j++)
+    {
+      bool isOldRow = j >= layer->y && j < layer->y + height;
+      for(i = x; i < x + width; i++)
+      {
+        if(isOldRow && i >= layer->x && i < layer->x + width)
+        {
+          i = layer->x + width - 1; // the rest of the old row is kept
+          continue;
+        }
+        Cluster ** slot = layer->clusters + layer->Slot(i, j);
+        // clusters leaving the window stay in the cache until the budget runs out
+        ReleaseCluster(*slot);
+        *slot = AcquireCluster(layerNum, i, j, true);
+      }
+    }
+
+    int keptX0 = Max(x, layer->x), keptX1 = Min(x + width, layer->x + width);
+    int keptY0 = Max(y, layer->y), keptY1 = Min(y + height, layer->y + height);
+    layer->x = x;
+    layer->y = y;
+    if(keptX0 >= keptX1 || keptY0 >= keptY1)
+    {
+      InvalidateLayer(layerNum);
+    }
+    else
+    {
+      AddDirtyRect(layer, x, y, width, keptY0 - y);
+      AddDirtyRect(layer, x, keptY1, width, y + height - keptY1);
+      AddDirtyRect(layer, x, keptY0, keptX0 - x, keptY1 - keptY0);
+      AddDirtyRect(layer, keptX1, keptY0, x + width - keptX1, keptY1 - keptY0);
+    }
+  }
+  else
+  {
+    int oldSize = layer->width * layer->height;
+    for(i = 0; i < oldSize; i++)
+    {
+      ReleaseCluster(layer->clusters[i]);
+    }
+    delete [] layer->clusters;
 
-  int newSize = width * height;
-  layer->clusters = new Cluster*[newSize];
-  ASSERT(layer->clusters);
+    layer->clusters = new Cluster*[width * height];
+    ASSERT(layer->clusters);
 
-  layer->x = x;
-  layer->y = y;
-  layer->width = width;
-  layer->height = height;
+    layer->x = x;
+    layer->y = y;
+    layer->width = width;
+    layer->height = height;
 
-  int offs, i, j, k;
-  for(offs = j = 0; j < height; j++)
-  {
-    for(i = 0; i < width; i++, offs++)
+    for(j = y; j < y + height; j++)
     {
-      k = FindClusterNum(oldClusters, oldSize, x+i, y+j);
-      if(k >= 0)
+      for(i = x; i < x + width; i++)
       {
-        layer->clusters[offs] = oldClusters[k];
-        oldClusters[k] = NULL;
+        layer->clusters[layer->Slot(i, j)] = AcquireCluster(layerNum, i, j, true);
       }
     }
+    InvalidateLayer(layerNum);
+  }
+  TrimCache(cacheBudget);
+
+  return layer->dirtyRects.Count() > 0;
+}
+
+void xMegaTexture::AddDirtyRect(MipLayer * layer, int x, int y, int width, int height)
+{
+  if(width <= 0 || height <= 0)
+  {
+    return;
+  }
+  ASSERT(width <= layer->width && height <= layer->height);
+
+  // a rect crossing the buffer edges is split into up to four slot rects
+  int slotX = WrapCoord(x, layer->width);
+  int slotY = WrapCoord(y, layer->height);
+  int width1 = Min(width, layer->width - slotX);
+  int height1 = Min(height, layer->height - slotY);
+  AddDirtySlots(layer, slotX, slotY, width1, height1);
+  if(width1 < width)
+  {
+    AddDirtySlots(layer, 0, slotY, width - width1, height1);
+  }
+  if(height1 < height)
+  {
+    AddDirtySlots(layer, slotX, 0, width1, height - height1);
+    if(width1 < width)
+    {
+      AddDirtySlots(layer, 0, 0, width - width1, height - height1);
+    }
+  }
+}
+
+void xMegaTexture::AddDirtySlots(MipLayer * layer, int x, int y, int width, int height)
+{
+  int count = layer->dirtyRects.Count();
+  if(count > 0)
+  {
+    Rect& last = layer->dirtyRects[count-1];
+    if(last.width == layer->width && last.height == layer->height)
+    {
+      return; // the whole layer is dirty already
+    }
+    // streamed clusters usually arrive row by row
+    if(last.y == y && last.height == height && last.x + last.width == x)
+    {
+      last.width += width;
+      return;
+    }
+  }
+  if(count >= MAX_DIRTY_RECTS)
+  {
+    layer->dirtyRects.SetCount(0, false);
+    layer->dirtyRects.Append(Rect(0, 0, layer->width, layer->height));
+    return;
+  }
+  layer->dirtyRects.Append(Rect(x, y, width, height));
+}
+
+void xMegaTexture::InvalidateLayer(int layerNum)
+{
+  ASSERT(layerNum >= 0 && layerNum < layersNumber);
+  MipLayer * layer = layers + layerNum;
+  layer->dirtyRects.SetCount(0, false);
+  if(layer->width > 0 && layer->height > 0)
+  {
+    layer->dirtyRects.Append(Rect(0, 0, layer->width, layer->height));
+  }
+}
+
+int xMegaTexture::DstClusterOffset(int i, int j, int pitch, int pixelBits) const
+{
+  if(pixelBits == 4)
+  {
+    // a row of BC1 blocks covers 4 rows of pixels
+    return j * (clusterSize / 4) * pitch + i * (clusterSize / 4) * 8;
+  }
+  return j * clusterSize * pitch + i * clusterSize * pixelBits / 8;
+}
+
+bool xMegaTexture::IsPixelBitsValid(int pixelBits, int plane) const
+{
+  if(plane < 0 || plane >= planesNumber)
+  {
+    return false;
+  }
+  if(planes[plane].format == FORMAT_L8)
+  {
+    return pixelBits == 8 || pixelBits == 32;
   }
+  return pixelBits == 24 || pixelBits == 32 || pixelBits == 4;
+}
 
-  int fromIndex = oldSize - 1;
-  for(offs = j = 0; j < height; j++)
+void xMegaTexture::CopyCluster(int layerNum, const Cluster * cluster, byte * dst, int pitch, int pixelBits,
+  bool withBorder, int plane)
+{
+  ASSERT(IsPixelBitsValid(pixelBits, plane));
+  xStatsTimer timer(frameStats.convertTime);
+  const byte * src = cluster->isReady ? cluster->image : FallbackCluster(layerNum, cluster->x, cluster->y, plane);
+  src += planeOffsets[plane];
+  // the border is skipped unless the whole padded cluster is wanted
+  int size = withBorder ? PaddedClusterSize() : clusterSize;
+  int skip = withBorder ? 0 : clusterBorder;
+  int blocks = size / 4;
+  int format = planes[plane].format;
+  if(format == FORMAT_L8)
   {
-    for(i = 0; i < width; i++, offs++)
+    int srcPitch = PaddedClusterSize();
+    src += skip * (srcPitch + 1);
+    for(int row = 0; row < size; row++)
     {
-      if(!layer->clusters[offs])
+      if(pixelBits == 8)
       {
-        for(; fromIndex >= 0; fromIndex--)
-        {
-          if(oldClusters[fromIndex])
-            break;
-        }
-        if(fromIndex >= 0)
-        {
-          layer->clusters[offs] = oldClusters[fromIndex];
-          oldClusters[fromIndex--] = NULL;
-        }
-        else
+        MEMCPY(dst, src, size);
+      }
+      else
+      {
+        dword * dstRow = (dword*)dst;
+        for(int col = 0; col < size; col++)
         {
-          layer->clusters[offs] = new Cluster();
-          // layer->clusters[offs]->image = new byte[clusterSize * clusterSize * 3];
-          // ASSERT(layer->clusters[offs]->image);
+          dstRow[col] = 0xff000000 | (src[col] * 0x010101);
         }
-        layer->clusters[offs]->x = x+i;
-        layer->clusters[offs]->y = y+j;
-        layer->clusters[offs]->image = LoadMip(layer->clusters[offs]->image, layerNum, x+i, y+j);
       }
+      src += srcPitch;
+      dst += pitch;
     }
+    return;
   }
-
-  for(k = 0; k < oldSize; k++)
+  if(format == FORMAT_BC1)
+  {
+    int srcPitch = 8 * (PaddedClusterSize() / 4);
+    src += (skip / 4) * (srcPitch + 8);
+    if(pixelBits == 4)
+    {
+      for(int row = 0; row < blocks; row++)
+      {
+        MEMCPY(dst, src, 8 * blocks);
+        src += srcPitch;
+        dst += pitch;
+      }
+      return;
+    }
+    for(int row = 0; row < blocks; row++)
+    {
+      for(int col = 0; col < blocks; col++)
+      {
+        DecodeBC1Block(dst + col * pixelBits / 2, pitch, src + 8 * col, pixelBits / 8);
+      }
+      src += srcPitch;
+      dst += 4 * pitch;
+    }
+    return;
+  }
+  int srcPitch = sizeof(byte) * 3 * PaddedClusterSize();
+  src += skip * (srcPitch + sizeof(byte) * 3);
+  if(pixelBits == 4)
   {
-    delete oldClusters[k];
+    ASSERT((size % 4) == 0);
+    xSIMD::Processor->CompressBC1(dst, pitch, src, srcPitch, blocks, blocks);
+    return;
+  }
+  int rowSize = sizeof(byte) * 3 * size;
+  if(pixelBits == 24)
+  {
+    if(pitch == rowSize && srcPitch == rowSize)
+    {
+      MEMCPY(dst, src, rowSize * size);
+      return;
+    }
+    for(int row = 0; row < size; row++)
+    {
+      MEMCPY(dst, src, rowSize);
+      src += srcPitch;
+      dst += pitch;
+    }
+    return;
+  }
+  if(pitch == sizeof(byte) * 4 * size && srcPitch == rowSize)
+  {
+    xSIMD::Processor->ExpandBGR24(dst, src, size * size);
+    return;
+  }
+  for(int row = 0; row < size; row++)
+  {
+    xSIMD::Processor->ExpandBGR24(dst, src, size);
+    src += srcPitch;
+    dst += pitch;
   }
-  delete [] oldClusters;
 }
 
 void xMegaTexture::GetTexture(int layerNum, int x, int y, int width, int height, 
-  byte * dst, int pitch, int dstWidth, int dstHeight, int pixelBits)
+  byte * dst, int pitch, int dstWidth, int dstHeight, int pixelBits, int plane)
 {
-  ASSERT(pixelBits == 24 || pixelBits == 32);
+  ASSERT(IsPixelBitsValid(pixelBits, plane));
   ASSERT(dstWidth == width * clusterSize);
   ASSERT(dstHeight == height * clusterSize);
   ASSERT(layerNum >= 0 && layerNum < layersNumber);
+  xStatsTimer timer(frameStats.textureTime);
   
   MipLayer * layer = layers + layerNum;
   ASSERT(layer->x <= x && layer->y <= y && layer->width <= x + width && layer->height <= y + height);
 
-  int rowSize = sizeof(byte) * 3 * clusterSize;
-  int srcRowSize = sizeof(byte) * (pixelBits / 8) * clusterSize;
   for(int j = 0; j < height; j++)
   {
     for(int i = 0; i < width; i++)
@@ -414,56 +3132,133 @@ void xMegaTexture::GetTexture(int layerNum, int x, int y, int width, int height,
       // int offsY = y - layer->y + j;
       Cluster * cluster = layer->FindCluster(x + i, y + j);
       ASSERT(cluster);
+      CopyCluster(layerNum, cluster, dst + DstClusterOffset(i, j, pitch, pixelBits), pitch, pixelBits, false, plane);
+    }
+  }
+  if(layer->x == x && layer->y == y && layer->width == width && layer->height == height)
+  {
+    layer->dirtyRects.SetCount(0, false);
+  }
+}
 
-      byte * clusterDest = dst + (j * clusterSize * pitch + i * srcRowSize);
-      byte * src = cluster->image;
-      
-      if(pixelBits == 24)
-      {
-        for(int row = 0; row < clusterSize; row++)
-        {
-          MEMCPY(clusterDest, src, rowSize);
-          src += rowSize;
-          clusterDest += pitch;
-        }
-      }
-      else // do need convert src to 32 bits per pixel ?
-      {
-        for(int row = 0; row < clusterSize; row++)
-        {
-          byte * rowDest = clusterDest;
-          for(int col = 0; col < clusterSize; col++)
-          {
-            *rowDest++ = *src++;
-            *rowDest++ = *src++;
-            *rowDest++ = *src++;
-            *rowDest++ = 0xff;
-          }
-          clusterDest += pitch;
-        }
-      }
+void xMegaTexture::GetTextureRect(int layerNum, const Rect& rect, byte * dst, int pitch, int pixelBits, int plane)
+{
+  ASSERT(IsPixelBitsValid(pixelBits, plane));
+  ASSERT(layerNum >= 0 && layerNum < layersNumber);
+
+  xStatsTimer timer(frameStats.textureTime);
+  MipLayer * layer = layers + layerNum;
+  ASSERT(rect.x >= 0 && rect.y >= 0 && rect.x + rect.width <= layer->width && rect.y + rect.height <= layer->height);
+
+  for(int j = 0; j < rect.height; j++)
+  {
+    Cluster ** slots = layer->clusters + (rect.y + j) * layer->width + rect.x;
+    for(int i = 0; i < rect.width; i++)
+    {
+      ASSERT(slots[i]);
+      CopyCluster(layerNum, slots[i], dst + DstClusterOffset(i, j, pitch, pixelBits), pitch, pixelBits, false, plane);
     }
   }
 }
 
-xMegaTexture::xMegaTexture()
+void xMegaTexture::GetCluster(int layerNum, int x, int y, byte * dst, int pitch, int pixelBits, int plane)
+{
+  ASSERT(IsPixelBitsValid(pixelBits, plane));
+  ASSERT(layerNum >= 0 && layerNum < layersNumber);
+
+  xStatsTimer timer(frameStats.textureTime);
+  Cluster * cluster = layers[layerNum].FindCluster(x, y);
+  ASSERT(cluster);
+  CopyCluster(layerNum, cluster, dst, pitch, pixelBits, true, plane);
+}
+
+xMegaTexture::xMegaTexture(): cache(4096)
 {
   layers = NULL;
   layersNumber = 0;
   clusterSize = 0;
+  clusterFormat = FORMAT_BGR24;
+  clusterBorder = 0;
   layerSize = 0;
+  planesNumber = 1;
+  planes[0].format = FORMAT_BGR24;
+  planes[0].codec = xClusterCodec::CODEC_RAW;
+  MEMSET(planeOffsets, 0, sizeof(planeOffsets));
+  archiveFile = INVALID_HANDLE_VALUE;
+  archiveMapping = NULL;
+  archiveView = NULL;
+  archiveSize = 0;
+  errorCluster = NULL;
+  MEMSET(&archiveHeader, 0, sizeof(archiveHeader));
+  streamThreads = NULL;
+  streamWorkers = NULL;
+  streamScratch = NULL;
+  streamThreadsNumber = 0;
+  pendingHeap.SetGranularity(256);
+  completedFirst = NULL;
+  streamStop = false;
+  fallbackCluster = NULL;
+  viewerPos = xVec2(0, 0);
+  viewerTime = 0;
+  prefetchLimit = 64;
+  prefetchStamp = 0;
+  pages = NULL;
+  pagePoolSize = 0;
+  pagesNumber = 0;
+  pageStamp = 0;
+  pageLoadLimit = 32;
+  cacheBudget = 64 << 20;
+  cacheBytes = 0;
+  cacheStamp = 0;
+  MEMSET(&cacheStats, 0, sizeof(cacheStats));
+  MEMSET(&frameStats, 0, sizeof(frameStats));
+  MEMSET(&totalStats, 0, sizeof(totalStats));
+  statsFrames = 0;
+  freeImages = NULL;
+  imageStride = 0;
+  imagesNumber = 0;
+  freeImagesNumber = 0;
+  freeClusters = NULL;
+  freeRequests = NULL;
+  recordsNumber = 0;
+  freeClustersNumber = 0;
+  freeRequestsNumber = 0;
 }
 
 xMegaTexture::~xMegaTexture()
 {
+  ClearPages();
+  ClearCache();
+  StopStreaming();
+  FreeImagePool();
   delete [] layers;
+  CloseArchive();
 }
 
-void xMegaTexture::Init(const xString& p_filename, int p_layersNumber, int p_clusterSize, int p_layerSize)
+void xMegaTexture::Init(const xString& p_filename, int p_layersNumber, int p_clusterSize, int p_layerSize,
+  int flags, int threadsNumber)
 {
+  ClearPages();
+  ClearCache();
+  StopStreaming();
+
   filename = p_filename;
   clusterSize = p_clusterSize;
 
+  // clusters are read from the packed archive if there is one, otherwise from separate tga files
+  if(OpenArchive() && (flags & INIT_MAPPED))
+  {
+    MapArchive();
+  }
+  // the images of all the clusters are sized for the archive format
+  InitImagePool();
+
+  // the page table mode needs no layers, but it streams all the same
+  if(IsArchive() && (flags & INIT_ASYNC))
+  {
+    StartStreaming(threadsNumber);
+  }
+
   delete [] layers;
 
   if(!p_layersNumber)
@@ -14,23 +14,181 @@ public:
     ID = 0xabcdef01
   }; */
 
-  struct Cluster
+  enum
   {
-    int x, y;
-    byte * image;
+    INIT_MAPPED = 1 << 0, // map the archive and read clusters straight from the mapped pages
+    INIT_ASYNC  = 1 << 1  // stream clusters in background threads
+  };
+
+  enum
+  {
+    FORMAT_BGR24, // top-down rows of pixels
+    FORMAT_BC1,   // top-down rows of DXT1 blocks, 8 bytes per 4x4 pixels
+    FORMAT_L8     // top-down rows of single channel texels: roughness, heights
+  };
 
-    Cluster(){ x = y = 0; image = NULL; }
-    ~Cluster(){ delete [] image; }
+  enum
+  {
+    MAX_PLANES = 8
   };
 
-  static int FindClusterNum(Cluster ** clusters, int size, int x, int y)
+  enum
+  {
+    FILTER_BOX,     // 2x2 average for power of two sizes
+    FILTER_KAISER,  // windowed sinc, sharp and nearly ringing free
+    FILTER_LANCZOS  // 3-lobed Lanczos, the sharpest one
+  };
+
+  enum
+  {
+    STATS_MIPS = 16,           // deeper mips are counted in the last one
+    STATS_HISTOGRAM_SIZE = 16, // time to resident: < 1 ms, then [2^(i-1), 2^i) ms, the last one is open
+    STATS_HISTORY_SIZE = 256   // finished frames kept for DumpStats
+  };
+
+  enum
+  {
+    STATS_CSV,  // a row per frame of the history, the totals go last
+    STATS_JSON
+  };
+
+  // a plane of the clusters: albedo, normals, material parameters. all the planes of a cluster
+  // are stored in one payload, so they come with one read and take one cache entry
+  struct PlaneDesc
+  {
+    xString filename; // the source image of Make, all the planes are of the same size
+    int format;
+    int codec;        // BC1 and L8 planes fall back to CODEC_LZ instead of CODEC_DELTA
+    int tolerance;
+    bool isLinear;    // filtered as is, colors are filtered in linear space
+
+    PlaneDesc()
+    {
+      format = FORMAT_BGR24;
+      codec = xClusterCodec::CODEC_RAW;
+      tolerance = 0;
+      isLinear = false;
+    }
+  };
+
+  struct Cluster;
+
+  struct CacheStats
+  {
+    int hits, misses;  // cluster lookups made by UpdateLayer and Prefetch
+    int evictions;
+    int prefetches;    // clusters requested by Prefetch
+    int cancels;       // requests dropped before they have been read
+    int loads;         // clusters read from the archive
+    uint64 bytesRead;  // coded payload bytes of the loads
+    int clustersNumber;
+    uint32 bytes;      // resident cluster memory
+    uint32 budget;
+    uint32 poolBytes;  // slabs of the cluster images, free images included
+  };
+
+  struct MipStats
+  {
+    int requests;  // cluster lookups of UpdateLayer, Prefetch and UpdatePages
+    int hits;
+    int loads;
+    int evictions;
+    int cancels;
+  };
+
+  struct StreamStats
+  {
+    int frame;
+    MipStats mips[STATS_MIPS];
+    uint64 bytesRead;
+    double loadTime;    // seconds spent reading clusters, summed over the stream threads
+    double decodeTime;  // the part of loadTime spent in the codecs
+    double convertTime; // CopyCluster, conversions to the texture format included
+    double textureTime; // GetTexture, GetTextureRect, GetCluster and GetDirtyPage, convertTime included
+    int queueDepth;     // pending loads when the frame is finished
+    int maxQueueDepth;
+    int residentHistogram[STATS_HISTOGRAM_SIZE]; // loads by the time from the request to the data
+  };
+
+  struct StreamRequest
+  {
+    int mip, x, y;
+    uint64 offset;
+    uint32 size;
+    byte * buf;         // allocated and freed by the main thread only
+    Cluster * cluster;  // NULL if the cluster has been dropped while loading
+    bool isMapped;      // buf points to the archive view, pages are only touched
+    bool isLoaded;
+    int codec;          // the payload is decoded into buf by the stream thread
+    double issueTime;   // StatsTime of the request
+    double loadTime;    // written by the stream thread
+    double decodeTime;
+    float deadline;     // when the cluster is needed, in SetViewer time
+    float priority;     // screen space error weighted by the deadline, the bigger goes first
+    int heapIndex;      // position in the pending heap, -1 once a thread has taken the request
+    StreamRequest * next; // in the completed, stale or free list
+  };
+
+  struct Cluster
   {
-    for(int i = 0; i < size; i++)
+    int mip, x, y;
+    byte * image;
+    bool isMapped;     // image points to the archive view or to the shared error cluster
+    bool isReady;      // image is filled, false while the cluster is streaming
+    int pinsNumber;    // layer windows and pages holding the cluster, it can't be evicted while pinned
+    int stamp;         // cache pass the cluster has been used last
+    StreamRequest * request;
+    xLinkList<Cluster> lruNode; // in the cache LRU list while unpinned
+    Cluster * next;    // in the free list
+
+    Cluster()
     {
-      if(clusters[i] && clusters[i]->x == x && clusters[i]->y == y)
-        return i;
+      lruNode.SetOwner(this);
+      Reset();
     }
-    return -1;
+    void Reset()
+    {
+      mip = x = y = 0;
+      image = NULL;
+      isMapped = false;
+      isReady = false;
+      pinsNumber = 0;
+      stamp = 0;
+      request = NULL;
+      next = NULL;
+    }
+  };
+
+  struct ClusterKey
+  {
+    int mip, x, y;
+
+    ClusterKey(){}
+    ClusterKey(int p_mip, int p_x, int p_y){ mip = p_mip; x = p_x; y = p_y; }
+
+    int Cmp(const ClusterKey& b) const { return MEMCMP(this, &b, sizeof(b)); }
+    // spreads neighbouring clusters over the table, windows are dense rectangles
+    int Hash() const { return (x * 73856093) ^ (y * 19349663) ^ (mip * 83492791); }
+  };
+
+  struct Rect
+  {
+    int x, y, width, height; // in clusters
+
+    Rect(){}
+    Rect(int p_x, int p_y, int p_width, int p_height){ x = p_x; y = p_y; width = p_width; height = p_height; }
+  };
+
+  // a tile sampled by the last frame, collected by the feedback pass of the renderer
+  struct FeedbackTile
+  {
+    int mip, x, y; // in clusters of the mip
+  };
+
+  static int WrapCoord(int a, int size)
+  {
+    a %= size;
+    return a < 0 ? a + size : a;
   }
 
   struct MipLayer
@@ -39,7 +197,10 @@ public:
     // int mip;
     int x, y;
 
+    // toroidal storage, the cluster (x, y) lives in the slot (x mod width, y mod height)
+    // so a window shift only replaces the clusters which enter and leave it
     Cluster ** clusters;
+    xArray<Rect> dirtyRects; // in slots, the parts of the layer buffer changed since ClearDirtyRects
 
     MipLayer()
     {
@@ -50,18 +211,16 @@ public:
     }
     ~MipLayer()
     {
-      int size = width * height;
-      for(int i = 0; i < size; i++)
-      {
-        delete clusters[i];
-      }
+      // the clusters are owned by the cache
       delete [] clusters;
     }
 
-    Cluster * FindCluster(int x, int y)
+    int Slot(int px, int py) const { return WrapCoord(py, height) * width + WrapCoord(px, width); }
+    bool Contains(int px, int py) const { return px >= x && px < x + width && py >= y && py < y + height; }
+
+    Cluster * FindCluster(int px, int py) const
     {
-      int i = FindClusterNum(clusters, width * height, x, y);
-      return i >= 0 ? clusters[i] : NULL;
+      return Contains(px, py) ? clusters[Slot(px, py)] : NULL;
     }
   };
 
@@ -70,26 +229,390 @@ protected:
   /* enum
   {
     CLUSTER_ERROR_POS = -1000000
+  }; */
+
+  enum
+  {
+    ID = MAKEID('X', 'M', 'T', 'X'),
+    VERSION = 1,
+    VERSION_PLANES = 2,           // the header is followed by the plane table
+    HEADER_FORMAT_MASK = 0xff,    // the low byte of Header::flags is the cluster format, of the first plane
+    HEADER_BORDER_MASK = 0xff00,  // the next one is the cluster border
+    HEADER_BORDER_SHIFT = 8,
+    HEADER_PLANES_MASK = 0xff0000, // the next one is the number of planes of VERSION_PLANES archives
+    HEADER_PLANES_SHIFT = 16,
+    CLUSTER_CODEC_MASK = 0xff,    // the low byte of ClusterHeader::flags is the xClusterCodec of the payload
+    CLUSTER_CODEC_PLANES = 0xff   // the payload starts with the coded sizes of the planes, see DecodeCluster
   };
 
+#pragma pack(push,1)
+  // archive layout: Header, PlaneHeader[planesNumber] of VERSION_PLANES, MipHeader[mipsNumber],
+  // ClusterHeader[clustersNumber], cluster payloads
   struct Header
   {
     int id;
+    int version;
     int fullWidth;
     int fullHeight;
     int clusterSize;
+    int mipsNumber;
+    int clustersNumber;
     int flags;
-  }; */
+  };
+
+  struct MipHeader
+  {
+    int width, height; // in clusters
+    int firstCluster;  // index in the cluster table
+  };
+
+  struct PlaneHeader
+  {
+    int format;
+    int codec; // coded planes of CLUSTER_CODEC_PLANES payloads
+  };
+
+  struct ClusterHeader
+  {
+    uint64 offset; // absolute payload position in the archive
+    uint32 size;   // coded size, the decoded one is always ClusterBytes()
+    uint32 flags;
+  };
+#pragma pack(pop)
 
   MipLayer * layers;
   int layersNumber;
 
   xString filename;
   int clusterSize;
+  int clusterFormat; // of the first plane
+  int clusterBorder;
   int layerSize;
+
+  // the planes follow each other in the cluster image
+  int planesNumber;
+  PlaneHeader planes[MAX_PLANES];
+  uint32 planeOffsets[MAX_PLANES + 1]; // the last one is ClusterBytes()
+
+  void SetPlanes(const PlaneHeader * planes, int count);
+
+  xString archiveFilename;
+  HANDLE archiveFile;
+  HANDLE archiveMapping;
+  byte * archiveView;
+  uint64 archiveSize;
+  byte * errorCluster;
+  Header archiveHeader;
+  xArray<MipHeader> archiveMips;
+  xArray<ClusterHeader> archiveClusters;
+
+  struct StreamWorker
+  {
+    xMegaTexture * texture;
+    byte * scratch;     // coded payloads are read here, ClusterBytes() at most
+  };
+
+  xThread * streamThreads;
+  StreamWorker * streamWorkers;
+  byte * streamScratch;
+  int streamThreadsNumber;
+  xMutex streamMutex;
+  xSemaphore streamSemaphore;
+  xArray<StreamRequest*> pendingHeap; // coarser mips go first, then the bigger priority
+  StreamRequest * completedFirst;
+  volatile bool streamStop;
+  byte * fallbackCluster;
+  xVec2 viewerPos;  // in mip 0 clusters
+  float viewerTime;
+
+  struct PrefetchItem
+  {
+    int mip, x, y;
+    float time; // when the cluster enters the window
+  };
+
+  int prefetchLimit;
+  // the lists of a Prefetch call are reserved by StartStreaming, every cluster gets in once
+  xArray<PrefetchItem> prefetchItems;
+  xArray<int> prefetchStamps; // Prefetch pass the cluster has been collected last, as the cluster table
+  int prefetchStamp;
+
+  static int ComparePrefetchItems(const PrefetchItem * a, const PrefetchItem * b);
+
+  // page table mode: a fixed pool of physical tiles is filled on demand of the feedback
+  struct Page
+  {
+    int mip, x, y;        // mip is -1 while the page is free
+    Cluster * cluster;    // pinned while the page holds it
+    int stamp;            // UpdatePages pass the page has been requested last
+    bool isUploaded;      // the pool texture holds the cluster
+    bool isLocked;        // pages of the coarsest mip are never evicted
+    xLinkList<Page> lruNode;
+
+    Page()
+    {
+      mip = -1;
+      x = y = 0;
+      cluster = NULL;
+      stamp = 0;
+      isUploaded = false;
+      isLocked = false;
+      lruNode.SetOwner(this);
+    }
+  };
+
+  Page * pages;
+  int pagePoolSize;       // pages per side of the pool texture
+  int pagesNumber;
+  xArray<int> pageTable;  // page of every archive cluster or -1, indexed as the cluster table
+  xArray<int> pageStamps; // UpdatePages pass the cluster has been requested last
+  xArray<int> dirtyPages; // ready pages waiting to be uploaded
+  xArray<FeedbackTile> missingPages; // of an UpdatePages call, reserved by InitPages
+  xLinkList<Page> pageLRU; // the most recently requested go first, locked pages aren't in the list
+  int pageStamp;
+  int pageLoadLimit;
+
+  static int CompareFeedbackTiles(const FeedbackTile * a, const FeedbackTile * b);
+  int PageTableIndex(int mip, int x, int y) const;
+  void LoadPage(Page * page, int mip, int x, int y);
+  void FreePage(Page * page);
+
+  // all resident clusters of all layers, unpinned ones are kept in LRU order
+  xHashTable<ClusterKey, Cluster*> cache;
+  xLinkList<Cluster> cacheLRU; // the most recently used go first
+  uint32 cacheBudget;
+  uint32 cacheBytes;
+  int cacheStamp;
+  CacheStats cacheStats;
+
+  StreamStats frameStats;  // the frame in progress
+  StreamStats totalStats;  // all the finished frames
+  xArray<StreamStats> statsHistory; // ring of the last finished frames
+  int statsFrames;
+
+  MipStats& FrameMipStats(int mip){ return frameStats.mips[Min(mip, (int)STATS_MIPS - 1)]; }
+  void AddResidentTime(double seconds);
+  static void WriteStatsCSV(FILE * f, const StreamStats& stats, int mipsNumber);
+  static void WriteStatsJSON(FILE * f, const StreamStats& stats, int mipsNumber);
+
+  uint32 ClusterBytes() const { return planeOffsets[planesNumber]; }
+  Cluster * FindCachedCluster(int mip, int x, int y);
+  Cluster * AcquireCluster(int mip, int x, int y, bool pin, bool canGrow = true, float delay = 0);
+  void ReleaseCluster(Cluster * cluster);
+  void EvictCluster(Cluster * cluster);
+  void TrimCache(uint32 budget);
+  void ClearCache();
+  void DeleteCluster(Cluster * cluster);
+  static int DeleteClusterProc(const ClusterKey& key, Cluster *& cluster, void * params);
+
+  enum
+  {
+    IMAGE_ALIGN = 64,      // cache line, SIMD loads of a cluster row start aligned
+    IMAGE_SLAB_GROW = 16,  // images of a slab added when the pool runs out
+    RECORD_SLAB_GROW = 64  // clusters and requests of a slab added when their lists run out
+  };
+
+  struct ImageSlab
+  {
+    byte * memory; // VirtualAlloc, page aligned
+    int imagesNumber;
+  };
+
+  // cluster images and temporary payloads are fixed size blocks of big slabs, so streaming
+  // doesn't touch the heap; the pool is used by the main thread only
+  xArray<ImageSlab> imageSlabs;
+  byte * freeImages;   // free list, the link is stored in the image
+  uint32 imageStride;  // ClusterBytes rounded up to IMAGE_ALIGN
+  int imagesNumber;
+  int freeImagesNumber;
+
+  // cache clusters and stream requests come from slabs too, as many as the budget has clusters
+  xArray<Cluster*> clusterSlabs;
+  xArray<StreamRequest*> requestSlabs;
+  Cluster * freeClusters;
+  StreamRequest * freeRequests;
+  int recordsNumber;   // clusters and requests of the slabs, the same number of both
+  int freeClustersNumber;
+  int freeRequestsNumber;
+
+  void InitImagePool();
+  void FreeImagePool();
+  bool ReserveImages(int count);
+  byte * AllocImage();
+  void FreeImage(byte * image);
+  void ReserveRecords(int count);
+  Cluster * AllocCluster();
+  void FreeCluster(Cluster * cluster);
+  StreamRequest * AllocRequest();
+  void FreeRequest(StreamRequest * request);
+
+  static void StreamThreadProc(void * params);
+  void StreamThread(byte * scratch);
+  bool StartStreaming(int threadsNumber);
+  void StopStreaming();
+  void ProcessStreaming();
+  void DetachRequest(Cluster * cluster);
+  void CompleteRequest(StreamRequest * request);
+
+  // the pending heap is guarded by streamMutex
+  float RequestPriority(const StreamRequest * request) const;
+  bool IsStaleRequest(const StreamRequest * request) const;
+  static bool IsRequestBefore(const StreamRequest * a, const StreamRequest * b);
+  void SwapRequests(int i, int j);
+  void SiftRequestUp(int i);
+  void SiftRequestDown(int i);
+  void PushRequest(StreamRequest * request);
+  StreamRequest * PopRequest();
+  void RemoveRequest(StreamRequest * request);
+  bool CancelRequest(StreamRequest * request);
+  void DropRequest(StreamRequest * request);
+
+  bool OpenArchive();
+  void CloseArchive();
+  bool MapArchive();
+  const ClusterHeader * FindArchiveCluster(int mip, int x, int y) const;
+  bool IsClusterValid(const ClusterHeader * cluster) const;
+  static int ClusterCodec(const ClusterHeader * cluster){ return cluster->flags & CLUSTER_CODEC_MASK; }
+  // dst gets ClusterBytes(), it's called by the stream threads too
+  bool DecodeCluster(byte * dst, const byte * src, uint32 size, int codec) const;
+
+  struct CompressJob
+  {
+    const byte * image;
+    int width;
+    int clusterSize; // stored size, the border included
+    int clusterStep; // distance between clusters in the image
+    byte * dst;
+  };
+
+  struct MakeFilter
+  {
+    xArray<int> first;    // the first source pixel of every target one
+    xArray<int> count;    // taps per target pixel
+    xArray<float> weights; // maxTaps weights per target pixel
+    int maxTaps;
+  };
+
+  struct MakeLevel
+  {
+    int width;
+    int height;
+    int pitch;      // the band width rounded up to whole clusters plus the borders
+    int clustersX;
+    int clusterRow; // the next row of clusters to be written
+    int bandFirst;  // the row of band[0], the border rows included
+    int rows;       // rows collected in the band
+    int srcRows;    // rows already passed to the next mip
+    byte * band;    // clusterSize + 2*border rows of pixels, the row of clusters and its borders
+
+    // the band is filtered horizontally into linear rows of the next mip width,
+    // the vertical pass turns them into the band of the next mip
+    MakeFilter filterX;
+    MakeFilter filterY;
+    float * hRows;
+    int hFirst;     // the source row of hRows[0]
+    int hCount;
+    int nextRow;    // the next row of the next mip to be produced
+  };
+
+  struct MakeWrite
+  {
+    FILE * f;
+    const byte * data;
+    uint32 size;
+    bool isOk;
+  };
+
+  struct MakeState
+  {
+    int format;
+    bool isLinear;
+    int clusterSize;
+    int border;
+    uint32 clusterDataSize;
+    int filter;
+    int codec;
+    int tolerance;
+    int threadsNumber;
+    MakeLevel * levels;
+    int levelsNumber;
+    MipHeader * mips;
+    ClusterHeader * clusters;
+    uint64 offset;
+    byte * payloads[2]; // a row of clusters is prepared while the other one is written
+    int payloadNum;
+    byte * coded;       // clusters are coded to their own slots and packed back to the payload
+    xArray<uint32> codedSizes;
+    float * accum;      // linear rows of the vertical pass
+    xThread writer;
+    MakeWrite write;
+  };
+
+  struct EncodeJob
+  {
+    const byte * src;
+    byte * dst;
+    uint32 * sizes;
+    uint32 clusterDataSize;
+    int clusterSize; // stored size, the border included
+    int codec;
+    int tolerance;
+  };
+
+  struct MakeRowsJob
+  {
+    const MakeLevel * level;
+    const MakeLevel * next;
+    float * accum;
+    int border;
+    int firstRow;
+    bool isLinear;
+  };
+
+  static void InitGammaTables();
+  static int MakePlaneCodec(int format, int codec);
+  static bool MakePlane(const xString& filename, const xString& dstPrefix, int clusterSize,
+    int format, int filter, int border, int codec, int tolerance, bool isLinear, int threadsNumber);
+  static bool MergePlanes(const xString& dstPrefix, const xString * planePrefixes,
+    const PlaneHeader * planes, int planesNumber);
+  static float FilterRadius(int filter);
+  static float FilterWeight(int filter, float x);
+  static void InitMakeFilter(MakeFilter& filter, int type, int srcSize, int dstSize);
+
+  static void MakeWriteProc(void * params);
+  static void MakeHorizontalProc(void * params, int i);
+  static void MakeVerticalProc(void * params, int i);
+  static bool MakeEmitClusters(MakeState& state, int levelNum);
+  static bool MakeProcessBand(MakeState& state, int levelNum);
+
+  static void EncodeClusterProc(void * params, int i);
+  static void CompressClusterProc(void * params, int i);
+  static void CompressClusters(byte * dst, const byte * image, int width, int clustersNumber,
+    int clusterSize, int clusterStep, int threadsNumber);
+  static void DecodeBC1Block(byte * dst, int pitch, const byte * block, int pixelBytes);
+
+  static bool ReadArchive(HANDLE f, uint64 offset, void * buf, uint32 size);
+  static bool WriteArchiveTables(FILE * f, const Header& header, const PlaneHeader * planes,
+    const xArray<MipHeader>& mips, const xArray<ClusterHeader>& clusters);
   
   byte * FillErrorCluster(byte * buf);
   byte * LoadMip(byte * buf, int mip, int x, int y);
+  byte * LoadMipTGA(byte * buf, int mip, int x, int y);
+  byte * MapMip(int mip, int x, int y);
+  void LoadCluster(Cluster * cluster, int mip, float delay = 0);
+  const byte * FallbackCluster(int layerNum, int x, int y, int plane);
+
+  enum
+  {
+    MAX_DIRTY_RECTS = 32 // more rects are merged into the whole layer
+  };
+
+  void AddDirtyRect(MipLayer * layer, int x, int y, int width, int height);
+  void AddDirtySlots(MipLayer * layer, int x, int y, int width, int height);
+  int DstClusterOffset(int i, int j, int pitch, int pixelBits) const;
+  bool IsPixelBitsValid(int pixelBits, int plane) const;
+  void CopyCluster(int layerNum, const Cluster * cluster, byte * dst, int pitch, int pixelBits,
+    bool withBorder = false, int plane = 0);
 
   // byte * Cluster(MipLayer * layer, int i, int j);
 
@@ -98,17 +621,119 @@ public:
   xMegaTexture();
   ~xMegaTexture();
 
-  void Init(const xString& p_filename, int p_layersNumber, int p_clusterSize, int p_layerSize);
+  void Init(const xString& p_filename, int p_layersNumber, int p_clusterSize, int p_layerSize,
+    int flags = 0, int threadsNumber = 0);
 
   // void UpdateLayers(int x, int y, int width, int height);
-  void UpdateLayer(int layerNum, int x, int y, int width, int height);
+  // returns true if the layer has dirty rects, i.e. its content has been changed
+  bool UpdateLayer(int layerNum, int x, int y, int width, int height);
+  // pixelBits is 24, 32 or 4 for DXT1 blocks, then pitch is the size of a row of blocks;
+  // BC1 clusters go straight through, other combinations are converted on the fly.
+  // L8 planes are read as 8 or 32 bits, gray with the alpha of 0xff, and only they are read as 8 bits.
+  // fills the whole window, the dirty rects are cleared if it's the layer window
   void GetTexture(int layerNum, int x, int y, int width, int height, 
-    byte * dst, int pitch, int dstWidth, int dstHeight, int pixelBits);
+    byte * dst, int pitch, int dstWidth, int dstHeight, int pixelBits, int plane = 0);
+
+  // the layer buffer is toroidal: the slot (x mod width, y mod height) holds the cluster (x, y),
+  // so a window shift only dirties the entering rows and columns
+  int DirtyRectsNumber(int layerNum) const { return layers[layerNum].dirtyRects.Count(); }
+  const Rect& DirtyRect(int layerNum, int i) const { return layers[layerNum].dirtyRects[i]; }
+  void ClearDirtyRects(int layerNum){ layers[layerNum].dirtyRects.SetCount(0, false); }
+  void InvalidateLayer(int layerNum);
+  // fills the slots of the rect, dst points to the first texel of the rect
+  void GetTextureRect(int layerNum, const Rect& rect, byte * dst, int pitch, int pixelBits, int plane = 0);
+  // fills PaddedClusterSize() square of the cluster (x, y) of the layer window, the border included,
+  // so it can be filtered on its own
+  void GetCluster(int layerNum, int x, int y, byte * dst, int pitch, int pixelBits, int plane = 0);
 
   int ClusterSize() const { return clusterSize; }
+  // clusters are stored with a border of texels copied from the neighbours,
+  // GetTexture and GetTextureRect skip it
+  int ClusterBorder() const { return clusterBorder; }
+  int PaddedClusterSize() const { return clusterSize + 2 * clusterBorder; }
+  int ClusterFormat() const { return clusterFormat; }
+  bool IsCompressed() const { return clusterFormat == FORMAT_BC1; }
+  int PlanesNumber() const { return planesNumber; }
+  int PlaneFormat(int plane) const { return planes[plane].format; }
+  bool IsArchive() const { return archiveFile != INVALID_HANDLE_VALUE; }
+  bool IsMapped() const { return archiveView != NULL; }
+  bool IsStreaming() const { return streamThreadsNumber > 0; }
+
+  // prefetch the clusters the layer windows will need while the camera moves along the path,
+  // positions are measured in mip 0 clusters, times in seconds from now (ascending)
+  void Prefetch(const xVec2 * path, const float * times, int count);
+  // velocity is measured in mip 0 clusters per second
+  void Prefetch(const xVec2& pos, const xVec2& velocity, float time = 0.5f);
+
+  // pending loads are ordered by the mip, the coarser first, then by the screen space error
+  // of the cluster seen from pos (mip 0 clusters) and by its deadline; requests of clusters
+  // which have left the windows and are overdue are cancelled, so they never reach the disk.
+  // time is in seconds, call it every frame before UpdateLayer and Prefetch
+  void SetViewer(const xVec2& pos, float time);
+
+  // max number of clusters requested by one Prefetch call
+  int PrefetchLimit() const { return prefetchLimit; }
+  void SetPrefetchLimit(int value){ prefetchLimit = value; }
+
+  // page table mode, residency follows the tiles really sampled instead of the layer windows.
+  // the pool holds poolSize x poolSize padded clusters (256 at most, the page table keeps
+  // pool positions in bytes), the coarsest mip is loaded up front
+  bool InitPages(int poolSize);
+  void ClearPages();
+  bool IsPaged() const { return pages != NULL; }
+  int PagePoolSize() const { return pagePoolSize; }
+  int MipsNumber() const { return archiveMips.Count(); }
+  int MipWidth(int mip) const { return archiveMips[mip].width; }   // in clusters
+  int MipHeight(int mip) const { return archiveMips[mip].height; }
+  // requests the tiles of the feedback and their coarser parents, tiles not requested
+  // are evicted in LRU order; returns the number of pages waiting to be uploaded
+  int UpdatePages(const FeedbackTile * tiles, int count);
+  int DirtyPagesNumber() const { return dirtyPages.Count(); }
+  // page position in the pool, in pages
+  void DirtyPagePos(int i, int& x, int& y) const;
+  // fills the padded cluster of the dirty page, it's used by the page table since then
+  void GetDirtyPage(int i, byte * dst, int pitch, int pixelBits, int plane = 0);
+  void ClearDirtyPages(){ dirtyPages.SetCount(0, false); }
+  // fills MipWidth x MipHeight dwords: pool x, pool y, resident mip, 0xff,
+  // a missing tile refers to the nearest uploaded parent, 0 if there is none
+  void GetPageTable(int mip, byte * dst, int pitch);
+  // max number of pages loaded by one UpdatePages call
+  int PageLoadLimit() const { return pageLoadLimit; }
+  void SetPageLoadLimit(int value){ pageLoadLimit = value; }
+
+  // the budget limits resident clusters of all layers, clusters in the layer windows are never evicted
+  uint32 CacheBudget() const { return cacheBudget; }
+  void SetCacheBudget(uint32 bytes);
+  CacheStats GetCacheStats() const;
+  void ResetCacheStats();
+
+  // call it once per frame after the layers have been uploaded: the queue depth is sampled,
+  // the frame goes to the totals and to the history
+  void FinishStatsFrame();
+  const StreamStats& FrameStats() const; // the last finished frame
+  const StreamStats& TotalStats() const { return totalStats; }
+  void ResetStats();
+  // writes the history and the totals the same way xHeap::DumpUsage writes the heap state
+  bool DumpStats(const xString& filename, int format = STATS_CSV) const;
+  // seconds of the performance counter
+  static double StatsTime();
+
+  static xString ArchiveFilename(const xString& prefix);
+  static uint32 ClusterDataSize(int format, int clusterSize);
 
-  static bool Make(const xString& filename,
-    const xString& dstPrefix, int clusterSize = 128);
+  // the source is read in bands of cluster rows and all the mips are built in the same pass,
+  // mips are filtered in linear space, sizes are halved and rounded up until the mip fits one cluster,
+  // filtering and BC1 compression run on threadsNumber threads, all processors if it's 0.
+  // every cluster gets border texels of its neighbours on each side, a multiple of 4 for BC1.
+  // clusters are coded by the codec if it makes them smaller, BC1 ones fall back to CODEC_LZ
+  // instead of CODEC_DELTA; tolerance makes CODEC_DELTA near lossless
+  static bool Make(const xString& filename, const xString& dstPrefix, int clusterSize = 128,
+    int format = FORMAT_BGR24, int filter = FILTER_BOX, int border = 0,
+    int codec = xClusterCodec::CODEC_RAW, int tolerance = 0, int threadsNumber = 0);
+  // every plane is made the same way from its own image, then the planes of every cluster are packed
+  // into one payload. a payload is stored raw unless its coded planes are smaller together
+  static bool Make(const PlaneDesc * planes, int planesNumber, const xString& dstPrefix, int clusterSize = 128,
+    int filter = FILTER_BOX, int border = 0, int threadsNumber = 0);
 };
 
 #endif // __X_MEGA_TEXTURE__
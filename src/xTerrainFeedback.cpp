@@ -0,0 +1,345 @@
+#include "xForm.h"
+
+// =================================================================
+// =================================================================
+// =================================================================
+
+xTerrainFeedback::xTerrainFeedback()
+{
+  width = height = 0;
+  tileSize = 0;
+  tilesX = tilesY = 0;
+  bins = NULL;
+}
+
+xTerrainFeedback::~xTerrainFeedback()
+{
+  delete [] bins;
+}
+
+void xTerrainFeedback::Init(int p_width, int p_height, int p_tileSize)
+{
+  ASSERT(p_width > 0 && p_height > 0 && p_tileSize > 0);
+  width = p_width;
+  height = p_height;
+  tileSize = p_tileSize;
+  tilesX = (width + tileSize - 1) / tileSize;
+  tilesY = (height + tileSize - 1) / tileSize;
+
+  // every buffer is allocated here, the tile threads only write to them
+  depths.SetCount(width * height);
+  keys.SetCount(width * height);
+  uniqueKeys.SetCount(tilesX * tilesY * tileSize * tileSize);
+  uniqueCounts.SetCount(tilesX * tilesY);
+  delete [] bins;
+  bins = new xArray<int>[tilesX * tilesY];
+  tiles.SetCount(0, false);
+}
+
+void xTerrainFeedback::AddTriangle(const Vert& v0, const Vert& v1, const Vert& v2, float scaleX, float scaleY)
+{
+  const Vert * verts[] = { &v0, &v1, &v2 };
+  float x[3], y[3], invZ[3];
+  for(int i = 0; i < 3; i++)
+  {
+    const xVec3& p = verts[i]->local;
+    invZ[i] = 1.0f / p.x;
+    x[i] = (0.5f - 0.5f * p.y * scaleX * invZ[i]) * width;
+    y[i] = (0.5f - 0.5f * p.z * scaleY * invZ[i]) * height;
+  }
+  float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+  if(area > -0.0001f && area < 0.0001f)
+  {
+    return;
+  }
+  int minX = Max(0, (int)xMath::Floor(Min(x[0], Min(x[1], x[2]))));
+  int minY = Max(0, (int)xMath::Floor(Min(y[0], Min(y[1], y[2]))));
+  int maxX = Min(width - 1, (int)xMath::Ceil(Max(x[0], Max(x[1], x[2]))));
+  int maxY = Min(height - 1, (int)xMath::Ceil(Max(y[0], Max(y[1], y[2]))));
+  if(minX > maxX || minY > maxY)
+  {
+    return;
+  }
+
+  Triangle& tri = triangles.Alloc();
+  tri.minX = minX;
+  tri.minY = minY;
+  tri.maxX = maxX;
+  tri.maxY = maxY;
+
+  // the edges face inwards whatever the winding is
+  float sign = area > 0 ? 1.0f : -1.0f;
+  for(int i = 0; i < 3; i++)
+  {
+    int j = (i + 1) % 3;
+    tri.edges[i].a = (y[i] - y[j]) * sign;
+    tri.edges[i].b = (x[j] - x[i]) * sign;
+    tri.edges[i].c = (x[i] * y[j] - x[j] * y[i]) * sign;
+  }
+
+  float values[3][3] =
+  {
+    { invZ[0], invZ[1], invZ[2] },
+    { v0.uv.x * invZ[0], v1.uv.x * invZ[1], v2.uv.x * invZ[2] },
+    { v0.uv.y * invZ[0], v1.uv.y * invZ[1], v2.uv.y * invZ[2] },
+  };
+  Plane * planes[] = { &tri.invDepth, &tri.uOverDepth, &tri.vOverDepth };
+  float invArea = 1.0f / area;
+  for(int i = 0; i < 3; i++)
+  {
+    const float * f = values[i];
+    Plane& plane = *planes[i];
+    plane.a = ((f[1] - f[0]) * (y[2] - y[0]) - (f[2] - f[0]) * (y[1] - y[0])) * invArea;
+    plane.b = ((f[2] - f[0]) * (x[1] - x[0]) - (f[1] - f[0]) * (x[2] - x[0])) * invArea;
+    plane.c = f[0] - plane.a * x[0] - plane.b * y[0];
+  }
+
+  int triNum = triangles.Count() - 1;
+  for(int ty = minY / tileSize; ty <= maxY / tileSize; ty++)
+  {
+    for(int tx = minX / tileSize; tx <= maxX / tileSize; tx++)
+    {
+      bins[ty * tilesX + tx].Append(triNum);
+    }
+  }
+}
+
+void xTerrainFeedback::ClipTriangle(const Vert * verts, float nearDist, float scaleX, float scaleY)
+{
+  // the near plane cuts a triangle into a polygon of 4 verts at most
+  Vert clipped[4];
+  int count = 0;
+  for(int i = 0; i < 3; i++)
+  {
+    const Vert& a = verts[i];
+    const Vert& b = verts[(i + 1) % 3];
+    bool isAIn = a.local.x >= nearDist;
+    bool isBIn = b.local.x >= nearDist;
+    if(isAIn)
+    {
+      clipped[count++] = a;
+    }
+    if(isAIn != isBIn)
+    {
+      float t = (nearDist - a.local.x) / (b.local.x - a.local.x);
+      Vert& v = clipped[count++];
+      v.local = a.local + (b.local - a.local) * t;
+      v.uv = a.uv + (b.uv - a.uv) * t;
+    }
+  }
+  for(int i = 2; i < count; i++)
+  {
+    AddTriangle(clipped[0], clipped[i-1], clipped[i], scaleX, scaleY);
+  }
+}
+
+int xTerrainFeedback::CompareKeys(const void * a, const void * b)
+{
+  // descending, so coarser mips go first
+  dword ka = *(const dword*)a, kb = *(const dword*)b;
+  return ka < kb ? 1 : (ka > kb ? -1 : 0);
+}
+
+void xTerrainFeedback::TileProc(void * params, int i)
+{
+  TileJob * job = (TileJob*)params;
+  job->feedback->RenderTile(i, *job);
+}
+
+void xTerrainFeedback::RenderTile(int tileNum, const TileJob& job)
+{
+  int x0 = (tileNum % tilesX) * tileSize, x1 = Min(x0 + tileSize, width);
+  int y0 = (tileNum / tilesX) * tileSize, y1 = Min(y0 + tileSize, height);
+  int x, y;
+  for(y = y0; y < y1; y++)
+  {
+    for(x = x0; x < x1; x++)
+    {
+      depths[y * width + x] = 0;
+      keys[y * width + x] = EMPTY_KEY;
+    }
+  }
+
+  const xArray<int>& bin = bins[tileNum];
+  for(int i = 0; i < bin.Count(); i++)
+  {
+    const Triangle& tri = triangles[bin[i]];
+    int minX = Max(tri.minX, x0), maxX = Min(tri.maxX, x1 - 1);
+    int minY = Max(tri.minY, y0), maxY = Min(tri.maxY, y1 - 1);
+    for(y = minY; y <= maxY; y++)
+    {
+      float fy = (float)y + 0.5f;
+      for(x = minX; x <= maxX; x++)
+      {
+        float fx = (float)x + 0.5f;
+        if(tri.edges[0].Value(fx, fy) < 0 || tri.edges[1].Value(fx, fy) < 0 || tri.edges[2].Value(fx, fy) < 0)
+        {
+          continue;
+        }
+        float invZ = tri.invDepth.Value(fx, fy);
+        float& depth = depths[y * width + x];
+        if(invZ <= depth)
+        {
+          continue;
+        }
+        depth = invZ;
+
+        // derivatives of u = (u/z) / (1/z) are exact for the perspective
+        float z = 1.0f / invZ;
+        float u = tri.uOverDepth.Value(fx, fy) * z;
+        float v = tri.vOverDepth.Value(fx, fy) * z;
+        float dudx = (tri.uOverDepth.a - u * tri.invDepth.a) * z;
+        float dudy = (tri.uOverDepth.b - u * tri.invDepth.b) * z;
+        float dvdx = (tri.vOverDepth.a - v * tri.invDepth.a) * z;
+        float dvdy = (tri.vOverDepth.b - v * tri.invDepth.b) * z;
+        float rho2 = Max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy) * job.derivScale * job.derivScale;
+        int mip = 0;
+        for(; rho2 >= 4.0f && mip < job.maxMip; mip++)
+        {
+          rho2 *= 0.25f;
+        }
+        int size = job.clusterSize << mip;
+        int tileX = Clamp((int)(u / size), 0, 0x3fff);
+        int tileY = Clamp((int)(v / size), 0, 0x3fff);
+        keys[y * width + x] = ((dword)mip << 28) | ((dword)tileY << 14) | (dword)tileX;
+      }
+    }
+  }
+
+  // the tiles of the screen tile are deduplicated here, so the main thread merges short lists
+  dword * unique = &uniqueKeys[tileNum * tileSize * tileSize];
+  int count = 0;
+  for(y = y0; y < y1; y++)
+  {
+    for(x = x0; x < x1; x++)
+    {
+      dword key = keys[y * width + x];
+      if(key != EMPTY_KEY && (!count || unique[count-1] != key))
+      {
+        unique[count++] = key;
+      }
+    }
+  }
+  qsort(unique, count, sizeof(dword), CompareKeys);
+  int uniqueCount = 0;
+  for(int i = 0; i < count; i++)
+  {
+    if(!uniqueCount || unique[uniqueCount-1] != unique[i])
+    {
+      unique[uniqueCount++] = unique[i];
+    }
+  }
+  uniqueCounts[tileNum] = uniqueCount;
+}
+
+void xTerrainFeedback::Render(const xTerrainVerts& terrain, const xFrustum& frustum, float texelsPerCell,
+  int clusterSize, int mipsNumber, float screenScale, int threadsNumber)
+{
+  ASSERT(width > 0 && height > 0 && mipsNumber > 0 && mipsNumber <= 16);
+  int i;
+  triangles.SetCount(0, false);
+  for(i = 0; i < tilesX * tilesY; i++)
+  {
+    bins[i].SetCount(0, false);
+  }
+
+  const xVec3& origin = frustum.Origin();
+  xMat3 axis = frustum.Axis().Transpose();
+  float nearDist = Max(frustum.NearDistance(), 0.01f);
+  float scaleX = frustum.FarDistance() / frustum.FarLeft();
+  float scaleY = frustum.FarDistance() / frustum.FarUp();
+
+  // the grid is culled by blocks and set up on this thread, screen tiles are rasterized in parallel
+  int cellsX = terrain.XPointsNumber() - 1;
+  int cellsY = terrain.YPointsNumber() - 1;
+  Vert blockVerts[(CULL_BLOCK_SIZE + 1) * (CULL_BLOCK_SIZE + 1)];
+  for(int by = 0; by < cellsY; by += CULL_BLOCK_SIZE)
+  {
+    for(int bx = 0; bx < cellsX; bx += CULL_BLOCK_SIZE)
+    {
+      int sizeX = Min((int)CULL_BLOCK_SIZE, cellsX - bx);
+      int sizeY = Min((int)CULL_BLOCK_SIZE, cellsY - by);
+      // tile height ranges cull first, so paged terrain tiles out of the view aren't loaded
+      xBounds bounds;
+      terrain.Bounds(bx, by, sizeX, sizeY, bounds);
+      if(frustum.CullBounds(bounds))
+      {
+        continue;
+      }
+      bounds.Clear();
+      int x, y;
+      for(y = 0; y <= sizeY; y++)
+      {
+        for(x = 0; x <= sizeX; x++)
+        {
+          bounds.Add(terrain.Vert(bx + x, by + y));
+        }
+      }
+      if(frustum.CullBounds(bounds))
+      {
+        continue;
+      }
+      for(y = 0; y <= sizeY; y++)
+      {
+        for(x = 0; x <= sizeX; x++)
+        {
+          Vert& v = blockVerts[y * (CULL_BLOCK_SIZE + 1) + x];
+          v.local = (terrain.Vert(bx + x, by + y) - origin) * axis;
+          v.uv = xVec2((float)(bx + x), (float)(by + y)) * texelsPerCell;
+        }
+      }
+      for(y = 0; y < sizeY; y++)
+      {
+        for(x = 0; x < sizeX; x++)
+        {
+          const Vert * row0 = blockVerts + y * (CULL_BLOCK_SIZE + 1) + x;
+          const Vert * row1 = row0 + CULL_BLOCK_SIZE + 1;
+          Vert cell[] = { row0[0], row0[1], row1[1], row1[0] };
+          ClipTriangle(cell, nearDist, scaleX, scaleY);
+          cell[1] = cell[2];
+          cell[2] = cell[3];
+          ClipTriangle(cell, nearDist, scaleX, scaleY);
+        }
+      }
+    }
+  }
+
+  TileJob job;
+  job.feedback = this;
+  job.clusterSize = clusterSize;
+  job.maxMip = mipsNumber - 1;
+  job.derivScale = 1.0f / screenScale;
+  if(triangles.Count() < PARALLEL_TRIANGLES)
+  {
+    threadsNumber = 1;
+  }
+  xThread::ParallelFor(TileProc, &job, tilesX * tilesY,
+    threadsNumber > 0 ? threadsNumber : xThread::ProcessorsNumber());
+
+  // the lists of the screen tiles are merged
+  xArray<dword> merged(256);
+  for(i = 0; i < tilesX * tilesY; i++)
+  {
+    const dword * unique = &uniqueKeys[i * tileSize * tileSize];
+    for(int j = 0; j < uniqueCounts[i]; j++)
+    {
+      merged.Append(unique[j]);
+    }
+  }
+  if(merged.Count() > 0)
+  {
+    qsort(merged.Ptr(), merged.Count(), sizeof(dword), CompareKeys);
+  }
+  tiles.SetCount(0, false);
+  for(i = 0; i < merged.Count(); i++)
+  {
+    if(i > 0 && merged[i] == merged[i-1])
+    {
+      continue;
+    }
+    xMegaTexture::FeedbackTile& tile = tiles.Alloc();
+    tile.mip = (int)(merged[i] >> 28);
+    tile.x = (int)(merged[i] & 0x3fff);
+    tile.y = (int)((merged[i] >> 14) & 0x3fff);
+  }
+}
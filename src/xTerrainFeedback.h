@@ -0,0 +1,99 @@
+#ifndef __X_TERRAIN_FEEDBACK_H__
+#define __X_TERRAIN_FEEDBACK_H__
+
+#pragma once
+
+// low resolution software rasterizer of the terrain which finds the megatexture tiles
+// really sampled by the camera, the result feeds xMegaTexture::UpdatePages
+class xTerrainFeedback
+{
+public:
+
+  enum
+  {
+    EMPTY_KEY = 0xffffffff // the pixel doesn't see the terrain
+  };
+
+protected:
+
+  enum
+  {
+    CULL_BLOCK_SIZE = 8,        // grid cells per side of the frustum culling blocks
+    PARALLEL_TRIANGLES = 256    // fewer triangles are rasterized on the calling thread
+  };
+
+  struct Vert
+  {
+    xVec3 local; // x is the depth, y is to the left, z is up
+    xVec2 uv;    // mip 0 texels
+  };
+
+  // attributes are planes in the screen space, a * x + b * y + c
+  struct Plane
+  {
+    float a, b, c;
+
+    float Value(float x, float y) const { return a * x + b * y + c; }
+  };
+
+  struct Triangle
+  {
+    Plane edges[3];   // positive inside
+    Plane invDepth;   // 1/z, the depth test compares it
+    Plane uOverDepth; // u/z and v/z are linear in the screen space
+    Plane vOverDepth;
+    int minX, minY, maxX, maxY; // pixels
+  };
+
+  struct TileJob
+  {
+    xTerrainFeedback * feedback;
+    int clusterSize;
+    int maxMip;
+    float derivScale; // feedback pixels to screen pixels
+  };
+
+  int width, height;
+  int tileSize;
+  int tilesX, tilesY;
+
+  xArray<float> depths;        // 1/z of every pixel, 0 is the far end
+  xArray<dword> keys;          // mip, tile x and tile y of every pixel
+  xArray<dword> uniqueKeys;    // tiles of every screen tile, sorted and unique
+  xArray<int> uniqueCounts;
+  xArray<Triangle> triangles;
+  xArray<int> * bins;          // triangles overlapping every screen tile
+  xArray<xMegaTexture::FeedbackTile> tiles;
+
+  void AddTriangle(const Vert& a, const Vert& b, const Vert& c, float scaleX, float scaleY);
+  void ClipTriangle(const Vert * verts, float nearDist, float scaleX, float scaleY);
+  void RenderTile(int tileNum, const TileJob& job);
+
+  static void TileProc(void * params, int i);
+  static int CompareKeys(const void * a, const void * b);
+
+public:
+
+  xTerrainFeedback();
+  ~xTerrainFeedback();
+
+  // the buffer is usually 1/8 of the back buffer, screen tiles are rendered by different threads
+  void Init(int width, int height, int tileSize = 16);
+  int Width() const { return width; }
+  int Height() const { return height; }
+
+  // texelsPerCell is the number of megatexture texels covering a grid cell,
+  // screenScale is the back buffer size over the buffer one, so mips are chosen for the real screen;
+  // threadsNumber is all processors if it's 0
+  void Render(const xTerrainVerts& terrain, const xFrustum& frustum, float texelsPerCell,
+    int clusterSize, int mipsNumber, float screenScale, int threadsNumber = 0);
+
+  // deduplicated tiles seen by the last Render, coarser mips go first
+  int TilesNumber() const { return tiles.Count(); }
+  const xMegaTexture::FeedbackTile * Tiles() const { return tiles.Ptr(); }
+
+  // the per pixel result, EMPTY_KEY or mip << 28 | y << 14 | x
+  const dword * Keys() const { return keys.Ptr(); }
+};
+
+#endif // __X_TERRAIN_FEEDBACK_H__
@@ -24,11 +24,20 @@ xFormApp::xFormApp(const xString& cmdLine)
   isShowMips = false;
   isShowMipsKeyLastPressed = false;
 
+  cameraTrace = NULL;
+  pagePoolSize = 0;
+  pageTexture = NULL;
+  pagesUploaded = 0;
+
   ParseCmdLine(cmdLine);
 }
 
 xFormApp::~xFormApp()
 {
+  if(cameraTrace)
+  {
+    fclose(cameraTrace);
+  }
   delete consoleFont;
   delete subFont;
 }
@@ -180,6 +189,7 @@ HRESULT xFormApp::ConfirmDevice(D3DCAPS9* pCaps, DWORD dwBehavior,
 HRESULT xFormApp::OneTimeSceneInit()
 {
   consoleTextList.Add(_T("OneTimeSceneInit"), D3DCOLOR_ARGB(255,255,200,200));
+  xSIMD::InitProcessor(_T("xForm"), false);
   InitInput();
   InitSound();
 
@@ -189,7 +199,7 @@ HRESULT xFormApp::OneTimeSceneInit()
   if(i < 0)
   {
     FILE * f;
-    errno_t err = _tfopen_s(&f, _T("../textures/mega-8192/mega-6-128-0x0.tga"), _T("rb"));
+    errno_t err = _tfopen_s(&f, xMegaTexture::ArchiveFilename(_T("../textures/mega-8192/mega")).ToChar(), _T("rb"));
     if(err != 0)
     {
       cmdLineSubs.Clear();
@@ -208,7 +218,40 @@ HRESULT xFormApp::OneTimeSceneInit()
     megaFilename = ChangeFilenameExt(srcFilename, _T(""));
     CreateDirectory(megaFilename, NULL);
     megaFilename = megaFilename + _T("/mega");
-    xMegaTexture::Make(srcFilename, megaFilename);
+    int format = FindCmdLine(_T("-bc1")) >= 0 ? xMegaTexture::FORMAT_BC1 : xMegaTexture::FORMAT_BGR24;
+    int filter = xMegaTexture::FILTER_BOX;
+    if((i = FindCmdLine(_T("-filter"))) >= 0)
+    {
+      xString filterName = CmdLine(i+1);
+      if(filterName.Icmp(_T("kaiser")) == 0)
+        filter = xMegaTexture::FILTER_KAISER;
+      else if(filterName.Icmp(_T("lanczos")) == 0)
+        filter = xMegaTexture::FILTER_LANCZOS;
+    }
+    int border = 0;
+    if((i = FindCmdLine(_T("-border"))) >= 0)
+    {
+      border = _ttoi(CmdLine(i+1).ToChar());
+      if(format == xMegaTexture::FORMAT_BC1)
+      {
+        border = (border + 3) & ~3; // whole blocks
+      }
+    }
+    int codec = xClusterCodec::CODEC_RAW;
+    if((i = FindCmdLine(_T("-codec"))) >= 0)
+    {
+      xString codecName = CmdLine(i+1);
+      if(codecName.Icmp(_T("lz")) == 0)
+        codec = xClusterCodec::CODEC_LZ;
+      else if(codecName.Icmp(_T("delta")) == 0)
+        codec = xClusterCodec::CODEC_DELTA;
+    }
+    int tolerance = 0;
+    if((i = FindCmdLine(_T("-tolerance"))) >= 0)
+    {
+      tolerance = Min(Max(_ttoi(CmdLine(i+1).ToChar()), 0), 255);
+    }
+    xMegaTexture::Make(srcFilename, megaFilename, 128, format, filter, border, codec, tolerance);
   }
 
   if(megaFilename.IsEmpty())
@@ -223,8 +266,27 @@ HRESULT xFormApp::OneTimeSceneInit()
 
   if(!megaFilename.IsEmpty())
   {
-    megaTexture.Init(megaFilename, 7, 128, -1); // (int)(TERRAIN_MIP0_RADIUS / TERRAIN_GRID));
+    int megaFlags = 0;
+    if(FindCmdLine(_T("-mapped")) >= 0)
+      megaFlags |= xMegaTexture::INIT_MAPPED;
+    if(FindCmdLine(_T("-sync")) < 0)
+      megaFlags |= xMegaTexture::INIT_ASYNC;
+    megaTexture.Init(megaFilename, 7, 128, -1, megaFlags); // (int)(TERRAIN_MIP0_RADIUS / TERRAIN_GRID));
     // megaTexture.UpdateLayers(7, 3, 4, 4);
+    // the layer windows still draw the terrain, the pages follow the feedback next to them
+    if((i = FindCmdLine(_T("-pages"))) >= 0)
+    {
+      pagePoolSize = Min(Max(_ttoi(CmdLine(i+1).ToChar()), 1), 256);
+    }
+  }
+
+  if((i = FindCmdLine(_T("-record"))) >= 0 && !cameraTrace)
+  {
+    _tfopen_s(&cameraTrace, CmdLine(i+1).ToChar(), _T("wt"));
+  }
+  if((i = FindCmdLine(_T("-stats"))) >= 0)
+  {
+    statsFilename = CmdLine(i+1);
   }
 
   lightVec = xAngles(40.0f, 40.0f, 0.0f).ToForward();
@@ -239,19 +301,23 @@ HRESULT xFormApp::InitDeviceObjects()
   subFont->InitDeviceObjects(m_pd3dDevice);
 
   terrainVerts.Init(xVec2(TERRAIN_SIZE, TERRAIN_SIZE), xVec2(TERRAIN_GRID, TERRAIN_GRID));
-  terrainVerts.CreateHill(xVec2(0,0), TERRAIN_SIZE * 0.2f, TERRAIN_MAX_HEIGHT * 0.7f, TERRAIN_SIZE * 0.32f, true);
+  // all hills are stamped in one pass
+  xTerrainVerts::Stamp hills[7];
+  hills[0] = xTerrainVerts::Stamp::Hill(xVec2(0,0), TERRAIN_SIZE * 0.2f, TERRAIN_MAX_HEIGHT * 0.7f, TERRAIN_SIZE * 0.32f, true);
   
   xRandom r = xRandom(12345);
-  for(int i = 0; i < 6; i++)
+  for(int i = 1; i < 7; i++)
   {
-    terrainVerts.CreateHill(
+    hills[i] = xTerrainVerts::Stamp::Hill(
       xVec2(TERRAIN_SIZE * 0.4f * r.CRandomFloat(), TERRAIN_SIZE * 0.4f * r.CRandomFloat()), 
       TERRAIN_SIZE * 0.4f * (0.5f + r.RandomFloat() * 0.5f), 
       TERRAIN_MAX_HEIGHT * (0.2f + r.RandomFloat() * 0.8f), 
       true);
   }
+  terrainVerts.ApplyStamps(hills, 7);
 
   terrainVerts.Smooth(1);
+  terrainVerts.Quantize();
 
   return S_OK;
 }
@@ -374,6 +440,11 @@ void xFormApp::CreateMesh(xMesh& out, int colorNum, int x, int y, int dx, int dy
   MEMCPY(indicesPtr, indices.Ptr(), sizeof(word) * indices.Count());
   out.UnlockIndices();
 
+  // heights of the whole rect are decoded at once
+  xArray<float> heights;
+  heights.SetCount(dx * dy, true);
+  terrainVerts.HeightsRect(x, y, dx, dy, heights.Ptr(), dx);
+
   xMesh::Vert * vert = out.LockVerts();
   ASSERT(vert);
 
@@ -383,11 +454,13 @@ void xFormApp::CreateMesh(xMesh& out, int colorNum, int x, int y, int dx, int dy
   for(int i = 0; i < srcKeys.Count(); i++, vert++)
   {
     const VertKey& k = srcKeys[i];
-    vert->pos = terrainVerts.Vert(k.x, k.y);
+    xVec2 pos = terrainVerts.Pos(k.x, k.y);
+    vert->pos = xVec3(pos.x, pos.y, heights[(k.y - y) * dx + (k.x - x)]);
     vert->normal = vec3_up; // TerrainNormal(i, j);
 
     vert->SetColor(color);
-    vert->st[0] = xVec2((float)(k.x - x) * overSizeX, (float)(k.y - y) * overSizeY);
+    // the mip texture is addressed toroidally like the megatexture layer, see UpdateTerrainMipCache
+    vert->st[0] = xVec2((float)k.x * overSizeX, (float)k.y * overSizeY);
   }
   out.UnlockVerts();
 }
@@ -423,6 +496,7 @@ HRESULT xFormApp::DeleteDeviceObjects()
 {
   textures.ForEach(DeleteTexture, this);
   textures.Clear();
+  SAFE_RELEASE(pageTexture); // the managed texture survives resets
 
   consoleTextList.Add(_T("DeleteDeviceObjects"), D3DCOLOR_ARGB(255,255,200,200));
   consoleFont->DeleteDeviceObjects();
@@ -439,6 +513,13 @@ HRESULT xFormApp::FinalCleanup()
   // ShutdownInput();
   SAFE_DELETE(consoleFont);
   SAFE_DELETE(subFont);
+  if(!statsFilename.IsEmpty())
+  {
+    int len = statsFilename.Len();
+    bool isJson = len > 5 && lstrcmpi(statsFilename.ToChar() + len - 5, _T(".json")) == 0;
+    megaTexture.DumpStats(statsFilename, isJson ? xMegaTexture::STATS_JSON : xMegaTexture::STATS_CSV);
+  }
+  xThread::FreePool();
   return S_OK;
 }
 
@@ -496,8 +577,8 @@ void xFormApp::ResetRenderStates()
   m_pd3dDevice->SetSamplerState( 0, D3DSAMP_MAGFILTER, D3DTEXF_LINEAR );
   m_pd3dDevice->SetSamplerState( 0, D3DSAMP_MIPFILTER, D3DTEXF_LINEAR );
 
-  m_pd3dDevice->SetSamplerState( 0, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP );
-  m_pd3dDevice->SetSamplerState( 0, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP );
+  m_pd3dDevice->SetSamplerState( 0, D3DSAMP_ADDRESSU, D3DTADDRESS_WRAP );
+  m_pd3dDevice->SetSamplerState( 0, D3DSAMP_ADDRESSV, D3DTADDRESS_WRAP );
 
   {
     // Set default values for all dx render states.
@@ -795,6 +876,11 @@ void xFormApp::UpdateTerrainMipCache(int mip, float idealRadius)
       mipCache.terrainSizeX, mipCache.terrainSizeY,
       clipX, clipY, clipSizeX, clipSizeY);
 
+    mipCache.layerX = ax;
+    mipCache.layerY = ay;
+    mipCache.layerWidth = dx;
+    mipCache.layerHeight = dy;
+
     HRESULT hr;
 
     int textureWidth = megaTexture.ClusterSize() * dx;
@@ -809,7 +895,7 @@ void xFormApp::UpdateTerrainMipCache(int mip, float idealRadius)
           mipCache.textureHeight = textureHeight,
           1, // levels
           0, // D3DUSAGE_DYNAMIC, // usage
-          D3DFMT_A8R8G8B8, // format
+          megaTexture.IsCompressed() ? D3DFMT_DXT1 : D3DFMT_A8R8G8B8, // format
           D3DPOOL_MANAGED,
           &mipCache.texture,
           NULL
@@ -821,21 +907,91 @@ void xFormApp::UpdateTerrainMipCache(int mip, float idealRadius)
     {
       // volatile int i = 0;
     }
+    mipCache.isTextureDirty = true;
+  }
+
+  if(!mipCache.texture)
+  {
+    return;
+  }
 
-    megaTexture.UpdateLayer(mip, ax, ay, dx, dy);
+  megaTexture.UpdateLayer(mip, mipCache.layerX, mipCache.layerY, mipCache.layerWidth, mipCache.layerHeight);
+  if(mipCache.isTextureDirty)
+  {
+    mipCache.isTextureDirty = false;
+    megaTexture.InvalidateLayer(mip);
+  }
+
+  // the texture slot (x mod width, y mod height) holds the cluster (x, y), so a window shift
+  // and streamed clusters only upload the rects which have been changed
+  int clusterSize = megaTexture.ClusterSize();
+  for(int i = 0; i < megaTexture.DirtyRectsNumber(mip); i++)
+  {
+    const xMegaTexture::Rect& dirty = megaTexture.DirtyRect(mip, i);
+    RECT lockRect = {
+      dirty.x * clusterSize, dirty.y * clusterSize,
+      (dirty.x + dirty.width) * clusterSize, (dirty.y + dirty.height) * clusterSize
+    };
 
     D3DLOCKED_RECT rect;
-    hr = mipCache.texture->LockRect(0, &rect, NULL, D3DLOCK_DISCARD);
+    HRESULT hr = mipCache.texture->LockRect(0, &rect, &lockRect, 0);
     ASSERT(!FAILED(hr));
 
-    megaTexture.GetTexture(mip, ax, ay, dx, dy, (byte*)rect.pBits, rect.Pitch, 
-      textureWidth,
-      textureHeight,
-      32);
+    // DXT1 blocks are copied as is
+    megaTexture.GetTextureRect(mip, dirty, (byte*)rect.pBits, rect.Pitch, megaTexture.IsCompressed() ? 4 : 32);
 
     mipCache.texture->UnlockRect(0);
     // mipCache.texture->GenerateMipSubLevels();
   }
+  megaTexture.ClearDirtyRects(mip);
+}
+
+void xFormApp::UpdateTerrainPages()
+{
+  pagesUploaded = 0;
+  if(!pagePoolSize || !megaTexture.IsArchive())
+  {
+    return;
+  }
+  int pageSize = megaTexture.PaddedClusterSize();
+  if(!pageTexture)
+  {
+    // a new texture gets every resident page again, the clusters are still in the cache
+    if(!megaTexture.InitPages(pagePoolSize))
+    {
+      pagePoolSize = 0; // too small for the coarsest mip
+      return;
+    }
+    int textureSize = pagePoolSize * pageSize;
+    HRESULT hr = m_pd3dDevice->CreateTexture(textureSize, textureSize, 1, 0,
+      megaTexture.IsCompressed() ? D3DFMT_DXT1 : D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &pageTexture, NULL);
+    ASSERT(!FAILED(hr));
+    if(!pageTexture)
+    {
+      return;
+    }
+  }
+  megaTexture.UpdatePages(terrainFeedback.Tiles(), terrainFeedback.TilesNumber());
+
+  for(int i = 0; i < megaTexture.DirtyPagesNumber(); i++)
+  {
+    int x, y;
+    megaTexture.DirtyPagePos(i, x, y);
+    RECT lockRect = { x * pageSize, y * pageSize, (x + 1) * pageSize, (y + 1) * pageSize };
+
+    D3DLOCKED_RECT rect;
+    HRESULT hr = pageTexture->LockRect(0, &rect, &lockRect, 0);
+    ASSERT(!FAILED(hr));
+    megaTexture.GetDirtyPage(i, (byte*)rect.pBits, rect.Pitch, megaTexture.IsCompressed() ? 4 : 32);
+    pageTexture->UnlockRect(0);
+  }
+  pagesUploaded = megaTexture.DirtyPagesNumber();
+  megaTexture.ClearDirtyPages();
+
+  // coarser mips of the table are the same entries shifted, so mip 0 is enough to sample
+  int width = megaTexture.MipWidth(0);
+  pageTable.SetCount(width * megaTexture.MipHeight(0), false);
+  megaTexture.GetPageTable(0, (byte*)pageTable.Ptr(), width * sizeof(dword));
 }
 
 HRESULT xFormApp::FrameMove()
@@ -869,6 +1025,25 @@ HRESULT xFormApp::FrameMove()
         total.allocSize / (1024.0 * 1024.0), total.allocCount - total.freeCount
       ), D3DCOLOR_ARGB(255,255,255,255),
       10);
+
+    xMegaTexture::CacheStats cache = megaTexture.GetCacheStats();
+    consoleTextList.Add(xString::Format(_T("clusters: %d, %.2f of %.2f Mb, hits: %d, misses: %d, evictions: %d, prefetched: %d, cancelled: %d"),
+        cache.clustersNumber, cache.bytes / (1024.0 * 1024.0), cache.budget / (1024.0 * 1024.0),
+        cache.hits, cache.misses, cache.evictions, cache.prefetches, cache.cancels
+      ), D3DCOLOR_ARGB(255,255,255,255),
+      11);
+
+    consoleTextList.Add(xString::Format(_T("feedback: %d tiles seen, %d pages uploaded"),
+        terrainFeedback.TilesNumber(), pagesUploaded),
+      D3DCOLOR_ARGB(255,255,255,255),
+      12);
+
+    const xMegaTexture::StreamStats& stream = megaTexture.FrameStats();
+    consoleTextList.Add(xString::Format(_T("stream: queue %d (max %d), load %.2f ms, decode %.2f ms, convert %.2f ms, texture %.2f ms"),
+        stream.queueDepth, stream.maxQueueDepth, stream.loadTime * 1000.0, stream.decodeTime * 1000.0,
+        stream.convertTime * 1000.0, stream.textureTime * 1000.0
+      ), D3DCOLOR_ARGB(255,255,255,255),
+      13);
   }
 
   if(IsKeyDown(DIK_X))
@@ -980,13 +1155,46 @@ HRESULT xFormApp::FrameMove()
       Max(cameraPosition.origin.z, terrainHeight + TERRAIN_CAMERA_HEIGHT);
   }
 
+  // pending loads are ordered for the new camera position before the windows request more
+  {
+    xVec2 pos = terrainVerts.MapPos(cameraPosition.origin.ToVec2());
+    float time = DXUtil_Timer(TIMER_GETAPPTIME);
+    megaTexture.SetViewer(pos, time);
+    if(cameraTrace)
+    {
+      fprintf(cameraTrace, "%f %f %f\n", time, pos.x, pos.y);
+    }
+  }
+
   for(int i = 0; i < TERRAIN_MIPS_NUMBER; i++)
   {
     UpdateTerrainMipCache(i, TERRAIN_MIP0_RADIUS);
   }
 
+  {
+    // one terrain grid cell is covered by one mip 0 cluster
+    xVec2 pos = terrainVerts.MapPos(cameraPosition.origin.ToVec2());
+    xVec2 nextPos = terrainVerts.MapPos((cameraPosition.origin + cameraPosition.speedVec).ToVec2());
+    megaTexture.Prefetch(pos, nextPos - pos, TERRAIN_PREFETCH_TIME);
+    megaTexture.FinishStatsFrame();
+  }
+
   frustum.SetPosition(cameraPosition.origin, cameraPosition.angles);
 
+  {
+    int feedbackWidth = Max(1, (int)m_d3dsdBackBuffer.Width / TERRAIN_FEEDBACK_SCALE);
+    int feedbackHeight = Max(1, (int)m_d3dsdBackBuffer.Height / TERRAIN_FEEDBACK_SCALE);
+    if(terrainFeedback.Width() != feedbackWidth || terrainFeedback.Height() != feedbackHeight)
+    {
+      terrainFeedback.Init(feedbackWidth, feedbackHeight);
+    }
+    // one terrain grid cell is covered by one mip 0 cluster
+    int clusterSize = megaTexture.ClusterSize();
+    terrainFeedback.Render(terrainVerts, frustum, (float)clusterSize, clusterSize,
+      TERRAIN_MIPS_NUMBER, (float)TERRAIN_FEEDBACK_SCALE);
+    UpdateTerrainPages();
+  }
+
   consoleTextList.Add(xString::Format(_T("org: %.1f %.1f %.1f, angles: %.1f %.1f %.1f, spd: %.1f km/h")
       , 
       cameraPosition.origin.x, cameraPosition.origin.y, cameraPosition.origin.z,
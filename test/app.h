@@ -85,6 +85,8 @@ public:
 #define CAMERA_ROTATE_SPEED     70.0f
 
 #define TERRAIN_MIP0_RADIUS   (TERRAIN_GRID * 6)
+#define TERRAIN_PREFETCH_TIME 0.5f // in sec
+#define TERRAIN_FEEDBACK_SCALE 8    // the feedback buffer is 1/8 of the back buffer
 // #define TERRAIN_MIP0_ACCURATY_SIZE  2
 // #define TERRAIN_MIP0_CACHE_SIZE     4
 
@@ -301,11 +303,17 @@ class xFormApp: public xForm
 
     xMesh mesh;
 
+    int layerX;
+    int layerY;
+    int layerWidth;
+    int layerHeight;
+
     LPDIRECT3DTEXTURE9 texture;
     int textureWidth;
     int textureHeight;
+    bool isTextureDirty;
 
-    MipCache(){ texture = NULL; }
+    MipCache(){ texture = NULL; isTextureDirty = false; }
     ~MipCache()
     {
       ASSERT(!texture);
@@ -320,11 +328,19 @@ class xFormApp: public xForm
   */
 
   void UpdateTerrainMipCache(int mip, float idealRadius);
+  void UpdateTerrainPages();
 
   // xMesh terrainMesh;
   // xMesh terrainSubMesh;
 
   xMegaTexture megaTexture;
+  xTerrainFeedback terrainFeedback; // tiles really seen by the camera
+  int pagePoolSize;                 // -pages n, the page table mode runs next to the layer windows
+  LPDIRECT3DTEXTURE9 pageTexture;   // the pool of pagePoolSize x pagePoolSize pages
+  xArray<dword> pageTable;          // mip 0 entries, what a page table shader reads
+  int pagesUploaded;                // by the last frame
+  FILE * cameraTrace;               // -record file, replayed by the bench
+  xString statsFilename;            // -stats file, the streaming statistics are written on exit
 
   xHashTable<xString, LPDIRECT3DTEXTURE9> textures;
   LPDIRECT3DTEXTURE9 Texture(const xString& name, bool generateMipMaps = true);